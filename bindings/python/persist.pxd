@@ -29,6 +29,7 @@ from librpc cimport Object
 
 
 ctypedef bint (*persist_collection_iter_f)(void *arg, const char *name)
+ctypedef bint (*persist_backup_cb_f)(void *arg, size_t remaining, size_t total)
 
 
 cdef extern from "rpc/object.h":
@@ -37,6 +38,11 @@ cdef extern from "rpc/object.h":
 
     ctypedef rpc_object *rpc_object_t
 
+    rpc_object_t rpc_retain(rpc_object_t object)
+
+
+ctypedef bint (*persist_scan_cb_f)(void *arg, rpc_object_t obj)
+
 
 cdef extern from "persist.h" nogil:
     cdef struct persist_db:
@@ -48,6 +54,12 @@ cdef extern from "persist.h" nogil:
     cdef struct persist_iter:
         pass
 
+    cdef struct persist_lazy:
+        pass
+
+    cdef struct persist_snapshot:
+        pass
+
     cdef struct persist_query_params:
         bint single
         bint count
@@ -55,17 +67,41 @@ cdef extern from "persist.h" nogil:
         const char *sort_field
         uint64_t offset
         uint64_t limit
+        size_t prefetch
+        size_t decode_threads
+
+    cdef struct persist_raw:
+        const char *format
+        const void *data
+        size_t len
+
+    ctypedef enum persist_index_type_t:
+        PERSIST_INDEX_VALUE
+        PERSIST_INDEX_FULLTEXT
+        PERSIST_INDEX_ARRAY
+
+    ctypedef enum persist_durability_t:
+        PERSIST_DURABILITY_DEFAULT
+        PERSIST_DURABILITY_FULL
+        PERSIST_DURABILITY_NORMAL
+        PERSIST_DURABILITY_OFF
 
     ctypedef persist_db *persist_db_t
     ctypedef persist_collection *persist_collection_t
     ctypedef persist_iter *persist_iter_t
+    ctypedef persist_lazy *persist_lazy_t
+    ctypedef persist_snapshot *persist_snapshot_t
     ctypedef persist_query_params *persist_query_params_t
 
     void *PERSIST_COLLECTION_ITER(persist_collection_iter_f fn, void *arg)
+    void *PERSIST_SCAN_CB(persist_scan_cb_f fn, void *arg)
+    void *PERSIST_BACKUP_CB(persist_backup_cb_f fn, void *arg)
 
     persist_db_t persist_open(const char *path, const char *driver,
         rpc_object_t params)
     void persist_close(persist_db_t db)
+    rpc_object_t persist_get_stats(persist_db_t db)
+    int persist_backup(persist_db_t db, const char *path, void *progress)
     persist_collection_t persist_collection_get(persist_db_t db,
         const char *name, bint create)
     bint persist_collection_exists(persist_db_t db, const char *name)
@@ -76,16 +112,52 @@ cdef extern from "persist.h" nogil:
         rpc_object_t metadata)
     void persist_collections_apply(persist_db_t db, void *applier)
     rpc_object_t persist_get(persist_collection_t col, const char *id)
+    int persist_get_raw(persist_collection_t col, const char *id,
+        persist_raw *raw)
+    rpc_object_t persist_get_field(persist_collection_t col, const char *id,
+        const char *path)
+    bint persist_exists(persist_collection_t col, const char *id)
+    int persist_add_index_ex(persist_collection_t col, const char *name,
+        const char *path, persist_index_type_t type)
+    int persist_drop_index(persist_collection_t col, const char *name)
+    int persist_query_parallel(persist_collection_t col, rpc_object_t filter,
+        persist_query_params_t params, size_t nthreads, void *cb)
     ssize_t persist_count(persist_collection_t col, rpc_object_t rules)
+    rpc_object_t persist_aggregate(persist_collection_t col, rpc_object_t rules,
+        rpc_object_t group_by, rpc_object_t aggregates)
+    rpc_object_t persist_distinct(persist_collection_t col, const char *path,
+        rpc_object_t rules, uint64_t limit)
     persist_iter_t persist_query(persist_collection_t col, rpc_object_t rules,
         persist_query_params_t params)
     int persist_save(persist_collection_t col, rpc_object_t obj)
     int persist_save_many(persist_collection_t col, rpc_object_t obj)
     int persist_delete(persist_collection_t col, const char *id)
     int persist_get_last_error(char **msgp)
+    int persist_start_transaction(persist_db_t db)
+    int persist_start_transaction_ex(persist_db_t db,
+        persist_durability_t durability)
+    int persist_commit_transaction(persist_db_t db)
+    int persist_rollback_transaction(persist_db_t db)
+    bint persist_transaction_active(persist_db_t db)
     void persist_collection_close(persist_collection_t collection)
+    void persist_collection_set_cache_size(persist_collection_t col,
+        size_t size)
     void persist_iter_close(persist_iter_t iter)
     int persist_iter_next(persist_iter_t iter, rpc_object_t *result)
+    int persist_iter_next_raw(persist_iter_t iter, const char **idp,
+        persist_raw *raw)
+    int persist_iter_next_lazy(persist_iter_t iter, const char **idp,
+        persist_lazy_t *result)
+    rpc_object_t persist_lazy_get(persist_lazy_t lazy, const char *path)
+    persist_snapshot_t persist_snapshot_open(persist_db_t db)
+    void persist_snapshot_close(persist_snapshot_t snap)
+    rpc_object_t persist_snapshot_get(persist_snapshot_t snap,
+        persist_collection_t col, const char *id)
+    persist_iter_t persist_snapshot_query(persist_snapshot_t snap,
+        persist_collection_t col, rpc_object_t filter,
+        persist_query_params_t params)
+    ssize_t persist_snapshot_count(persist_snapshot_t snap,
+        persist_collection_t col, rpc_object_t filter)
 
 
 cdef class Database(object):
@@ -94,12 +166,22 @@ cdef class Database(object):
     cdef object driver
     cdef Object params
     cdef object collections
+    cdef object snapshots
 
     @staticmethod
     cdef bint c_apply_callback(void *arg, const char *name)
+    @staticmethod
+    cdef bint c_backup_callback(void *arg, size_t remaining,
+        size_t total) with gil
     cdef persist_db_t unwrap(self) nogil
 
 
+cdef class Snapshot(object):
+    cdef persist_snapshot_t snapshot
+    cdef object parent
+    cdef object queries
+
+
 cdef class Collection(object):
     cdef persist_collection_t collection
     cdef object parent
@@ -108,12 +190,17 @@ cdef class Collection(object):
     @staticmethod
     cdef Collection wrap(object parent, persist_collection_t ptr)
     cdef persist_collection_t unwrap(self) nogil
+    @staticmethod
+    cdef bint c_scan_callback(void *arg, rpc_object_t obj) with gil
 
 
 cdef class CollectionIterator(object):
     cdef persist_iter_t iter
     cdef object cnt
     cdef object parent
+    cdef object raw
+    cdef object fields
 
     @staticmethod
-    cdef CollectionIterator wrap(object parent, persist_iter_t iter)
+    cdef CollectionIterator wrap(object parent, persist_iter_t iter,
+        object raw=*, object fields=*)
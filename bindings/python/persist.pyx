@@ -31,6 +31,20 @@ cimport persist
 
 logger = logging.getLogger(__name__)
 
+INDEX_TYPES = {
+    'value': PERSIST_INDEX_VALUE,
+    'fulltext': PERSIST_INDEX_FULLTEXT,
+    'array': PERSIST_INDEX_ARRAY
+}
+
+DURABILITY_LEVELS = {
+    None: PERSIST_DURABILITY_DEFAULT,
+    'full': PERSIST_DURABILITY_FULL,
+    'normal': PERSIST_DURABILITY_NORMAL,
+    'off': PERSIST_DURABILITY_OFF
+}
+
+
 class PersistException(RuntimeError):
     def __init__(self, code, message):
         super().__init__(message)
@@ -51,6 +65,7 @@ cdef class Database(object):
         self.driver = driver
         self.params = rpc_params
         self.collections = []
+        self.snapshots = []
 
     def __dealloc__(self):
         if self.db != <persist_db_t>NULL:
@@ -70,6 +85,10 @@ cdef class Database(object):
 
     def close(self):
         if self.db != <persist_db_t>NULL:
+            # Closing a snapshot removes it from the list
+            for snap in list(self.snapshots):
+                snap.close()
+
             # Close our collections
             for col in self.collections:
                 col.close()
@@ -88,6 +107,91 @@ cdef class Database(object):
         def __get__(self):
             return self.db != <persist_db_t>NULL
 
+    def start_transaction(self, durability=None):
+        if self.db == <persist_db_t>NULL:
+            raise ValueError('Database is closed')
+
+        if durability not in DURABILITY_LEVELS:
+            raise ValueError('Invalid durability level')
+
+        if persist_start_transaction_ex(
+            self.db,
+            DURABILITY_LEVELS[durability]
+        ) != 0:
+            check_last_error()
+
+    def commit_transaction(self):
+        if self.db == <persist_db_t>NULL:
+            raise ValueError('Database is closed')
+
+        if persist_commit_transaction(self.db) != 0:
+            check_last_error()
+
+    def rollback_transaction(self):
+        if self.db == <persist_db_t>NULL:
+            raise ValueError('Database is closed')
+
+        if persist_rollback_transaction(self.db) != 0:
+            check_last_error()
+
+    property transaction_active:
+        def __get__(self):
+            if self.db == <persist_db_t>NULL:
+                return False
+
+            return persist_transaction_active(self.db)
+
+    def snapshot(self):
+        cdef persist_snapshot_t snap
+        cdef Snapshot ret
+
+        if self.db == <persist_db_t>NULL:
+            raise ValueError('Database is closed')
+
+        snap = persist_snapshot_open(self.db)
+        if snap == <persist_snapshot_t>NULL:
+            check_last_error()
+
+        ret = Snapshot.__new__(Snapshot)
+        ret.snapshot = snap
+        ret.parent = self
+        ret.queries = []
+        self.snapshots.append(ret)
+
+        return ret
+
+    def get_stats(self):
+        if self.db == <persist_db_t>NULL:
+            raise ValueError('Database is closed')
+
+        return Object.wrap(persist_get_stats(self.db)).unpack()
+
+    def backup(self, path, progress=None):
+        cdef const char *c_path
+        cdef int ret
+
+        if self.db == <persist_db_t>NULL:
+            raise ValueError('Database is closed')
+
+        if not isinstance(path, str):
+            raise TypeError('Path needs to be a string')
+
+        b_path = path.encode('utf-8')
+        c_path = b_path
+
+        with nogil:
+            ret = persist_backup(
+                self.db,
+                c_path,
+                PERSIST_BACKUP_CB(
+                    <persist_backup_cb_f>Database.c_backup_callback,
+                    <void *>progress
+                )
+            )
+
+        if ret != 0:
+            check_last_error()
+
     def collection_exists(self, name):
         if self.db == <persist_db_t>NULL:
             raise ValueError('Database is closed')
@@ -193,6 +297,94 @@ cdef class Database(object):
         cdef object cb = <object>arg
         cb(name)
 
+    @staticmethod
+    cdef bint c_backup_callback(void *arg, size_t remaining,
+                                size_t total) with gil:
+        cdef object cb = <object>arg
+        if cb is None:
+            return True
+
+        return cb(remaining, total) is not False
+
+
+cdef class Snapshot(object):
+    def __dealloc__(self):
+        if self.snapshot != <persist_snapshot_t>NULL:
+            persist_snapshot_close(self.snapshot)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    property is_open:
+        def __get__(self):
+            return self.snapshot != <persist_snapshot_t>NULL
+
+    def close(self):
+        if self.snapshot != <persist_snapshot_t>NULL:
+            for q in self.queries:
+                q.close()
+
+            persist_snapshot_close(self.snapshot)
+            self.snapshot = <persist_snapshot_t>NULL
+            self.parent.snapshots.remove(self)
+
+    def get(self, Collection col, id, default=None):
+        cdef rpc_object_t ret
+
+        if not self.is_open:
+            raise ValueError('Snapshot is closed')
+
+        ret = persist_snapshot_get(self.snapshot, col.collection,
+                                   id.encode('utf-8'))
+        if ret == <rpc_object_t>NULL:
+            return default
+
+        return Object.wrap(ret).unpack()
+
+    def query(self, Collection col, rules=[], sort=None, descending=False):
+        cdef persist_iter_t iter
+        cdef persist_query_params params
+        cdef Object rpc_rules = Object(rules)
+
+        if not self.is_open:
+            raise ValueError('Snapshot is closed')
+
+        memset(&params, 0, sizeof(params))
+
+        if sort is not None:
+            b_sort = sort.encode('utf-8')
+            params.sort_field = b_sort
+
+        if descending:
+            params.descending = True
+
+        iter = persist_snapshot_query(self.snapshot, col.collection,
+                                      rpc_rules.unwrap(), &params)
+        if iter == <persist_iter_t>NULL:
+            check_last_error()
+
+        citer = CollectionIterator.wrap(self, iter)
+        self.queries.append(citer)
+
+        return citer
+
+    def count(self, Collection col, rules=[]):
+        cdef ssize_t result
+        cdef Object rpc_rules = Object(rules)
+
+        if not self.is_open:
+            raise ValueError('Snapshot is closed')
+
+        result = persist_snapshot_count(self.snapshot, col.collection,
+                                        rpc_rules.unwrap())
+        if result == -1:
+            check_last_error()
+
+        return result
+
 
 cdef class Collection(object):
     def __dealloc__(self):
@@ -233,6 +425,51 @@ cdef class Collection(object):
 
     def get(self, id, default=None):
         cdef rpc_object_t ret
+        cdef const char *c_id
+
+        if not self.parent.is_open:
+            raise ValueError('Database is closed')
+
+        if not isinstance(id, str):
+            raise TypeError('Id needs to be a string')
+
+        id = id.encode('utf-8')
+        c_id = id
+
+        with nogil:
+            ret = persist_get(self.collection, c_id)
+
+        if ret == <rpc_object_t>NULL:
+            return default
+
+        return Object.wrap(ret).unpack()
+
+    def get_raw(self, id, default=None):
+        cdef persist_raw raw
+        cdef const char *c_id
+        cdef int ret
+
+        if not self.parent.is_open:
+            raise ValueError('Database is closed')
+
+        if not isinstance(id, str):
+            raise TypeError('Id needs to be a string')
+
+        id = id.encode('utf-8')
+        c_id = id
+
+        with nogil:
+            ret = persist_get_raw(self.collection, c_id, &raw)
+
+        if ret != 0:
+            return default
+
+        return (<const char *>raw.data)[:raw.len]
+
+    def get_field(self, id, path, default=None):
+        cdef rpc_object_t ret
+        cdef const char *c_id
+        cdef const char *c_path
 
         if not self.parent.is_open:
             raise ValueError('Database is closed')
@@ -240,13 +477,28 @@ cdef class Collection(object):
         if not isinstance(id, str):
             raise TypeError('Id needs to be a string')
 
-        ret = persist_get(self.collection, id.encode('utf-8'))
+        id = id.encode('utf-8')
+        path = path.encode('utf-8')
+        c_id = id
+        c_path = path
+
+        with nogil:
+            ret = persist_get_field(self.collection, c_id, c_path)
 
         if ret == <rpc_object_t>NULL:
             return default
 
         return Object.wrap(ret).unpack()
 
+    def exists(self, id):
+        if not self.parent.is_open:
+            raise ValueError('Database is closed')
+
+        if not isinstance(id, str):
+            raise TypeError('Id needs to be a string')
+
+        return persist_exists(self.collection, id.encode('utf-8'))
+
     def set(self, value):
         cdef Object rpc_value
         cdef int ret
@@ -281,6 +533,12 @@ cdef class Collection(object):
         if ret != 0:
             check_last_error()
 
+    def set_cache_size(self, size):
+        if not self.parent.is_open:
+            raise ValueError('Database is closed')
+
+        persist_collection_set_cache_size(self.collection, size)
+
     def delete(self, id):
         if not self.parent.is_open:
             raise ValueError('Database is closed')
@@ -290,6 +548,34 @@ cdef class Collection(object):
 
         persist_delete(self.collection, id.encode('utf-8'))
 
+    def add_index(self, name, path, type='value'):
+        if not self.parent.is_open:
+            raise ValueError('Database is closed')
+
+        if not isinstance(name, str) or not isinstance(path, str):
+            raise TypeError('Index name and path need to be strings')
+
+        if type not in INDEX_TYPES:
+            raise ValueError('Invalid index type')
+
+        if persist_add_index_ex(
+            self.collection,
+            name.encode('utf-8'),
+            path.encode('utf-8'),
+            INDEX_TYPES[type]
+        ) != 0:
+            check_last_error()
+
+    def drop_index(self, name):
+        if not self.parent.is_open:
+            raise ValueError('Database is closed')
+
+        if not isinstance(name, str):
+            raise TypeError('Index name needs to be a string')
+
+        if persist_drop_index(self.collection, name.encode('utf-8')) != 0:
+            check_last_error()
+
     def count(self, rules=[]):
         cdef ssize_t result
         cdef Object rpc_rules = Object(rules);
@@ -303,7 +589,59 @@ cdef class Collection(object):
 
         return result
 
-    def query(self, rules=[], sort=None, descending=False, offset=None, limit=None):
+    def aggregate(self, aggregates, rules=[], group_by=None):
+        cdef rpc_object_t result
+        cdef Object rpc_aggregates = Object(aggregates)
+        cdef Object rpc_rules = Object(rules)
+        cdef Object rpc_group_by
+        cdef rpc_object_t raw_aggregates = rpc_aggregates.unwrap()
+        cdef rpc_object_t raw_rules = rpc_rules.unwrap()
+        cdef rpc_object_t raw_group_by = <rpc_object_t>NULL
+
+        if not self.parent.is_open:
+            raise ValueError('Database is closed')
+
+        if group_by is not None:
+            rpc_group_by = Object(group_by)
+            raw_group_by = rpc_group_by.unwrap()
+
+        with nogil:
+            result = persist_aggregate(self.collection, raw_rules,
+                                       raw_group_by, raw_aggregates)
+
+        if result == <rpc_object_t>NULL:
+            check_last_error()
+
+        return Object.wrap(result).unpack()
+
+    def distinct(self, path, rules=[], limit=0):
+        cdef rpc_object_t result
+        cdef Object rpc_rules = Object(rules)
+        cdef rpc_object_t raw_rules = rpc_rules.unwrap()
+        cdef uint64_t c_limit = limit
+        cdef const char *c_path
+
+        if not self.parent.is_open:
+            raise ValueError('Database is closed')
+
+        if not isinstance(path, str):
+            raise TypeError('Path needs to be a string')
+
+        b_path = path.encode('utf-8')
+        c_path = b_path
+
+        with nogil:
+            result = persist_distinct(self.collection, c_path, raw_rules,
+                                      c_limit)
+
+        if result == <rpc_object_t>NULL:
+            check_last_error()
+
+        return Object.wrap(result).unpack()
+
+    def query(self, rules=[], sort=None, descending=False, offset=None,
+              limit=None, raw=False, fields=None, prefetch=0,
+              decode_threads=0):
         cdef persist_iter_t iter
         cdef persist_query_params params
         cdef Object rpc_rules = Object(rules);
@@ -327,17 +665,70 @@ cdef class Collection(object):
         if limit is not None:
             params.limit = limit
 
+        params.prefetch = prefetch
+        params.decode_threads = decode_threads
+
         with nogil:
             iter = persist_query(self.collection, raw_rules, &params)
 
         if iter == <persist_iter_t>NULL:
             check_last_error()
 
-        citer = CollectionIterator.wrap(self, iter)
+        citer = CollectionIterator.wrap(self, iter, raw, fields)
         self.queries.append(citer)
 
         return citer
 
+    def query_parallel(self, rules=[], threads=4, sort=None, descending=False,
+                       offset=None, limit=None):
+        cdef persist_query_params params
+        cdef Object rpc_rules = Object(rules)
+        cdef rpc_object_t raw_rules = rpc_rules.unwrap()
+        cdef size_t nthreads = threads
+        cdef int ret
+
+        if not self.parent.is_open:
+            raise ValueError('Database is closed')
+
+        memset(&params, 0, sizeof(params))
+        results = []
+
+        if sort is not None:
+            b_sort = sort.encode('utf-8')
+            params.sort_field = b_sort
+
+        if descending:
+            params.descending = True
+
+        if offset is not None:
+            params.offset = offset
+
+        if limit is not None:
+            params.limit = limit
+
+        with nogil:
+            ret = persist_query_parallel(
+                self.collection,
+                raw_rules,
+                &params,
+                nthreads,
+                PERSIST_SCAN_CB(
+                    <persist_scan_cb_f>Collection.c_scan_callback,
+                    <void *>results
+                )
+            )
+
+        if ret != 0:
+            check_last_error()
+
+        return results
+
+    @staticmethod
+    cdef bint c_scan_callback(void *arg, rpc_object_t obj) with gil:
+        cdef object results = <object>arg
+        results.append(Object.wrap(rpc_retain(obj)).unpack())
+        return True
+
 
 cdef class CollectionIterator(object):
     def __dealloc__(self):
@@ -349,10 +740,40 @@ cdef class CollectionIterator(object):
 
     def __next__(self):
         cdef rpc_object_t result
+        cdef persist_raw raw
+        cdef persist_lazy_t lazy
+        cdef rpc_object_t value
+        cdef const char *id
 
         if not self.cnt:
             raise StopIteration
 
+        if self.fields is not None:
+            if persist_iter_next_lazy(self.iter, &id, &lazy) != 0:
+                check_last_error()
+
+            if id == NULL:
+                self.cnt = False
+                raise StopIteration
+
+            ret = {'id': id.decode('utf-8')}
+            for f in self.fields:
+                value = persist_lazy_get(lazy, f.encode('utf-8'))
+                if value != <rpc_object_t>NULL:
+                    ret[f] = Object.wrap(value).unpack()
+
+            return ret
+
+        if self.raw:
+            if persist_iter_next_raw(self.iter, &id, &raw) != 0:
+                check_last_error()
+
+            if id == NULL:
+                self.cnt = False
+                raise StopIteration
+
+            return id.decode('utf-8'), (<const char *>raw.data)[:raw.len]
+
         if persist_iter_next(self.iter, &result) != 0:
             check_last_error()
 
@@ -372,13 +793,16 @@ cdef class CollectionIterator(object):
             self.iter = <persist_iter_t>NULL
 
     @staticmethod
-    cdef CollectionIterator wrap(object parent, persist_iter_t iter):
+    cdef CollectionIterator wrap(object parent, persist_iter_t iter,
+                                 object raw=False, object fields=None):
         cdef CollectionIterator ret
 
         ret = CollectionIterator.__new__(CollectionIterator)
         ret.iter = iter
         ret.cnt = True
         ret.parent = parent
+        ret.raw = raw
+        ret.fields = fields
 
         return ret
 
@@ -34,6 +34,9 @@ struct persist_db;
 struct persist_collection;
 struct persist_iter;
 struct persist_query_params;
+struct persist_raw;
+struct persist_lazy;
+struct persist_snapshot;
 
 /**
  * An open database handle.
@@ -55,11 +58,55 @@ typedef struct persist_iter *persist_iter_t;
  */
 typedef struct persist_query_params *persist_query_params_t;
 
+/**
+ * A consistent read-only view of a database.
+ */
+typedef struct persist_snapshot *persist_snapshot_t;
+
+/**
+ * A lazily decoded view of a serialized object.
+ */
+typedef struct persist_lazy *persist_lazy_t;
+
+/**
+ * Index types supported by @ref persist_add_index_ex.
+ */
+typedef enum persist_index_type
+{
+	PERSIST_INDEX_VALUE,		/**< Index on field value */
+	PERSIST_INDEX_FULLTEXT,		/**< Full-text index on string field */
+	PERSIST_INDEX_ARRAY,		/**< Index on elements of array field */
+} persist_index_type_t;
+
+/**
+ * Durability levels, see @ref persist_start_transaction_ex.
+ */
+typedef enum persist_durability
+{
+	PERSIST_DURABILITY_DEFAULT,	/**< Database-wide setting */
+	PERSIST_DURABILITY_FULL,	/**< Sync on every commit */
+	PERSIST_DURABILITY_NORMAL,	/**< Sync on checkpoints only */
+	PERSIST_DURABILITY_OFF,		/**< Never sync */
+} persist_durability_t;
+
 /**
  *
  */
 typedef bool (^persist_collection_iter_t)(const char *_Nonnull name);
 
+/**
+ * Callback invoked with every object returned by a parallel scan.
+ * Returning false stops the scan.
+ */
+typedef bool (^persist_scan_cb_t)(_Nonnull rpc_object_t obj);
+
+/**
+ * Callback invoked after every step of an online backup with the
+ * number of pages left to copy and the total number of pages.
+ * Returning false aborts the backup.
+ */
+typedef bool (^persist_backup_cb_t)(size_t remaining, size_t total);
+
 /**
  * Converts function pointer to a persist_collection_iter_t block type.
  */
@@ -68,6 +115,22 @@ typedef bool (^persist_collection_iter_t)(const char *_Nonnull name);
                 return ((bool)_fn(_arg, _name));	\
         }
 
+/**
+ * Converts function pointer to a persist_scan_cb_t block type.
+ */
+#define	PERSIST_SCAN_CB(_fn, _arg)			\
+	^(rpc_object_t _obj) {				\
+                return ((bool)_fn(_arg, _obj));		\
+        }
+
+/**
+ * Converts function pointer to a persist_backup_cb_t block type.
+ */
+#define	PERSIST_BACKUP_CB(_fn, _arg)			\
+	^(size_t _remaining, size_t _total) {		\
+                return ((bool)_fn(_arg, _remaining, _total));	\
+        }
+
 struct persist_query_params
 {
 	bool				single;
@@ -76,6 +139,22 @@ struct persist_query_params
 	uint64_t			offset;
 	uint64_t			limit;
 	_Nullable rpc_query_cb_t	callback;
+	size_t				prefetch;
+	size_t				decode_threads;
+};
+
+/**
+ * A stored object in its serialized form, as kept by the driver.
+ *
+ * The data is borrowed from the library and stays valid until the next
+ * raw read made by the same thread (or, for iterators, until the next
+ * call on the iterator or its close).
+ */
+struct persist_raw
+{
+	const char *_Nullable		format;	/**< Serializer name */
+	const void *_Nullable		data;	/**< Serialized object */
+	size_t				len;	/**< Length of data */
 };
 
 /**
@@ -83,8 +162,44 @@ struct persist_query_params
  *
  * If the database file doesn't exist, it will get created.
  *
+ * @p params is an optional dictionary of driver settings. The sqlite
+ * driver recognizes:
+ * - "stmt_cache_size": number of collections per thread whose prepared
+ *   statements are kept around (default 64, 0 means unbounded)
+ * - "storage": "tables" keeps every collection in a table of its own,
+ *   "single-table" stores all collections in one shared table, which
+ *   makes having tens of thousands of collections cheap. Full-text
+ *   indexes aren't available in single-table mode. Defaults to the
+ *   mode the database file was created with.
+ * - "durability": "full" syncs the disk on every commit (the default),
+ *   "normal" only on checkpoints, which may lose the most recent
+ *   commits on power loss, but never corrupts the database, "off"
+ *   never syncs, and "periodic" behaves like "normal", but also syncs
+ *   every "durability_interval" milliseconds (default 1000)
+ * - "page_size": database page size in bytes, only honored when the
+ *   database file gets created
+ * - "cache_size": page cache size, in pages if positive or in KiB if
+ *   negative
+ * - "mmap_size": number of bytes of the database file accessed through
+ *   memory mapping (0 disables it)
+ * - "temp_store": where temporary tables and indexes live, "default",
+ *   "file" or "memory"
+ * - "wal_autocheckpoint": number of WAL pages after which a committing
+ *   writer checkpoints (0 disables it)
+ * - "journal_size_limit": number of bytes the WAL file gets truncated
+ *   to after a checkpoint (-1 leaves it unbounded)
+ * - "lookaside": number of lookaside memory slots per connection, each
+ *   "lookaside_slot_size" bytes big (default 1200)
+ * - "checkpoint": "inline" lets committing writers checkpoint the WAL
+ *   (the default), "background" moves checkpoints to a thread running
+ *   every "checkpoint_interval" milliseconds (default 1000), which
+ *   overrides "wal_autocheckpoint". The thread uses a connection of
+ *   its own, so writers don't wait for it. Once the WAL reaches
+ *   "checkpoint_limit" pages (default 4000), the thread restarts it
+ *   and, past four times that, truncates it.
+ *
  * @param path Database file path
- * @param params
+ * @param params Driver settings
  * @return Open database handle
  */
 _Nullable persist_db_t persist_open(const char *_Nonnull path,
@@ -97,10 +212,42 @@ _Nullable persist_db_t persist_open(const char *_Nonnull path,
  */
 void persist_close(_Nonnull persist_db_t db);
 
+/**
+ * Returns driver runtime statistics, such as statement cache hit
+ * and miss counters, or the number of checkpoints run in background
+ * and the time they took (in microseconds).
+ *
+ * @param db Database handle
+ * @return Dictionary of counters
+ */
+_Nonnull rpc_object_t persist_get_stats(_Nonnull persist_db_t db);
+
+/**
+ * Copies a live database to a file @p path.
+ *
+ * The copy is made a few pages at a time and the database is released
+ * between steps, so writers are never held off for long. Changes made
+ * while the backup runs end up in the copy.
+ *
+ * If the backup fails or gets aborted, @p path may be left with
+ * a partial copy.
+ *
+ * @param db Database handle
+ * @param path Destination file path
+ * @param progress Optional progress callback
+ * @return 0 on success, -1 on error
+ */
+int persist_backup(_Nonnull persist_db_t db, const char *_Nonnull path,
+    _Nullable persist_backup_cb_t progress);
+
 /**
  * Returns a collection handle. If no such collection exists, it will
  * be created.
  *
+ * Handles are cached and shared between callers, so getting a handle
+ * of a collection that was used before doesn't hit the storage.
+ * Every handle has to be released with @ref persist_collection_close.
+ *
  * @param db Database handle
  * @param name Collection name
  * @return
@@ -131,7 +278,7 @@ int persist_collection_remove(_Nonnull persist_db_t db,
  *
  * @param db Database handle
  * @param name Collection name
- * @return Metadata object.
+ * @return Metadata object. Caller is responsible for releasing it.
  */
 _Nullable rpc_object_t persist_collection_get_metadata(
     _Nonnull persist_db_t db, const char *_Nonnull name);
@@ -146,6 +293,20 @@ _Nullable rpc_object_t persist_collection_get_metadata(
 int persist_collection_set_metadata(_Nonnull persist_db_t db,
     const char *_Nonnull name, _Nullable rpc_object_t metadata);
 
+/**
+ * Sets the size of the in-memory object cache of a collection.
+ *
+ * With a non-zero size, @ref persist_get returns objects shared with
+ * the cache, which must not be modified by the caller. Saves and
+ * deletes invalidate cached objects. Objects read inside a transaction
+ * are not cached and rollbacks flush the cache.
+ *
+ * @param col Collection handle
+ * @param size Maximum number of cached objects or 0 to disable caching
+ */
+void persist_collection_set_cache_size(_Nonnull persist_collection_t col,
+    size_t size);
+
 /**
  *
  * @param collection
@@ -162,6 +323,25 @@ void persist_collection_close(_Nonnull persist_collection_t collection);
 int persist_add_index(_Nonnull persist_collection_t col,
     const char *_Nonnull name, const char *_Nonnull path);
 
+/**
+ * Creates an index of type @p type on field @p path.
+ *
+ * A full-text index can be queried using the "search" filter operator,
+ * for example: ["description", "search", "disk AND fail*"].
+ * An array index speeds up the "contains" filter operator, which
+ * matches objects whose array field contains a given element, for
+ * example: ["tags", "contains", "archived"].
+ *
+ * @param col Collection handle
+ * @param name Index name
+ * @param path Field path
+ * @param type Index type
+ * @return 0 on success, -1 on error
+ */
+int persist_add_index_ex(_Nonnull persist_collection_t col,
+    const char *_Nonnull name, const char *_Nonnull path,
+    persist_index_type_t type);
+
 /**
  *
  * @param col
@@ -188,6 +368,54 @@ _Nullable rpc_object_t persist_get(_Nonnull persist_collection_t col,
     const char *_Nonnull id);
 
 /**
+ * Retrieves serialized bytes of an object, without decoding them.
+ *
+ * Meant for callers that only pass documents along, like proxies
+ * and exporters. The object cache is not consulted.
+ *
+ * @param col Collection handle
+ * @param id Primary key
+ * @param raw Filled with a borrowed view of the stored object
+ * @return 0 on success, -1 on error
+ */
+int persist_get_raw(_Nonnull persist_collection_t col,
+    const char *_Nonnull id, struct persist_raw *_Nonnull raw);
+
+/**
+ * Retrieves the value at field path @p path of an object.
+ *
+ * Drivers able to do so extract the value from the stored object
+ * without decoding all of it, which makes reading small fields out of
+ * big objects cheap.
+ *
+ * @param col Collection handle
+ * @param id Primary key
+ * @param path Field path
+ * @return Field value or NULL on error. Caller is responsible
+ *         for releasing it.
+ */
+_Nullable rpc_object_t persist_get_field(_Nonnull persist_collection_t col,
+    const char *_Nonnull id, const char *_Nonnull path);
+
+/**
+ * Checks whether an object with id @p id exists, without loading it.
+ *
+ * @param col Collection handle
+ * @param id Primary key
+ * @return true if the object exists, otherwise false
+ */
+bool persist_exists(_Nonnull persist_collection_t col,
+    const char *_Nonnull id);
+
+/**
+ * Queries a collection.
+ *
+ * Setting "prefetch" in @p params to a non-zero value makes the
+ * iterator read and decode up to that many objects ahead of the caller
+ * on a background thread. "decode_threads" additionally spreads
+ * decoding of prefetched objects over that many threads. Results are
+ * always returned in query order. Prefetching iterators only support
+ * @ref persist_iter_next.
  *
  * @param col Collection handle
  * @param query
@@ -196,12 +424,80 @@ _Nullable rpc_object_t persist_get(_Nonnull persist_collection_t col,
 _Nullable persist_iter_t persist_query(_Nonnull persist_collection_t col,
     _Nullable rpc_object_t filter, _Nullable persist_query_params_t params);
 
+/**
+ * Queries a collection using @p nthreads threads.
+ *
+ * The collection is split into id ranges of similar size, each scanned
+ * on a separate read-only connection, so decoding scales with cores.
+ * Before scanning starts, all partitions are pinned to the last
+ * committed state, so none of them sees later commits. Pinning holds
+ * off commits made through the same database handle only: commits by
+ * other handles or processes landing meanwhile may be seen by some
+ * partitions and not others.
+ *
+ * Without a sort field in @p params, @p cb is called concurrently from
+ * the scanning threads, in no particular order, and offset and limit
+ * are not supported. With a sort field, partitions are merged and
+ * @p cb is called on the calling thread, in order.
+ *
+ * Objects passed to @p cb are only valid for the duration of the call.
+ *
+ * @param col Collection handle
+ * @param filter Filter predicates
+ * @param params Query parameters
+ * @param nthreads Number of partitions to scan in parallel
+ * @param cb Callback called with each object
+ * @return 0 on success, -1 on error
+ */
+int persist_query_parallel(_Nonnull persist_collection_t col,
+    _Nullable rpc_object_t filter, _Nullable persist_query_params_t params,
+    size_t nthreads, _Nonnull persist_scan_cb_t cb);
+
 /**
  *
  */
 ssize_t persist_count(_Nonnull persist_collection_t col,
     _Nullable rpc_object_t filter);
 
+/**
+ * Computes aggregate values over objects matching @p filter.
+ *
+ * @p aggregates is a dictionary mapping result field names to
+ * [function, path] tuples, where function is one of "count", "sum",
+ * "min", "max" or "avg". Path may be omitted for "count", in which
+ * case matching objects are counted.
+ *
+ * If @p group_by (an array of field paths) is given, one result is
+ * returned per distinct combination of group values, with group
+ * values stored under their paths.
+ *
+ * @param col Collection handle
+ * @param filter Filter predicates
+ * @param group_by Array of field paths to group on
+ * @param aggregates Aggregate specification
+ * @return Array of result dictionaries or NULL on error
+ */
+_Nullable rpc_object_t persist_aggregate(_Nonnull persist_collection_t col,
+    _Nullable rpc_object_t filter, _Nullable rpc_object_t group_by,
+    _Nonnull rpc_object_t aggregates);
+
+/**
+ * Returns distinct values of field @p path among objects matching
+ * @p filter, together with their number of occurrences.
+ *
+ * Results are dictionaries with "value" and "count" keys, ordered by
+ * descending count. Drivers answer this from an index on @p path
+ * if one exists (see @ref persist_add_index).
+ *
+ * @param col Collection handle
+ * @param path Field path
+ * @param filter Filter predicates
+ * @param limit Maximum number of values to return or 0 for no limit
+ * @return Array of results or NULL on error
+ */
+_Nullable rpc_object_t persist_distinct(_Nonnull persist_collection_t col,
+    const char *_Nonnull path, _Nullable rpc_object_t filter, uint64_t limit);
+
 /**
  *
  * @param col Collection handle
@@ -237,11 +533,34 @@ int persist_delete(_Nonnull persist_collection_t col, const char *_Nonnull id);
  * Pending changes can be rolled back using @ref persist_rollback_transaction
  * function.
  *
+ * Transactions can be nested. Committing an inner transaction makes
+ * its changes part of the enclosing one, while rolling it back only
+ * discards changes made since it was started. Nothing is written to
+ * the database until the outermost transaction commits.
+ *
+ * A database handle has a single transaction at a time, owned by the
+ * thread that started it. Until it ends, starting, committing or
+ * rolling back a transaction from any other thread fails with EBUSY.
+ *
  * @param db Database handle
  * @return 0 on success, -1 on error
  */
 int persist_start_transaction(_Nonnull persist_db_t db);
 
+/**
+ * Starts a database transaction with durability level @p durability.
+ *
+ * The level overrides the database-wide "durability" setting for
+ * the commit of this transaction only. It is ignored for nested
+ * transactions, which are committed together with the outermost one.
+ *
+ * @param db Database handle
+ * @param durability Durability level
+ * @return 0 on success, -1 on error
+ */
+int persist_start_transaction_ex(_Nonnull persist_db_t db,
+    persist_durability_t durability);
+
 /**
  * Commits a pending database transaction.
  *
@@ -277,12 +596,148 @@ bool persist_transaction_active(_Nonnull persist_db_t db);
 int persist_iter_next(_Nonnull persist_iter_t iter,
     _Nullable rpc_object_t *_Nonnull result);
 
+/**
+ * Returns next query result as serialized bytes, without decoding it.
+ *
+ * Both @p idp and @p raw point into the current row and stay valid
+ * until the next call on @p iter or until it is closed. On end of
+ * results, @p idp is set to NULL.
+ *
+ * @param iter Iterator
+ * @param idp Set to the object id
+ * @param raw Filled with a borrowed view of the stored object
+ * @return 0 on success, -1 on error
+ */
+int persist_iter_next_raw(_Nonnull persist_iter_t iter,
+    const char *_Nullable *_Nonnull idp, struct persist_raw *_Nonnull raw);
+
+/**
+ * Returns next query result as a lazily decoded view.
+ *
+ * Fields of the view are decoded only when read with
+ * @ref persist_lazy_get, which makes scans touching a few fields of
+ * large objects cheap. The view belongs to the iterator and is valid
+ * until the next call on @p iter or until it is closed.
+ *
+ * @param iter Iterator
+ * @param idp Set to the object id or NULL on end of results
+ * @param result Set to the object view
+ * @return 0 on success, -1 on error
+ */
+int persist_iter_next_lazy(_Nonnull persist_iter_t iter,
+    const char *_Nullable *_Nonnull idp,
+    _Nullable persist_lazy_t *_Nonnull result);
+
 /**
  *
  * @param iter
  */
 void persist_iter_close(_Nonnull persist_iter_t iter);
 
+/**
+ * Creates an empty lazy object view.
+ *
+ * @return Lazy view handle
+ */
+_Nonnull persist_lazy_t persist_lazy_new(void);
+
+/**
+ * Points a lazy view at serialized object @p raw.
+ *
+ * Nothing gets decoded at this point. The view borrows @p raw data,
+ * which has to stay valid for as long as the view is used.
+ *
+ * @param lazy Lazy view handle
+ * @param raw Serialized object
+ */
+void persist_lazy_set(_Nonnull persist_lazy_t lazy,
+    const struct persist_raw *_Nonnull raw);
+
+/**
+ * Decodes the value at field path @p path.
+ *
+ * On first access, offsets of top-level fields are indexed. Only
+ * the subtree of the top-level field @p path starts with is decoded.
+ *
+ * @param lazy Lazy view handle
+ * @param path Field path
+ * @return Field value or NULL. Caller is responsible for releasing it.
+ */
+_Nullable rpc_object_t persist_lazy_get(_Nonnull persist_lazy_t lazy,
+    const char *_Nonnull path);
+
+/**
+ * Decodes the whole object.
+ *
+ * @param lazy Lazy view handle
+ * @return Object or NULL. Caller is responsible for releasing it.
+ */
+_Nullable rpc_object_t persist_lazy_load(_Nonnull persist_lazy_t lazy);
+
+/**
+ * Frees a lazy view.
+ *
+ * @param lazy Lazy view handle
+ */
+void persist_lazy_free(_Nonnull persist_lazy_t lazy);
+
+/**
+ * Opens a read snapshot of the database.
+ *
+ * Reads made through the snapshot see the database as of the time
+ * it was opened, regardless of writes committed in the meantime.
+ * Snapshots don't block writers and any number of them can be open
+ * at once. They don't see uncommitted changes of an active
+ * transaction. Iterators returned by @ref persist_snapshot_query
+ * have to be closed before the snapshot.
+ *
+ * @param db Database handle
+ * @return Snapshot handle or NULL on error
+ */
+_Nullable persist_snapshot_t persist_snapshot_open(_Nonnull persist_db_t db);
+
+/**
+ * Closes a read snapshot.
+ *
+ * @param snap Snapshot handle
+ */
+void persist_snapshot_close(_Nonnull persist_snapshot_t snap);
+
+/**
+ * Retrieves an object as seen by snapshot @p snap.
+ *
+ * @param snap Snapshot handle
+ * @param col Collection handle
+ * @param id Primary key
+ * @return Object or NULL on error. Caller is responsible for releasing it.
+ */
+_Nullable rpc_object_t persist_snapshot_get(_Nonnull persist_snapshot_t snap,
+    _Nonnull persist_collection_t col, const char *_Nonnull id);
+
+/**
+ * Queries a collection as seen by snapshot @p snap.
+ *
+ * @param snap Snapshot handle
+ * @param col Collection handle
+ * @param filter Filter predicates
+ * @param params Query parameters
+ * @return Iterator or NULL on error
+ */
+_Nullable persist_iter_t persist_snapshot_query(
+    _Nonnull persist_snapshot_t snap, _Nonnull persist_collection_t col,
+    _Nullable rpc_object_t filter, _Nullable persist_query_params_t params);
+
+/**
+ * Counts objects matching @p filter as seen by snapshot @p snap.
+ *
+ * @param snap Snapshot handle
+ * @param col Collection handle
+ * @param filter Filter predicates
+ * @return Number of objects or -1 on error
+ */
+ssize_t persist_snapshot_count(_Nonnull persist_snapshot_t snap,
+    _Nonnull persist_collection_t col, _Nullable rpc_object_t filter);
+
 /**
  *
  * @param msgp
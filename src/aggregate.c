@@ -0,0 +1,528 @@
+/*
+ * Copyright 2018 Jakub Klama <jakub.klama@gmail.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <persist.h>
+#include "internal.h"
+
+enum persist_aggregate_fn
+{
+	AGGREGATE_COUNT,
+	AGGREGATE_SUM,
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+	AGGREGATE_AVG
+};
+
+struct persist_aggregate_spec
+{
+	const char *			pas_name;
+	const char *			pas_path;
+	enum persist_aggregate_fn	pas_fn;
+};
+
+struct persist_aggregate_acc
+{
+	uint64_t			paa_count;
+	int64_t				paa_isum;
+	double				paa_dsum;
+	bool				paa_real;
+	rpc_object_t			paa_value;
+};
+
+struct persist_aggregate_group
+{
+	rpc_object_t			pag_key;
+	struct persist_aggregate_acc *	pag_accs;
+};
+
+static const char *persist_aggregate_names[] = {
+	[AGGREGATE_COUNT] = "count",
+	[AGGREGATE_SUM] = "sum",
+	[AGGREGATE_MIN] = "min",
+	[AGGREGATE_MAX] = "max",
+	[AGGREGATE_AVG] = "avg",
+};
+
+static guint persist_aggregate_hash(gconstpointer);
+static gboolean persist_aggregate_equal(gconstpointer, gconstpointer);
+static GArray *persist_aggregate_parse(rpc_object_t);
+static rpc_object_t persist_aggregate_key(rpc_object_t, rpc_object_t);
+static struct persist_aggregate_group *persist_aggregate_group_new(
+    rpc_object_t, GArray *);
+static void persist_aggregate_group_free(struct persist_aggregate_group *,
+    GArray *);
+static void persist_aggregate_feed(struct persist_aggregate_group *,
+    GArray *, rpc_object_t);
+static rpc_object_t persist_aggregate_result(struct persist_aggregate_group *,
+    GArray *, rpc_object_t);
+
+static guint
+persist_aggregate_hash(gconstpointer key)
+{
+
+	return ((guint)rpc_hash((rpc_object_t)key));
+}
+
+static gboolean
+persist_aggregate_equal(gconstpointer a, gconstpointer b)
+{
+
+	return (rpc_equal((rpc_object_t)a, (rpc_object_t)b));
+}
+
+static GArray *
+persist_aggregate_parse(rpc_object_t aggregates)
+{
+	GArray *specs;
+	bool stop;
+
+	if (aggregates == NULL ||
+	    rpc_get_type(aggregates) != RPC_TYPE_DICTIONARY) {
+		persist_set_last_error_static(EINVAL,
+		    "Aggregates are not a dictionary");
+		return (NULL);
+	}
+
+	specs = g_array_new(false, true, sizeof(struct persist_aggregate_spec));
+	stop = rpc_dictionary_apply(aggregates, ^(const char *name,
+	    rpc_object_t v) {
+		struct persist_aggregate_spec spec = { .pas_name = name };
+		rpc_object_t fn;
+		rpc_object_t path;
+		size_t i;
+
+		if (rpc_get_type(v) != RPC_TYPE_ARRAY ||
+		    rpc_array_get_count(v) < 1 || rpc_array_get_count(v) > 2) {
+			persist_set_last_error(EINVAL,
+			    "Aggregate %s is not a [function, path] tuple", name);
+			return ((bool)false);
+		}
+
+		fn = rpc_array_get_value(v, 0);
+		path = rpc_array_get_value(v, 1);
+
+		if (rpc_get_type(fn) != RPC_TYPE_STRING) {
+			persist_set_last_error(EINVAL,
+			    "Aggregate %s: function name is not a string", name);
+			return ((bool)false);
+		}
+
+		for (i = 0; i < G_N_ELEMENTS(persist_aggregate_names); i++) {
+			if (g_strcmp0(rpc_string_get_string_ptr(fn),
+			    persist_aggregate_names[i]) == 0)
+				break;
+		}
+
+		if (i == G_N_ELEMENTS(persist_aggregate_names)) {
+			persist_set_last_error(EINVAL,
+			    "Aggregate %s: invalid function %s", name,
+			    rpc_string_get_string_ptr(fn));
+			return ((bool)false);
+		}
+
+		spec.pas_fn = (enum persist_aggregate_fn)i;
+
+		if (path != NULL && rpc_get_type(path) == RPC_TYPE_STRING)
+			spec.pas_path = rpc_string_get_string_ptr(path);
+		else if (path != NULL && rpc_get_type(path) != RPC_TYPE_NULL) {
+			persist_set_last_error(EINVAL,
+			    "Aggregate %s: path is not a string", name);
+			return ((bool)false);
+		}
+
+		if (spec.pas_path == NULL && spec.pas_fn != AGGREGATE_COUNT) {
+			persist_set_last_error(EINVAL,
+			    "Aggregate %s: path is required", name);
+			return ((bool)false);
+		}
+
+		g_array_append_val(specs, spec);
+		return ((bool)true);
+	});
+
+	if (stop) {
+		g_array_free(specs, true);
+		return (NULL);
+	}
+
+	return (specs);
+}
+
+static rpc_object_t
+persist_aggregate_key(rpc_object_t obj, rpc_object_t group_by)
+{
+	rpc_object_t key;
+
+	key = rpc_array_create();
+	if (group_by == NULL)
+		return (key);
+
+	rpc_array_apply(group_by, ^(size_t idx, rpc_object_t path) {
+		rpc_object_t v;
+
+		v = persist_get_path(obj, rpc_string_get_string_ptr(path));
+		if (v == NULL)
+			rpc_array_append_stolen_value(key, rpc_null_create());
+		else
+			rpc_array_append_value(key, v);
+
+		return ((bool)true);
+	});
+
+	return (key);
+}
+
+static struct persist_aggregate_group *
+persist_aggregate_group_new(rpc_object_t key, GArray *specs)
+{
+	struct persist_aggregate_group *group;
+
+	group = g_malloc0(sizeof(*group));
+	group->pag_key = key;
+	group->pag_accs = g_new0(struct persist_aggregate_acc, specs->len);
+	return (group);
+}
+
+static void
+persist_aggregate_group_free(struct persist_aggregate_group *group,
+    GArray *specs)
+{
+	guint i;
+
+	for (i = 0; i < specs->len; i++) {
+		if (group->pag_accs[i].paa_value != NULL)
+			rpc_release(group->pag_accs[i].paa_value);
+	}
+
+	rpc_release(group->pag_key);
+	g_free(group->pag_accs);
+	g_free(group);
+}
+
+static void
+persist_aggregate_feed(struct persist_aggregate_group *group, GArray *specs,
+    rpc_object_t obj)
+{
+	struct persist_aggregate_spec *spec;
+	struct persist_aggregate_acc *acc;
+	rpc_object_t v;
+	guint i;
+
+	for (i = 0; i < specs->len; i++) {
+		spec = &g_array_index(specs, struct persist_aggregate_spec, i);
+		acc = &group->pag_accs[i];
+
+		if (spec->pas_path == NULL) {
+			acc->paa_count++;
+			continue;
+		}
+
+		v = persist_get_path(obj, spec->pas_path);
+		if (v == NULL || rpc_get_type(v) == RPC_TYPE_NULL)
+			continue;
+
+		switch (spec->pas_fn) {
+		case AGGREGATE_COUNT:
+			acc->paa_count++;
+			break;
+
+		case AGGREGATE_SUM:
+		case AGGREGATE_AVG:
+			switch (rpc_get_type(v)) {
+			case RPC_TYPE_INT64:
+				acc->paa_isum += rpc_int64_get_value(v);
+				acc->paa_dsum += (double)rpc_int64_get_value(v);
+				break;
+
+			case RPC_TYPE_UINT64:
+				acc->paa_isum += (int64_t)rpc_uint64_get_value(v);
+				acc->paa_dsum += (double)rpc_uint64_get_value(v);
+				break;
+
+			case RPC_TYPE_DOUBLE:
+				acc->paa_dsum += rpc_double_get_value(v);
+				acc->paa_real = true;
+				break;
+
+			default:
+				continue;
+			}
+
+			acc->paa_count++;
+			break;
+
+		case AGGREGATE_MIN:
+		case AGGREGATE_MAX:
+			if (acc->paa_value != NULL) {
+				if (spec->pas_fn == AGGREGATE_MIN &&
+				    persist_compare(v, acc->paa_value) >= 0)
+					break;
+
+				if (spec->pas_fn == AGGREGATE_MAX &&
+				    persist_compare(v, acc->paa_value) <= 0)
+					break;
+
+				rpc_release(acc->paa_value);
+			}
+
+			acc->paa_value = rpc_retain(v);
+			break;
+		}
+	}
+}
+
+static rpc_object_t
+persist_aggregate_result(struct persist_aggregate_group *group, GArray *specs,
+    rpc_object_t group_by)
+{
+	struct persist_aggregate_spec *spec;
+	struct persist_aggregate_acc *acc;
+	rpc_object_t result;
+	rpc_object_t v;
+	guint i;
+
+	result = rpc_dictionary_create();
+
+	if (group_by != NULL) {
+		rpc_array_apply(group_by, ^(size_t idx, rpc_object_t path) {
+			rpc_dictionary_set_value(result,
+			    rpc_string_get_string_ptr(path),
+			    rpc_array_get_value(group->pag_key, idx));
+			return ((bool)true);
+		});
+	}
+
+	for (i = 0; i < specs->len; i++) {
+		spec = &g_array_index(specs, struct persist_aggregate_spec, i);
+		acc = &group->pag_accs[i];
+
+		switch (spec->pas_fn) {
+		case AGGREGATE_COUNT:
+			v = rpc_int64_create((int64_t)acc->paa_count);
+			break;
+
+		case AGGREGATE_SUM:
+			if (acc->paa_count == 0)
+				v = rpc_null_create();
+			else if (acc->paa_real)
+				v = rpc_double_create(acc->paa_dsum);
+			else
+				v = rpc_int64_create(acc->paa_isum);
+			break;
+
+		case AGGREGATE_AVG:
+			if (acc->paa_count == 0)
+				v = rpc_null_create();
+			else
+				v = rpc_double_create(acc->paa_dsum /
+				    (double)acc->paa_count);
+			break;
+
+		case AGGREGATE_MIN:
+		case AGGREGATE_MAX:
+			if (acc->paa_value == NULL)
+				v = rpc_null_create();
+			else
+				v = rpc_retain(acc->paa_value);
+			break;
+
+		default:
+			g_assert_not_reached();
+		}
+
+		rpc_dictionary_steal_value(result, spec->pas_name, v);
+	}
+
+	return (result);
+}
+
+bool
+persist_aggregate_validate(rpc_object_t group_by, rpc_object_t aggregates)
+{
+	GArray *specs;
+	bool stop;
+
+	if (group_by != NULL) {
+		if (rpc_get_type(group_by) != RPC_TYPE_ARRAY) {
+			persist_set_last_error_static(EINVAL,
+			    "group_by is not an array");
+			return (false);
+		}
+
+		stop = rpc_array_apply(group_by, ^(size_t idx, rpc_object_t v) {
+			return ((bool)(rpc_get_type(v) == RPC_TYPE_STRING));
+		});
+
+		if (stop) {
+			persist_set_last_error(EINVAL,
+			    "group_by contains a non-string path");
+			return (false);
+		}
+	}
+
+	specs = persist_aggregate_parse(aggregates);
+	if (specs == NULL)
+		return (false);
+
+	g_array_free(specs, true);
+	return (true);
+}
+
+rpc_object_t
+persist_aggregate_fallback(struct persist_collection *col, rpc_object_t filter,
+    rpc_object_t group_by, rpc_object_t aggregates)
+{
+	const struct persist_driver *drv = col->pc_db->pdb_driver;
+	struct persist_aggregate_group *group;
+	GHashTable *groups;
+	GPtrArray *order;
+	GArray *specs;
+	rpc_object_t result = NULL;
+	rpc_object_t obj;
+	rpc_object_t key;
+	void *iter;
+	const char *id;
+	guint i;
+
+	specs = persist_aggregate_parse(aggregates);
+	if (specs == NULL)
+		return (NULL);
+
+	iter = drv->pd_query(col->pc_db->pdb_arg, col->pc_name, filter, NULL);
+	if (iter == NULL) {
+		g_array_free(specs, true);
+		return (NULL);
+	}
+
+	groups = g_hash_table_new(persist_aggregate_hash,
+	    persist_aggregate_equal);
+	order = g_ptr_array_new();
+
+	for (;;) {
+		if (drv->pd_query_next(iter, &id, &obj) != 0)
+			goto done;
+
+		if (id == NULL)
+			break;
+
+		if (obj == NULL)
+			continue;
+
+		rpc_dictionary_set_string(obj, "id", id);
+
+		key = persist_aggregate_key(obj, group_by);
+		group = g_hash_table_lookup(groups, key);
+		if (group == NULL) {
+			group = persist_aggregate_group_new(key, specs);
+			g_hash_table_insert(groups, key, group);
+			g_ptr_array_add(order, group);
+		} else
+			rpc_release(key);
+
+		persist_aggregate_feed(group, specs, obj);
+		rpc_release(obj);
+	}
+
+	/* Like SQL, an ungrouped aggregate over no rows yields one result */
+	if (group_by == NULL && order->len == 0) {
+		group = persist_aggregate_group_new(rpc_array_create(), specs);
+		g_ptr_array_add(order, group);
+	}
+
+	result = rpc_array_create();
+	for (i = 0; i < order->len; i++) {
+		rpc_array_append_stolen_value(result, persist_aggregate_result(
+		    g_ptr_array_index(order, i), specs, group_by));
+	}
+
+done:
+	drv->pd_query_close(iter);
+
+	for (i = 0; i < order->len; i++)
+		persist_aggregate_group_free(g_ptr_array_index(order, i), specs);
+
+	g_hash_table_destroy(groups);
+	g_ptr_array_free(order, true);
+	g_array_free(specs, true);
+	return (result);
+}
+
+static gint
+persist_distinct_compare(gconstpointer a, gconstpointer b)
+{
+	rpc_object_t r1 = *(rpc_object_t *)a;
+	rpc_object_t r2 = *(rpc_object_t *)b;
+	int64_t c1 = rpc_dictionary_get_int64(r1, "count");
+	int64_t c2 = rpc_dictionary_get_int64(r2, "count");
+
+	if (c1 != c2)
+		return (c1 > c2 ? -1 : 1);
+
+	return (persist_compare(rpc_dictionary_get_value(r1, "value"),
+	    rpc_dictionary_get_value(r2, "value")));
+}
+
+rpc_object_t
+persist_distinct_fallback(struct persist_collection *col, const char *path,
+    rpc_object_t filter, uint64_t limit)
+{
+	rpc_auto_object_t group_by = NULL;
+	rpc_auto_object_t aggregates = NULL;
+	rpc_auto_object_t groups = NULL;
+	rpc_object_t result;
+	GPtrArray *rows;
+	guint i;
+
+	group_by = rpc_object_pack("[s]", path);
+	aggregates = rpc_object_pack("{[s]}", "count", "count");
+	groups = persist_aggregate(col, filter, group_by, aggregates);
+	if (groups == NULL)
+		return (NULL);
+
+	rows = g_ptr_array_new_with_free_func((GDestroyNotify)rpc_release_impl);
+	rpc_array_apply(groups, ^(size_t idx, rpc_object_t v) {
+		g_ptr_array_add(rows, rpc_object_pack("{v,v}",
+		    "value", rpc_retain(rpc_dictionary_get_value(v, path)),
+		    "count", rpc_retain(rpc_dictionary_get_value(v, "count"))));
+		return ((bool)true);
+	});
+
+	g_ptr_array_sort(rows, persist_distinct_compare);
+	result = rpc_array_create();
+
+	for (i = 0; i < rows->len; i++) {
+		if (limit != 0 && i >= limit)
+			break;
+
+		rpc_array_append_value(result, g_ptr_array_index(rows, i));
+	}
+
+	g_ptr_array_free(rows, true);
+	return (result);
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright 2018 Jakub Klama <jakub.klama@gmail.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <glib.h>
+#include <rpc/object.h>
+#include "internal.h"
+
+#define	PERSIST_CACHE_SHARDS	16
+#define	PERSIST_CACHE_SHARD_MIN	64
+
+struct persist_cache_entry
+{
+	char *				pce_id;
+	rpc_object_t			pce_obj;
+	guint				pce_slot;
+	bool				pce_referenced;
+};
+
+struct persist_cache_shard
+{
+	GMutex				pcs_mtx;
+	GHashTable *			pcs_entries;
+	GPtrArray *			pcs_clock;
+	guint				pcs_hand;
+	guint				pcs_capacity;
+	uint64_t			pcs_generation;
+	uint64_t			pcs_hits;
+	uint64_t			pcs_misses;
+};
+
+struct persist_cache
+{
+	volatile gint			pca_enabled;
+	volatile gint			pca_nshards;
+	uint64_t			pca_generation;
+	struct persist_cache_shard *	pca_shards;
+};
+
+static struct persist_cache_shard *persist_cache_shard(struct persist_cache *,
+    const char *);
+static uint64_t persist_cache_generation(struct persist_cache *);
+static void persist_cache_entry_free(struct persist_cache_entry *);
+static void persist_cache_shard_flush(struct persist_cache *,
+    struct persist_cache_shard *);
+
+static struct persist_cache_shard *
+persist_cache_shard(struct persist_cache *cache, const char *id)
+{
+	guint nshards;
+
+	nshards = (guint)g_atomic_int_get(&cache->pca_nshards);
+	return (&cache->pca_shards[g_str_hash(id) % nshards]);
+}
+
+/*
+ * Generations are unique across shards, so that a miss and its fill
+ * hashed to different shards by a concurrent resize never match.
+ */
+static uint64_t
+persist_cache_generation(struct persist_cache *cache)
+{
+
+	return (__atomic_add_fetch(&cache->pca_generation, 1,
+	    __ATOMIC_RELAXED));
+}
+
+static void
+persist_cache_entry_free(struct persist_cache_entry *entry)
+{
+
+	rpc_release(entry->pce_obj);
+	g_free(entry->pce_id);
+	g_free(entry);
+}
+
+static void
+persist_cache_shard_flush(struct persist_cache *cache,
+    struct persist_cache_shard *shard)
+{
+
+	g_hash_table_remove_all(shard->pcs_entries);
+	g_ptr_array_set_size(shard->pcs_clock, 0);
+	shard->pcs_hand = 0;
+	shard->pcs_generation = persist_cache_generation(cache);
+}
+
+struct persist_cache *
+persist_cache_new(void)
+{
+
+	/* Shards are only allocated once the cache gets enabled */
+	return (g_malloc0(sizeof(struct persist_cache)));
+}
+
+void
+persist_cache_free(struct persist_cache *cache)
+{
+	struct persist_cache_shard *shard;
+	guint i;
+
+	if (cache->pca_shards != NULL) {
+		for (i = 0; i < PERSIST_CACHE_SHARDS; i++) {
+			shard = &cache->pca_shards[i];
+			g_hash_table_destroy(shard->pcs_entries);
+			g_ptr_array_free(shard->pcs_clock, true);
+			g_mutex_clear(&shard->pcs_mtx);
+		}
+
+		g_free(cache->pca_shards);
+	}
+
+	g_free(cache);
+}
+
+bool
+persist_cache_enabled(struct persist_cache *cache)
+{
+
+	return (g_atomic_int_get(&cache->pca_enabled) != 0);
+}
+
+void
+persist_cache_set_capacity(struct persist_cache *cache, size_t capacity)
+{
+	struct persist_cache_shard *shard;
+	struct persist_cache_shard *shards;
+	guint nshards;
+	guint i;
+
+	if (cache->pca_shards == NULL) {
+		if (capacity == 0)
+			return;
+
+		shards = g_malloc0_n(PERSIST_CACHE_SHARDS, sizeof(*shards));
+		for (i = 0; i < PERSIST_CACHE_SHARDS; i++) {
+			shard = &shards[i];
+			g_mutex_init(&shard->pcs_mtx);
+			shard->pcs_entries = g_hash_table_new_full(g_str_hash,
+			    g_str_equal, NULL,
+			    (GDestroyNotify)persist_cache_entry_free);
+			shard->pcs_clock = g_ptr_array_new();
+		}
+
+		g_atomic_int_set(&cache->pca_nshards, PERSIST_CACHE_SHARDS);
+		g_atomic_pointer_set(&cache->pca_shards, shards);
+	}
+
+	/*
+	 * Small caches use fewer shards, so that uneven hashing doesn't
+	 * leave some ids competing for a handful of slots while others
+	 * sit empty. The shards add up to the exact capacity.
+	 */
+	nshards = (guint)CLAMP(capacity / PERSIST_CACHE_SHARD_MIN, 1,
+	    PERSIST_CACHE_SHARDS);
+	for (i = 0; i < PERSIST_CACHE_SHARDS; i++) {
+		shard = &cache->pca_shards[i];
+		g_mutex_lock(&shard->pcs_mtx);
+		persist_cache_shard_flush(cache, shard);
+		shard->pcs_capacity = i >= nshards ? 0 :
+		    (guint)(capacity / nshards +
+		    (i < capacity % nshards ? 1 : 0));
+		g_mutex_unlock(&shard->pcs_mtx);
+	}
+
+	g_atomic_int_set(&cache->pca_nshards, (gint)nshards);
+	g_atomic_int_set(&cache->pca_enabled, capacity > 0);
+}
+
+/*
+ * Returns a new reference to the cached object or NULL. On a miss,
+ * *generation is filled in to be passed to persist_cache_put(), so
+ * that a value read before a concurrent invalidation doesn't end up
+ * in the cache.
+ */
+rpc_object_t
+persist_cache_get(struct persist_cache *cache, const char *id,
+    uint64_t *generation)
+{
+	struct persist_cache_shard *shard;
+	struct persist_cache_entry *entry;
+	rpc_object_t result = NULL;
+
+	shard = persist_cache_shard(cache, id);
+	g_mutex_lock(&shard->pcs_mtx);
+	entry = g_hash_table_lookup(shard->pcs_entries, id);
+	if (entry != NULL) {
+		entry->pce_referenced = true;
+		result = rpc_retain(entry->pce_obj);
+		shard->pcs_hits++;
+	} else {
+		*generation = shard->pcs_generation;
+		shard->pcs_misses++;
+	}
+
+	g_mutex_unlock(&shard->pcs_mtx);
+	return (result);
+}
+
+void
+persist_cache_put(struct persist_cache *cache, const char *id,
+    rpc_object_t obj, uint64_t generation)
+{
+	struct persist_cache_shard *shard;
+	struct persist_cache_entry *entry;
+	struct persist_cache_entry *victim;
+
+	shard = persist_cache_shard(cache, id);
+	g_mutex_lock(&shard->pcs_mtx);
+
+	if (shard->pcs_capacity == 0 || shard->pcs_generation != generation ||
+	    g_hash_table_contains(shard->pcs_entries, id)) {
+		g_mutex_unlock(&shard->pcs_mtx);
+		return;
+	}
+
+	entry = g_malloc0(sizeof(*entry));
+	entry->pce_id = g_strdup(id);
+	entry->pce_obj = rpc_retain(obj);
+
+	if (shard->pcs_clock->len < shard->pcs_capacity) {
+		entry->pce_slot = shard->pcs_clock->len;
+		g_ptr_array_add(shard->pcs_clock, entry);
+		g_hash_table_insert(shard->pcs_entries, entry->pce_id, entry);
+		g_mutex_unlock(&shard->pcs_mtx);
+		return;
+	}
+
+	/* CLOCK: recently used entries get a second chance */
+	for (;;) {
+		victim = g_ptr_array_index(shard->pcs_clock, shard->pcs_hand);
+		if (!victim->pce_referenced)
+			break;
+
+		victim->pce_referenced = false;
+		shard->pcs_hand = (shard->pcs_hand + 1) % shard->pcs_clock->len;
+	}
+
+	entry->pce_slot = victim->pce_slot;
+	shard->pcs_clock->pdata[entry->pce_slot] = entry;
+	shard->pcs_hand = (shard->pcs_hand + 1) % shard->pcs_clock->len;
+	g_hash_table_remove(shard->pcs_entries, victim->pce_id);
+	g_hash_table_insert(shard->pcs_entries, entry->pce_id, entry);
+	g_mutex_unlock(&shard->pcs_mtx);
+}
+
+void
+persist_cache_remove(struct persist_cache *cache, const char *id)
+{
+	struct persist_cache_shard *shard;
+	struct persist_cache_entry *entry;
+	struct persist_cache_entry *moved;
+	GPtrArray *clock;
+
+	shard = persist_cache_shard(cache, id);
+	g_mutex_lock(&shard->pcs_mtx);
+	shard->pcs_generation = persist_cache_generation(cache);
+
+	entry = g_hash_table_lookup(shard->pcs_entries, id);
+	if (entry != NULL) {
+		clock = shard->pcs_clock;
+		g_ptr_array_remove_index_fast(clock, entry->pce_slot);
+		if (entry->pce_slot < clock->len) {
+			moved = g_ptr_array_index(clock, entry->pce_slot);
+			moved->pce_slot = entry->pce_slot;
+		}
+
+		if (shard->pcs_hand >= clock->len)
+			shard->pcs_hand = 0;
+
+		g_hash_table_remove(shard->pcs_entries, id);
+	}
+
+	g_mutex_unlock(&shard->pcs_mtx);
+}
+
+void
+persist_cache_flush(struct persist_cache *cache)
+{
+	struct persist_cache_shard *shard;
+	guint i;
+
+	if (!persist_cache_enabled(cache))
+		return;
+
+	for (i = 0; i < PERSIST_CACHE_SHARDS; i++) {
+		shard = &cache->pca_shards[i];
+		g_mutex_lock(&shard->pcs_mtx);
+		persist_cache_shard_flush(cache, shard);
+		g_mutex_unlock(&shard->pcs_mtx);
+	}
+}
+
+void
+persist_cache_get_stats(struct persist_cache *cache, uint64_t *hits,
+    uint64_t *misses, uint64_t *entries)
+{
+	struct persist_cache_shard *shard;
+	guint i;
+
+	if (cache->pca_shards == NULL)
+		return;
+
+	for (i = 0; i < PERSIST_CACHE_SHARDS; i++) {
+		shard = &cache->pca_shards[i];
+		g_mutex_lock(&shard->pcs_mtx);
+		*hits += shard->pcs_hits;
+		*misses += shard->pcs_misses;
+		*entries += shard->pcs_clock->len;
+		g_mutex_unlock(&shard->pcs_mtx);
+	}
+}
@@ -36,23 +36,113 @@
 #include "../internal.h"
 
 #define SQLITE_YIELD_DELAY	(100 * 1000)
+#define SQLITE_STMT_CACHE_SIZE	64
+#define SQLITE_SYNC_INTERVAL	1000
+#define SQLITE_CKPT_INTERVAL	1000
+#define SQLITE_CKPT_LIMIT	4000
+#define SQLITE_BACKUP_PAGES	64
+#define SQLITE_BACKUP_DELAY	1000
+#define SQLITE_LOOKASIDE_SIZE	1200
 #define SQL_CREATE_TABLE	"CREATE TABLE IF NOT EXISTS %s (id TEXT PRIMARY KEY, value TEXT);"
 #define SQL_DROP_TABLE		"DROP TABLE %s;"
 #define SQL_LIST_TABLES		"SELECT * FROM sqlite_master WHERE TYPE='table';"
 #define SQL_GET			"SELECT * FROM %s WHERE id = ?;"
 #define SQL_INSERT		"INSERT OR REPLACE INTO %s (id, value) VALUES (?, ?);"
 #define SQL_DELETE		"DELETE FROM %s WHERE id = ?;"
+#define SQL_EXISTS		"SELECT 1 FROM %s WHERE id = ?;"
+#define SQL_IDS			"SELECT id FROM %s ORDER BY id;"
+#define SQL_FIELD		"SELECT json_type(value, ?2), json_extract(value, ?2) FROM %s WHERE id = ?1;"
 #define SQL_ADD_INDEX(_x)	"CREATE INDEX IF NOT EXISTS %s_%s ON %s(" SQL_EXTRACT(_x) ");"
 #define SQL_DROP_INDEX		"DROP INDEX %s_%s"
-#define SQL_EXTRACT(_x)		"json_quote(json_extract(value, '$." _x "'))"
+#define SQL_EXTRACT(_x)		"json_quote(" SQL_EXTRACT_RAW(_x) ")"
+#define SQL_EXTRACT_RAW(_x)	"json_extract(value, '$." _x "')"
 #define SQL_JSON(_x)		"json('" _x "')"
+#define SQL_CREATE_INDEXES	"CREATE TABLE IF NOT EXISTS __indexes (collection TEXT, name TEXT, path TEXT, type TEXT, PRIMARY KEY (collection, name));"
+#define SQL_RECORD_INDEX	"INSERT OR REPLACE INTO __indexes (collection, name, path, type) VALUES (%Q, %Q, %Q, %Q);"
+#define SQL_FORGET_INDEX	"DELETE FROM __indexes WHERE collection = %Q AND name = %Q;"
+#define SQL_FIND_INDEX		"SELECT name FROM __indexes WHERE collection = %Q AND path = %Q AND type = %Q;"
+#define SQL_GET_INDEX_TYPE	"SELECT type FROM __indexes WHERE collection = %Q AND name = %Q;"
+#define SQL_LIST_INDEXES	"SELECT name FROM __indexes WHERE collection = %Q;"
+#define SQL_FTS_CREATE		"CREATE VIRTUAL TABLE %s USING fts5(content);"
+#define SQL_FTS_TRIGGER_BI	"CREATE TRIGGER %s_bi BEFORE INSERT ON %s BEGIN DELETE FROM %s WHERE rowid IN (SELECT rowid FROM %s WHERE id = new.id); END;"
+#define SQL_FTS_TRIGGER_AI	"CREATE TRIGGER %s_ai AFTER INSERT ON %s BEGIN INSERT INTO %s (rowid, content) VALUES (new.rowid, json_extract(new.value, '$.%s')); END;"
+#define SQL_FTS_TRIGGER_AD	"CREATE TRIGGER %s_ad AFTER DELETE ON %s BEGIN DELETE FROM %s WHERE rowid = old.rowid; END;"
+#define SQL_FTS_POPULATE	"INSERT INTO %s (rowid, content) SELECT rowid, json_extract(value, '$.%s') FROM %s;"
+#define SQL_FTS_DROP		"DROP TRIGGER IF EXISTS %s_bi; DROP TRIGGER IF EXISTS %s_ai; DROP TRIGGER IF EXISTS %s_ad; DROP TABLE IF EXISTS %s;"
+#define SQL_FTS_SEARCH		"rowid IN (SELECT rowid FROM %s_%s WHERE %s_%s MATCH %Q)"
+#define SQL_ARRAY_CREATE	"CREATE TABLE %s (value TEXT, id TEXT, PRIMARY KEY (value, id)) WITHOUT ROWID; CREATE INDEX %s_id ON %s(id);"
+#define SQL_ARRAY_TRIGGER_AI	"CREATE TRIGGER %s_ai AFTER INSERT ON %s BEGIN DELETE FROM %s WHERE id = new.id; INSERT OR IGNORE INTO %s (value, id) SELECT json_quote(j.value), new.id FROM json_each(new.value, '$.%s') AS j; END;"
+#define SQL_ARRAY_TRIGGER_AD	"CREATE TRIGGER %s_ad AFTER DELETE ON %s BEGIN DELETE FROM %s WHERE id = old.id; END;"
+#define SQL_ARRAY_POPULATE	"INSERT OR IGNORE INTO %s (value, id) SELECT json_quote(j.value), t.id FROM %s AS t, json_each(t.value, '$.%s') AS j;"
+#define SQL_ARRAY_DROP		"DROP TRIGGER IF EXISTS %s_ai; DROP TRIGGER IF EXISTS %s_ad; DROP TABLE IF EXISTS %s;"
+#define SQL_ARRAY_CONTAINS	"id IN (SELECT id FROM %s_%s WHERE value = json(%Q))"
+#define SQL_OBJECTS		"__objects"
+#define SQL_CREATE_OBJECTS	"CREATE TABLE IF NOT EXISTS __objects (collection TEXT, id TEXT, value TEXT, PRIMARY KEY (collection, id)) WITHOUT ROWID;"
+#define SQL_HAS_OBJECTS		"SELECT name FROM sqlite_master WHERE type = 'table' AND name = '__objects';"
+#define SQL_SINGLE_LIST		"SELECT DISTINCT collection FROM __objects;"
+#define SQL_SINGLE_GET		"SELECT id, value FROM __objects WHERE collection = %Q AND id = ?;"
+#define SQL_SINGLE_INSERT	"INSERT OR REPLACE INTO __objects (collection, id, value) VALUES (%Q, ?, ?);"
+#define SQL_SINGLE_DELETE	"DELETE FROM __objects WHERE collection = %Q AND id = ?;"
+#define SQL_SINGLE_EXISTS	"SELECT 1 FROM __objects WHERE collection = %Q AND id = ?;"
+#define SQL_SINGLE_FIELD	"SELECT json_type(value, ?2), json_extract(value, ?2) FROM __objects WHERE collection = %Q AND id = ?1;"
+#define SQL_SINGLE_IDS		"SELECT id FROM __objects WHERE collection = %Q ORDER BY id;"
+#define SQL_SINGLE_DESTROY	"DELETE FROM __objects WHERE collection = %Q;"
+#define SQL_SINGLE_SCOPE	" FROM __objects WHERE collection = %Q "
+#define SQL_SINGLE_ADD_INDEX(_x) "CREATE INDEX IF NOT EXISTS %s_%s ON __objects(" SQL_EXTRACT(_x) ") WHERE collection = %Q;"
+#define SQL_SINGLE_ARRAY_TRIGGER_AI "CREATE TRIGGER %s_ai AFTER INSERT ON __objects WHEN new.collection = %Q BEGIN DELETE FROM %s WHERE id = new.id; INSERT OR IGNORE INTO %s (value, id) SELECT json_quote(j.value), new.id FROM json_each(new.value, '$.%s') AS j; END;"
+#define SQL_SINGLE_ARRAY_TRIGGER_AD "CREATE TRIGGER %s_ad AFTER DELETE ON __objects WHEN old.collection = %Q BEGIN DELETE FROM %s WHERE id = old.id; END;"
+#define SQL_SINGLE_ARRAY_POPULATE "INSERT OR IGNORE INTO %s (value, id) SELECT json_quote(j.value), t.id FROM __objects AS t, json_each(t.value, '$.%s') AS j WHERE t.collection = %Q;"
+#define SQL_JSON_CONTAINS	"EXISTS (SELECT 1 FROM json_each(value, '$.%s') AS j WHERE json_quote(j.value) = json(%Q))"
 
 struct sqlite_context
 {
 	sqlite3 *		sc_db;
+	struct persist_db *	sc_persist;
 	bool			sc_trace;
-	GHashTable *		sc_stmt_cache;
-	GMutex			sc_mtx;
+	bool			sc_single;
+	GMutex			sc_tx_mtx;
+	GThread *		sc_tx_owner;
+	guint			sc_tx_depth;
+	persist_durability_t	sc_durability;
+	bool			sc_tx_override;
+	GThread *		sc_ckpt_thread;
+	struct sqlite_context *	sc_ckpt;
+	GMutex			sc_ckpt_mtx;
+	GCond			sc_ckpt_cv;
+	bool			sc_ckpt_stop;
+	gint64			sc_ckpt_interval;
+	int64_t			sc_ckpt_limit;
+	uint64_t		sc_ckpt_passive;
+	uint64_t		sc_ckpt_restart;
+	uint64_t		sc_ckpt_truncate;
+	uint64_t		sc_ckpt_busy;
+	uint64_t		sc_ckpt_frames;
+	uint64_t		sc_ckpt_wal_frames;
+	uint64_t		sc_ckpt_time;
+	GPtrArray *		sc_caches;
+	guint			sc_cache_limit;
+	uint64_t		sc_cache_hits;
+	uint64_t		sc_cache_misses;
+	uint64_t		sc_cache_evictions;
+};
+
+struct sqlite_stmt_cache
+{
+	struct sqlite_context *	ssc_sc;
+	GHashTable *		ssc_stmts;
+	GQueue			ssc_lru;
+	GByteArray *		ssc_raw;
+	uint64_t		ssc_entries;
+	uint64_t		ssc_hits;
+	uint64_t		ssc_misses;
+	uint64_t		ssc_evictions;
+};
+
+struct sqlite_filter
+{
+	struct sqlite_context *	sf_sc;
+	const char *		sf_collection;
+	GString *		sf_sql;
 };
 
 struct sqlite_iter
@@ -65,56 +155,171 @@ struct sqlite_operator
 {
 	const char *		so_librpc;
 	const char *		so_sqlite;
+	bool			so_string;
 };
 
 struct sqlite_prepared_stmts
 {
+	char *			sc_collection;
+	GList			sc_link;
 	sqlite3_stmt *		sc_prepared_get;
 	sqlite3_stmt *		sc_prepared_insert;
 	sqlite3_stmt *		sc_prepared_delete;
+	sqlite3_stmt *		sc_prepared_exists;
+	sqlite3_stmt *		sc_prepared_field;
 };
 
-static bool sqlite_eval_logic_and(GString *, rpc_object_t);
-static bool sqlite_eval_logic_or(GString *, rpc_object_t);
-static bool sqlite_eval_logic_nor(GString *, rpc_object_t);
-static bool sqlite_eval_logic_operator(GString *, rpc_object_t);
-static bool sqlite_eval_field_operator(GString *, rpc_object_t);
-static bool sqlite_eval_rule(GString *, rpc_object_t);
+static bool sqlite_eval_logic(struct sqlite_filter *, struct persist_filter *,
+    const char *);
+static bool sqlite_eval_node(struct sqlite_filter *, struct persist_filter *);
+static bool sqlite_eval_field_operator(struct sqlite_filter *,
+    struct persist_filter *);
+static bool sqlite_eval_search(struct sqlite_filter *, const char *,
+    rpc_object_t);
+static bool sqlite_eval_contains(struct sqlite_filter *, const char *,
+    rpc_object_t);
+static bool sqlite_eval_in(struct sqlite_filter *, const char *,
+    rpc_object_t);
+static char *sqlite_dump_json(rpc_object_t);
+static void sqlite_append_printf(GString *, const char *, ...);
+static bool sqlite_eval_source(struct sqlite_context *, const char *,
+    GString *, rpc_object_t);
+static bool sqlite_eval_filter(struct sqlite_context *, const char *,
+    GString *, rpc_object_t);
+static char *sqlite_select_text(struct sqlite_context *, const char *);
+static char *sqlite_find_index(struct sqlite_context *, const char *,
+    const char *, persist_index_type_t);
+static char *sqlite_get_index_type(struct sqlite_context *, const char *,
+    const char *);
+static void sqlite_regexp(sqlite3_context *, int, sqlite3_value **);
 static int sqlite_trace_callback(unsigned int, void *, void *, void *);
 static int sqlite_exec(struct sqlite_context *, const char *);
-static int sqlite_unpack(sqlite3_stmt *, char **, rpc_object_t *);
+static int sqlite_unpack(sqlite3_stmt *, const char **, rpc_object_t *);
+static int sqlite_unpack_raw(sqlite3_stmt *, const char **,
+    struct persist_raw *);
+static rpc_object_t sqlite_column_object(sqlite3_stmt *, int);
+static struct sqlite_stmt_cache *sqlite_get_stmt_cache(
+    struct sqlite_context *);
+static void sqlite_stmt_cache_free(struct sqlite_stmt_cache *);
+static void sqlite_stmt_cache_evict(struct sqlite_stmt_cache *,
+    struct sqlite_prepared_stmts *);
+static void sqlite_stmt_cache_clear(struct sqlite_stmt_cache *);
 static struct sqlite_prepared_stmts *sqlite_get_prepared_stmts(
     struct sqlite_context *, const char *);
 static void sqlite_free_prepared_stmts(struct sqlite_prepared_stmts *);
 static int sqlite_open(struct persist_db *);
+static int sqlite_init_functions(struct sqlite_context *);
+static int sqlite_init_tuning(struct persist_db *, struct sqlite_context *);
+static int sqlite_get_tunable(struct persist_db *, const char *, int64_t *);
+static int sqlite_init_durability(struct persist_db *,
+    struct sqlite_context *);
+static int sqlite_set_sync(struct sqlite_context *, persist_durability_t);
+static int sqlite_init_checkpoint(struct persist_db *,
+    struct sqlite_context *);
+static gpointer sqlite_checkpoint_worker(gpointer);
+static void sqlite_checkpoint(struct sqlite_context *);
+static void sqlite_context_free(struct sqlite_context *);
+static struct sqlite_context *sqlite_open_private(struct sqlite_context *,
+    int);
+static void *sqlite_open_reader(void *);
+static void sqlite_close_reader(void *);
+static int sqlite_begin_snapshot(void *);
+static int sqlite_begin_snapshots(void *, void **, guint);
+static int sqlite_get_splits(void *, const char *, guint, GPtrArray *);
 static void sqlite_close(struct persist_db *);
 static int sqlite_create_collection(void *, const char *);
 static int sqlite_destroy_collection(void *, const char *);
 static int sqlite_get_collections(void *, GPtrArray *);
-static int sqlite_add_index(void *, const char *, const char *, const char *);
+static int sqlite_add_index(void *, const char *, const char *, const char *,
+    persist_index_type_t);
 static int sqlite_drop_index(void *, const char *, const char *);
 static int sqlite_get_object(void *, const char *, const char *, rpc_object_t *);
+static int sqlite_get_raw(void *, const char *, const char *,
+    struct persist_raw *);
+static int sqlite_fetch(struct sqlite_context *, const char *, const char *,
+    rpc_object_t *, struct persist_raw *);
 static int sqlite_save_object(void *, const char *, const char *, rpc_object_t);
 static int sqlite_save_objects(void *, const char *, rpc_object_t);
 static int sqlite_delete_object(void *, const char *, const char *);
-static int sqlite_start_tx(void *);
+static int sqlite_get_field(void *, const char *, const char *, const char *,
+    rpc_object_t *);
+static int sqlite_get_field_decoded(struct sqlite_context *, const char *,
+    const char *, const char *, rpc_object_t *);
+static char *sqlite_json_path(const char *);
+static int sqlite_exists(void *, const char *, const char *);
+static guint sqlite_tx_depth(struct sqlite_context *);
+static bool sqlite_tx_owned(struct sqlite_context *, guint);
+static void sqlite_end_override(struct sqlite_context *);
+static int sqlite_start_tx(void *, persist_durability_t);
 static int sqlite_commit_tx(void *);
 static int sqlite_rollback_tx(void *);
 static bool sqlite_in_tx(void *);
 static ssize_t sqlite_count(void *, const char *, rpc_object_t);
+static rpc_object_t sqlite_aggregate(void *, const char *, rpc_object_t,
+    rpc_object_t, rpc_object_t);
+static rpc_object_t sqlite_distinct(void *, const char *, const char *,
+    rpc_object_t, uint64_t);
 static void *sqlite_query(void *, const char *, rpc_object_t, persist_query_params_t);
-static int sqlite_query_next(void *, char **id, rpc_object_t *);
+static void *sqlite_query_range(void *, const char *, rpc_object_t,
+    persist_query_params_t, const char *, const char *);
+static int sqlite_query_next(void *, const char **id, rpc_object_t *);
+static int sqlite_query_next_raw(void *, const char **, struct persist_raw *);
+static const char *sqlite_query_sort_key(void *);
 static void sqlite_query_close(void *);
+static rpc_object_t sqlite_get_stats(void *);
+static int sqlite_backup(void *, const char *, persist_backup_cb_t);
+
+static const char *sqlite_sync_levels[] = {
+	[PERSIST_DURABILITY_DEFAULT] = "FULL",
+	[PERSIST_DURABILITY_FULL] = "FULL",
+	[PERSIST_DURABILITY_NORMAL] = "NORMAL",
+	[PERSIST_DURABILITY_OFF] = "OFF",
+};
+
+static const char *sqlite_tunables[] = {
+	"page_size",
+	"cache_size",
+	"mmap_size",
+	"wal_autocheckpoint",
+	"journal_size_limit",
+	NULL
+};
+
+static const char *const sqlite_temp_stores[] = {
+	"default",
+	"file",
+	"memory",
+	NULL
+};
 
 static const struct sqlite_operator sqlite_operator_table[] = {
-	{ "=", "=" },
-	{ "!=", "!=" },
-	{ ">", ">" },
-	{ ">=", ">=" },
-	{ "<" , "<" },
-	{ "<=", "<=" },
-	{ "~", "REGEXP" },
-	{ "match", "GLOB" },
+	{ "=", "=", false },
+	{ "!=", "!=", false },
+	{ ">", ">", false },
+	{ ">=", ">=", false },
+	{ "<", "<", false },
+	{ "<=", "<=", false },
+	{ "~", "REGEXP", true },
+	{ "match", "GLOB", true },
+	{ }
+};
+
+static const char *sqlite_index_types[] = {
+	[PERSIST_INDEX_VALUE] = "value",
+	[PERSIST_INDEX_FULLTEXT] = "fulltext",
+	[PERSIST_INDEX_ARRAY] = "array",
+};
+
+static GMutex sqlite_cache_mtx;
+static GPrivate sqlite_thread_caches = G_PRIVATE_INIT(
+    (GDestroyNotify)g_hash_table_destroy);
+
+static const struct sqlite_operator sqlite_aggregate_table[] = {
+	{ "count", "count", false },
+	{ "sum", "sum", false },
+	{ "min", "min", false },
+	{ "max", "max", false },
+	{ "avg", "avg", false },
 	{ }
 };
 
@@ -142,6 +347,48 @@ sqlite_trace_callback(unsigned int code, void *ctx, void *p, void *x)
 	g_assert_not_reached();
 }
 
+static void
+sqlite_regexp(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	GRegex *regex;
+	GError *err = NULL;
+	const char *pattern;
+	const char *text;
+	bool compiled = false;
+
+	/*
+	 * The pattern is compiled once per statement and kept around
+	 * as auxiliary data for as long as the argument stays constant.
+	 */
+	regex = sqlite3_get_auxdata(ctx, 0);
+	if (regex == NULL) {
+		pattern = (const char *)sqlite3_value_text(argv[0]);
+		if (pattern == NULL) {
+			sqlite3_result_null(ctx);
+			return;
+		}
+
+		regex = g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, &err);
+		if (regex == NULL) {
+			sqlite3_result_error(ctx, err->message, -1);
+			g_error_free(err);
+			return;
+		}
+
+		compiled = true;
+	}
+
+	text = (const char *)sqlite3_value_text(argv[1]);
+	if (text == NULL)
+		sqlite3_result_null(ctx);
+	else
+		sqlite3_result_int(ctx, g_regex_match(regex, text, 0, NULL));
+
+	/* Has to come last: sqlite may destroy the regex right away */
+	if (compiled)
+		sqlite3_set_auxdata(ctx, 0, regex, (void (*)(void *))g_regex_unref);
+}
+
 static int
 sqlite_exec(struct sqlite_context *ctx, const char *sql)
 {
@@ -169,82 +416,310 @@ sqlite_exec(struct sqlite_context *ctx, const char *sql)
 	return (0);
 }
 
+static char *
+sqlite_select_text(struct sqlite_context *sqlite, const char *sql)
+{
+	sqlite3_stmt *stmt;
+	char *result = NULL;
+
+	if (sqlite3_prepare_v2(sqlite->sc_db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s", sqlite3_errmsg(sqlite->sc_db));
+		return (NULL);
+	}
+
+retry:
+	switch (sqlite3_step(stmt)) {
+	case SQLITE_ROW:
+		result = g_strdup((const char *)sqlite3_column_text(stmt, 0));
+		break;
+
+	case SQLITE_LOCKED:
+	case SQLITE_BUSY:
+		g_usleep(SQLITE_YIELD_DELAY);
+		goto retry;
+
+	default:
+		break;
+	}
+
+	sqlite3_finalize(stmt);
+	return (result);
+}
+
+static char *
+sqlite_find_index(struct sqlite_context *sqlite, const char *collection,
+    const char *path, persist_index_type_t type)
+{
+	char *sql;
+	char *result;
+
+	sql = sqlite3_mprintf(SQL_FIND_INDEX, collection, path,
+	    sqlite_index_types[type]);
+	result = sqlite_select_text(sqlite, sql);
+	sqlite3_free(sql);
+	return (result);
+}
+
+static char *
+sqlite_get_index_type(struct sqlite_context *sqlite, const char *collection,
+    const char *name)
+{
+	char *sql;
+	char *result;
+
+	sql = sqlite3_mprintf(SQL_GET_INDEX_TYPE, collection, name);
+	result = sqlite_select_text(sqlite, sql);
+	sqlite3_free(sql);
+	return (result);
+}
+
 static int
-sqlite_unpack(sqlite3_stmt *stmt, char **idp, rpc_object_t *result)
+sqlite_unpack(sqlite3_stmt *stmt, const char **idp, rpc_object_t *result)
 {
-	const uint8_t *id;
 	const void *blob;
 	size_t len;
 	rpc_object_t obj;
 
-	id = sqlite3_column_text(stmt, 0);
+	/* The id stays valid until the statement is stepped or reset */
+	if (idp != NULL)
+		*idp = (const char *)sqlite3_column_text(stmt, 0);
+
+	if (result == NULL)
+		return (0);
+
 	blob = sqlite3_column_text(stmt, 1);
 	len = (size_t)sqlite3_column_bytes(stmt, 1);
 
 	if (blob == NULL) {
-		persist_set_last_error(EINVAL, "Inconsistent database state");
+		persist_set_last_error_static(EINVAL,
+		    "Inconsistent database state");
 		return (-1);
 	}
 
 	obj = rpc_serializer_load("json", blob, len);
 	if (obj == NULL) {
 		obj = rpc_get_last_error();
-		persist_set_last_error(rpc_error_get_code(obj),
+		persist_set_last_error(rpc_error_get_code(obj), "%s",
 		    rpc_error_get_message(obj));
-
+		return (-1);
 	}
 
+	*result = obj;
+	return (0);
+}
+
+static int
+sqlite_unpack_raw(sqlite3_stmt *stmt, const char **idp,
+    struct persist_raw *raw)
+{
+
 	if (idp != NULL)
-		*idp = g_strdup((const char *)id);
+		*idp = (const char *)sqlite3_column_text(stmt, 0);
 
-	if (result != NULL)
-		*result = obj;
+	raw->format = "json";
+	raw->data = sqlite3_column_text(stmt, 1);
+	raw->len = (size_t)sqlite3_column_bytes(stmt, 1);
+
+	if (raw->data == NULL) {
+		persist_set_last_error_static(EINVAL,
+		    "Inconsistent database state");
+		return (-1);
+	}
 
 	return (0);
 }
 
+static rpc_object_t
+sqlite_column_object(sqlite3_stmt *stmt, int column)
+{
+
+	switch (sqlite3_column_type(stmt, column)) {
+	case SQLITE_INTEGER:
+		return (rpc_int64_create(sqlite3_column_int64(stmt, column)));
+
+	case SQLITE_FLOAT:
+		return (rpc_double_create(sqlite3_column_double(stmt, column)));
+
+	case SQLITE_TEXT:
+		return (rpc_string_create(
+		    (const char *)sqlite3_column_text(stmt, column)));
+
+	default:
+		return (rpc_null_create());
+	}
+}
+
+/*
+ * Every thread gets its own set of prepared statements per database,
+ * so that lookups don't take any locks and concurrent readers never
+ * share statement state. sqlite_cache_mtx only guards creation and
+ * destruction of per-thread caches.
+ */
+static struct sqlite_stmt_cache *
+sqlite_get_stmt_cache(struct sqlite_context *sqlite)
+{
+	struct sqlite_stmt_cache *cache;
+	GHashTable *caches;
+
+	caches = g_private_get(&sqlite_thread_caches);
+	if (caches == NULL) {
+		caches = g_hash_table_new_full(NULL, NULL, NULL,
+		    (GDestroyNotify)sqlite_stmt_cache_free);
+		g_private_set(&sqlite_thread_caches, caches);
+	}
+
+	/* A stale cache may be left behind by a closed database */
+	cache = g_hash_table_lookup(caches, sqlite);
+	if (cache != NULL && cache->ssc_sc == sqlite)
+		return (cache);
+
+	cache = g_malloc0(sizeof(*cache));
+	cache->ssc_sc = sqlite;
+	cache->ssc_stmts = g_hash_table_new(g_str_hash, g_str_equal);
+	g_queue_init(&cache->ssc_lru);
+
+	g_mutex_lock(&sqlite_cache_mtx);
+	g_ptr_array_add(sqlite->sc_caches, cache);
+	g_mutex_unlock(&sqlite_cache_mtx);
+
+	g_hash_table_replace(caches, sqlite, cache);
+	return (cache);
+}
+
+static void
+sqlite_stmt_cache_free(struct sqlite_stmt_cache *cache)
+{
+
+	g_mutex_lock(&sqlite_cache_mtx);
+	if (cache->ssc_sc != NULL) {
+		g_ptr_array_remove_fast(cache->ssc_sc->sc_caches, cache);
+		cache->ssc_sc->sc_cache_hits += cache->ssc_hits;
+		cache->ssc_sc->sc_cache_misses += cache->ssc_misses;
+		cache->ssc_sc->sc_cache_evictions += cache->ssc_evictions;
+	}
+
+	sqlite_stmt_cache_clear(cache);
+	g_mutex_unlock(&sqlite_cache_mtx);
+	g_hash_table_destroy(cache->ssc_stmts);
+
+	if (cache->ssc_raw != NULL)
+		g_byte_array_unref(cache->ssc_raw);
+
+	g_free(cache);
+}
+
+static void
+sqlite_stmt_cache_evict(struct sqlite_stmt_cache *cache,
+    struct sqlite_prepared_stmts *stmts)
+{
+
+	g_queue_unlink(&cache->ssc_lru, &stmts->sc_link);
+	g_hash_table_remove(cache->ssc_stmts, stmts->sc_collection);
+	__atomic_sub_fetch(&cache->ssc_entries, 1, __ATOMIC_RELAXED);
+	sqlite_free_prepared_stmts(stmts);
+}
+
+static void
+sqlite_stmt_cache_clear(struct sqlite_stmt_cache *cache)
+{
+	GList *link;
+
+	while ((link = g_queue_peek_head_link(&cache->ssc_lru)) != NULL)
+		sqlite_stmt_cache_evict(cache, link->data);
+}
+
 static struct sqlite_prepared_stmts *
 sqlite_get_prepared_stmts(struct sqlite_context *sqlite, const char *col)
 {
+	struct sqlite_stmt_cache *cache;
 	struct sqlite_prepared_stmts *stmts;
-	g_autofree char *get_sql = NULL;
-	g_autofree char *insert_sql = NULL;
-	g_autofree char *delete_sql = NULL;
-
-	g_mutex_lock(&sqlite->sc_mtx);
-
-retry:
-	stmts = g_hash_table_lookup(sqlite->sc_stmt_cache, col);
+	char *get_sql;
+	char *insert_sql;
+	char *delete_sql;
+	char *exists_sql;
+	char *field_sql;
+	int ret = SQLITE_OK;
+
+	cache = sqlite_get_stmt_cache(sqlite);
+	stmts = g_hash_table_lookup(cache->ssc_stmts, col);
 	if (stmts != NULL) {
-		g_mutex_unlock(&sqlite->sc_mtx);
+		__atomic_add_fetch(&cache->ssc_hits, 1, __ATOMIC_RELAXED);
+		g_queue_unlink(&cache->ssc_lru, &stmts->sc_link);
+		g_queue_push_head_link(&cache->ssc_lru, &stmts->sc_link);
 		return (stmts);
 	}
 
+	__atomic_add_fetch(&cache->ssc_misses, 1, __ATOMIC_RELAXED);
 	stmts = g_malloc0(sizeof(*stmts));
-	get_sql = g_strdup_printf(SQL_GET, col);
-	insert_sql = g_strdup_printf(SQL_INSERT, col);
-	delete_sql = g_strdup_printf(SQL_DELETE, col);
+	stmts->sc_collection = g_strdup(col);
+	stmts->sc_link.data = stmts;
+
+	if (sqlite->sc_single) {
+		get_sql = sqlite3_mprintf(SQL_SINGLE_GET, col);
+		insert_sql = sqlite3_mprintf(SQL_SINGLE_INSERT, col);
+		delete_sql = sqlite3_mprintf(SQL_SINGLE_DELETE, col);
+		exists_sql = sqlite3_mprintf(SQL_SINGLE_EXISTS, col);
+		field_sql = sqlite3_mprintf(SQL_SINGLE_FIELD, col);
+	} else {
+		get_sql = sqlite3_mprintf(SQL_GET, col);
+		insert_sql = sqlite3_mprintf(SQL_INSERT, col);
+		delete_sql = sqlite3_mprintf(SQL_DELETE, col);
+		exists_sql = sqlite3_mprintf(SQL_EXISTS, col);
+		field_sql = sqlite3_mprintf(SQL_FIELD, col);
+	}
 
-	if (sqlite3_prepare_v2(sqlite->sc_db, get_sql, -1,
-	    &stmts->sc_prepared_get, NULL) != SQLITE_OK) {
-		persist_set_last_error(errno, "%s", sqlite3_errmsg(sqlite->sc_db));
-		return (NULL);
+	if (ret == SQLITE_OK) {
+		ret = sqlite3_prepare_v2(sqlite->sc_db, get_sql, -1,
+		    &stmts->sc_prepared_get, NULL);
 	}
 
-	if (sqlite3_prepare_v2(sqlite->sc_db, insert_sql, -1,
-	    &stmts->sc_prepared_insert, NULL) != SQLITE_OK) {
-		persist_set_last_error(errno, "%s", sqlite3_errmsg(sqlite->sc_db));
-		return (NULL);
+	if (ret == SQLITE_OK) {
+		ret = sqlite3_prepare_v2(sqlite->sc_db, insert_sql, -1,
+		    &stmts->sc_prepared_insert, NULL);
 	}
 
-	if (sqlite3_prepare_v2(sqlite->sc_db, delete_sql, -1,
-	    &stmts->sc_prepared_delete, NULL) != SQLITE_OK) {
-		persist_set_last_error(errno, "%s", sqlite3_errmsg(sqlite->sc_db));
-		return (NULL);
+	if (ret == SQLITE_OK) {
+		ret = sqlite3_prepare_v2(sqlite->sc_db, delete_sql, -1,
+		    &stmts->sc_prepared_delete, NULL);
+	}
+
+	if (ret == SQLITE_OK) {
+		ret = sqlite3_prepare_v2(sqlite->sc_db, exists_sql, -1,
+		    &stmts->sc_prepared_exists, NULL);
+	}
+
+	if (ret == SQLITE_OK) {
+		ret = sqlite3_prepare_v2(sqlite->sc_db, field_sql, -1,
+		    &stmts->sc_prepared_field, NULL);
+	}
+
+	sqlite3_free(get_sql);
+	sqlite3_free(insert_sql);
+	sqlite3_free(delete_sql);
+	sqlite3_free(exists_sql);
+	sqlite3_free(field_sql);
+
+	if (ret != SQLITE_OK)
+		goto error;
+
+	/* Keep memory flat no matter how many collections get touched */
+	if (sqlite->sc_cache_limit > 0 &&
+	    cache->ssc_lru.length >= sqlite->sc_cache_limit) {
+		__atomic_add_fetch(&cache->ssc_evictions, 1,
+		    __ATOMIC_RELAXED);
+		sqlite_stmt_cache_evict(cache,
+		    g_queue_peek_tail_link(&cache->ssc_lru)->data);
 	}
 
-	g_hash_table_insert(sqlite->sc_stmt_cache, g_strdup(col), stmts);
-	goto retry;
+	g_hash_table_insert(cache->ssc_stmts, stmts->sc_collection, stmts);
+	g_queue_push_head_link(&cache->ssc_lru, &stmts->sc_link);
+	__atomic_add_fetch(&cache->ssc_entries, 1, __ATOMIC_RELAXED);
+	return (stmts);
+
+error:
+	persist_set_last_error(EFAULT, "%s", sqlite3_errmsg(sqlite->sc_db));
+	sqlite_free_prepared_stmts(stmts);
+	return (NULL);
 }
 
 static void
@@ -254,6 +729,9 @@ sqlite_free_prepared_stmts(struct sqlite_prepared_stmts *stmts)
 	sqlite3_finalize(stmts->sc_prepared_get);
 	sqlite3_finalize(stmts->sc_prepared_insert);
 	sqlite3_finalize(stmts->sc_prepared_delete);
+	sqlite3_finalize(stmts->sc_prepared_exists);
+	sqlite3_finalize(stmts->sc_prepared_field);
+	g_free(stmts->sc_collection);
 	g_free(stmts);
 }
 
@@ -261,6 +739,9 @@ static int
 sqlite_open(struct persist_db *db)
 {
 	struct sqlite_context *ctx;
+	g_autofree char *existing = NULL;
+	const char *storage;
+	int64_t cache_limit;
 	int err;
 
 	err = sqlite3_enable_shared_cache(1);
@@ -268,6 +749,8 @@ sqlite_open(struct persist_db *db)
 		abort();
 
 	ctx = g_malloc0(sizeof(*ctx));
+	ctx->sc_persist = db;
+	g_mutex_init(&ctx->sc_tx_mtx);
 
 	err = sqlite3_open(db->pdb_path, &ctx->sc_db);
 	if (err != SQLITE_OK) {
@@ -283,156 +766,1132 @@ sqlite_open(struct persist_db *db)
 		ctx->sc_trace = true;
 	}
 
+	if (persist_get_param_int(db, "stmt_cache_size",
+	    SQLITE_STMT_CACHE_SIZE, &cache_limit) != 0 || cache_limit < 0) {
+		persist_set_last_error_static(EINVAL,
+		    "Invalid stmt_cache_size value");
+		sqlite3_close(ctx->sc_db);
+		g_free(ctx);
+		return (-1);
+	}
+
+	/* Page size has to be picked before the database switches to WAL */
+	if (sqlite_init_tuning(db, ctx) != 0) {
+		sqlite3_close(ctx->sc_db);
+		g_free(ctx);
+		return (-1);
+	}
+
 	if (sqlite_exec(ctx, "PRAGMA journal_mode=WAL;") != 0) {
 		sqlite3_close(ctx->sc_db);
 		g_free(ctx);
 		return (-1);
 	}
 
-	g_mutex_init(&ctx->sc_mtx);
-	ctx->sc_stmt_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
-	    (GDestroyNotify)g_free, (GDestroyNotify)sqlite_free_prepared_stmts);
+	if (sqlite_exec(ctx, SQL_CREATE_INDEXES) != 0) {
+		sqlite3_close(ctx->sc_db);
+		g_free(ctx);
+		return (-1);
+	}
 
-	db->pdb_arg = ctx;
-	return (0);
-}
+	/* Without an explicit choice, stick to what the file already uses */
+	storage = persist_get_param_string(db, "storage", NULL);
+	if (storage == NULL) {
+		existing = sqlite_select_text(ctx, SQL_HAS_OBJECTS);
+		ctx->sc_single = existing != NULL;
+	} else if (g_strcmp0(storage, "single-table") == 0)
+		ctx->sc_single = true;
+	else if (g_strcmp0(storage, "tables") != 0) {
+		persist_set_last_error(EINVAL, "Invalid storage mode: %s",
+		    storage);
+		sqlite3_close(ctx->sc_db);
+		g_free(ctx);
+		return (-1);
+	}
 
-static void
-sqlite_close(struct persist_db *db)
-{
-	struct sqlite_context *ctx;
+	if (ctx->sc_single && sqlite_exec(ctx, SQL_CREATE_OBJECTS) != 0) {
+		sqlite3_close(ctx->sc_db);
+		g_free(ctx);
+		return (-1);
+	}
 
-	ctx = db->pdb_arg;
-	sqlite3_close(ctx->sc_db);
-	g_hash_table_destroy(ctx->sc_stmt_cache);
-	g_mutex_clear(&ctx->sc_mtx);
-	g_free(ctx);
-}
+	if (sqlite_init_functions(ctx) != 0) {
+		sqlite3_close(ctx->sc_db);
+		g_free(ctx);
+		return (-1);
+	}
 
-static int
-sqlite_create_collection(void *arg, const char *name)
-{
-	struct sqlite_context *sqlite = arg;
-	g_autofree char *sql = g_strdup_printf(SQL_CREATE_TABLE, name);
+	if (sqlite_init_durability(db, ctx) != 0) {
+		sqlite3_close(ctx->sc_db);
+		g_free(ctx);
+		return (-1);
+	}
 
-	return (sqlite_exec(sqlite, sql));
+	if (sqlite_init_checkpoint(db, ctx) != 0) {
+		sqlite3_close(ctx->sc_db);
+		g_free(ctx);
+		return (-1);
+	}
+
+	ctx->sc_caches = g_ptr_array_new();
+	ctx->sc_cache_limit = (guint)cache_limit;
+
+	db->pdb_arg = ctx;
+	return (0);
 }
 
 static int
-sqlite_destroy_collection(void *arg, const char *name)
+sqlite_init_functions(struct sqlite_context *ctx)
 {
-	struct sqlite_context *sqlite = arg;
-	g_autofree char *sql = g_strdup_printf(SQL_DROP_TABLE, name);
+	int err;
 
-	return (sqlite_exec(sqlite, sql));
+	err = sqlite3_create_function_v2(ctx->sc_db, "regexp", 2,
+	    SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sqlite_regexp, NULL,
+	    NULL, NULL);
+	if (err != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s", sqlite3_errstr(err));
+		return (-1);
+	}
+
+	return (0);
 }
 
 static int
-sqlite_get_collections(void *arg, GPtrArray *result)
+sqlite_init_tuning(struct persist_db *db, struct sqlite_context *ctx)
 {
-	struct sqlite_context *sqlite = arg;
-	sqlite3_stmt *stmt;
-	char *name;
+	const char *store;
+	int64_t value;
+	int64_t size;
+	char sql[128];
+	guint i;
+	int ret;
 
-	if (sqlite3_prepare_v2(sqlite->sc_db, SQL_LIST_TABLES, -1,
-	    &stmt, NULL) != SQLITE_OK) {
-		persist_set_last_error(errno, "%s", sqlite3_errmsg(sqlite->sc_db));
+	/* Lookaside can't be resized once the connection has used it */
+	ret = sqlite_get_tunable(db, "lookaside", &value);
+	if (ret < 0)
 		return (-1);
+
+	if (ret > 0) {
+		if (persist_get_param_int(db, "lookaside_slot_size",
+		    SQLITE_LOOKASIDE_SIZE, &size) != 0)
+			return (-1);
+
+		ret = sqlite3_db_config(ctx->sc_db, SQLITE_DBCONFIG_LOOKASIDE,
+		    NULL, (int)size, (int)value);
+		if (ret != SQLITE_OK) {
+			persist_set_last_error(EINVAL, "%s",
+			    sqlite3_errstr(ret));
+			return (-1);
+		}
 	}
 
-	for (;;) {
-		retry:
-		switch (sqlite3_step(stmt)) {
-		case SQLITE_ROW:
-			name = (char *)sqlite3_column_text(stmt, 2);
-			g_ptr_array_add(result, name);
-			continue;
+	for (i = 0; sqlite_tunables[i] != NULL; i++) {
+		ret = sqlite_get_tunable(db, sqlite_tunables[i], &value);
+		if (ret < 0)
+			return (-1);
 
-		case SQLITE_LOCKED:
-		case SQLITE_BUSY:
-			g_usleep(SQLITE_YIELD_DELAY);
-			goto retry;
+		if (ret == 0)
+			continue;
 
-		case SQLITE_DONE:
-			goto endloop;
+		g_snprintf(sql, sizeof(sql), "PRAGMA %s=%" PRId64 ";",
+		    sqlite_tunables[i], value);
 
-		default:
-			persist_set_last_error(EFAULT, "%s",
-			    sqlite3_errmsg(sqlite->sc_db));
-			sqlite3_finalize(stmt);
+		if (sqlite_exec(ctx, sql) != 0)
 			return (-1);
-		}
+	}
 
-endloop:
-		break;
+	if (persist_get_param(db, "temp_store") == NULL)
+		return (0);
+
+	store = persist_get_param_string(db, "temp_store", NULL);
+	if (store == NULL || !g_strv_contains(sqlite_temp_stores, store)) {
+		persist_set_last_error_static(EINVAL,
+		    "Invalid temp_store value");
+		return (-1);
 	}
 
-	sqlite3_finalize(stmt);
-	return (0);
+	g_snprintf(sql, sizeof(sql), "PRAGMA temp_store=%s;", store);
+	return (sqlite_exec(ctx, sql));
 }
 
 static int
-sqlite_add_index(void *arg, const char *collection, const char *name,
-    const char *path)
+sqlite_get_tunable(struct persist_db *db, const char *name, int64_t *result)
 {
-	struct sqlite_context *sqlite = arg;
-	g_autofree char *sql = g_strdup_printf(SQL_ADD_INDEX("%s"),
-	    collection, name, collection, path);
 
-	return (sqlite_exec(sqlite, sql));
+	if (persist_get_param(db, name) == NULL)
+		return (0);
+
+	if (persist_get_param_int(db, name, 0, result) != 0)
+		return (-1);
+
+	return (1);
 }
 
 static int
-sqlite_drop_index(void *arg, const char *collection, const char *name)
+sqlite_init_durability(struct persist_db *db, struct sqlite_context *ctx)
 {
-	struct sqlite_context *sqlite = arg;
-	g_autofree char *sql = g_strdup_printf(SQL_DROP_INDEX, collection,
-	    name);
+	const char *durability;
+	int64_t interval;
+
+	durability = persist_get_param_string(db, "durability", "full");
+	if (g_strcmp0(durability, "full") == 0)
+		ctx->sc_durability = PERSIST_DURABILITY_FULL;
+	else if (g_strcmp0(durability, "normal") == 0)
+		ctx->sc_durability = PERSIST_DURABILITY_NORMAL;
+	else if (g_strcmp0(durability, "off") == 0)
+		ctx->sc_durability = PERSIST_DURABILITY_OFF;
+	else if (g_strcmp0(durability, "periodic") == 0) {
+		ctx->sc_durability = PERSIST_DURABILITY_NORMAL;
+		if (persist_get_param_int(db, "durability_interval",
+		    SQLITE_SYNC_INTERVAL, &interval) != 0)
+			return (-1);
 
-	return (sqlite_exec(sqlite, sql));
+		ctx->sc_ckpt_interval = interval * 1000;
+		if (ctx->sc_ckpt_interval <= 0) {
+			persist_set_last_error_static(EINVAL,
+			    "Invalid durability interval");
+			return (-1);
+		}
+	} else {
+		persist_set_last_error(EINVAL, "Invalid durability mode: %s",
+		    durability);
+		return (-1);
+	}
+
+	return (sqlite_set_sync(ctx, ctx->sc_durability));
 }
 
 static int
-sqlite_get_object(void *arg, const char *collection, const char *id,
-    rpc_object_t *obj)
+sqlite_set_sync(struct sqlite_context *ctx, persist_durability_t durability)
 {
-	struct sqlite_context *sqlite = arg;
+	char sql[64];
+
+	g_snprintf(sql, sizeof(sql), "PRAGMA synchronous=%s;",
+	    sqlite_sync_levels[durability]);
+
+	return (sqlite_exec(ctx, sql));
+}
+
+static int
+sqlite_init_checkpoint(struct persist_db *db, struct sqlite_context *ctx)
+{
+	const char *mode;
+	const char *path;
+	int64_t interval;
+
+	g_mutex_init(&ctx->sc_ckpt_mtx);
+	g_cond_init(&ctx->sc_ckpt_cv);
+
+	mode = persist_get_param_string(db, "checkpoint", "inline");
+	if (g_strcmp0(mode, "background") == 0) {
+		if (persist_get_param_int(db, "checkpoint_interval",
+		    SQLITE_CKPT_INTERVAL, &interval) != 0)
+			return (-1);
+
+		if (persist_get_param_int(db, "checkpoint_limit",
+		    SQLITE_CKPT_LIMIT, &ctx->sc_ckpt_limit) != 0)
+			return (-1);
+
+		interval *= 1000;
+		if (interval <= 0 || ctx->sc_ckpt_limit <= 0) {
+			persist_set_last_error_static(EINVAL,
+			    "Invalid checkpoint settings");
+			return (-1);
+		}
+
+		/* Committing writers no longer checkpoint by themselves */
+		if (sqlite_exec(ctx, "PRAGMA wal_autocheckpoint=0;") != 0)
+			return (-1);
+
+		if (ctx->sc_ckpt_interval == 0 ||
+		    interval < ctx->sc_ckpt_interval)
+			ctx->sc_ckpt_interval = interval;
+	} else if (g_strcmp0(mode, "inline") != 0) {
+		persist_set_last_error(EINVAL, "Invalid checkpoint mode: %s",
+		    mode);
+		return (-1);
+	}
+
+	/* In-memory databases have no log to checkpoint */
+	path = sqlite3_db_filename(ctx->sc_db, "main");
+	if (ctx->sc_ckpt_interval == 0 || path == NULL || *path == '\0')
+		return (0);
+
+	/*
+	 * Checkpointing through the main connection would hold its mutex,
+	 * and with it every writer, until the checkpoint is done.
+	 */
+	ctx->sc_ckpt = sqlite_open_private(ctx, SQLITE_OPEN_READWRITE);
+	if (ctx->sc_ckpt == NULL)
+		return (-1);
+
+	ctx->sc_ckpt_thread = g_thread_new("persist checkpoint",
+	    sqlite_checkpoint_worker, ctx);
+	return (0);
+}
+
+/*
+ * With synchronous=NORMAL, the WAL is only synced by checkpoints, so
+ * running one periodically bounds the window of commits lost on power
+ * failure. In background mode, the same thread takes over the work
+ * writers would otherwise do inline when committing.
+ */
+static gpointer
+sqlite_checkpoint_worker(gpointer arg)
+{
+	struct sqlite_context *ctx = arg;
+	gint64 deadline;
+
+	g_mutex_lock(&ctx->sc_ckpt_mtx);
+	while (!ctx->sc_ckpt_stop) {
+		deadline = g_get_monotonic_time() + ctx->sc_ckpt_interval;
+		if (g_cond_wait_until(&ctx->sc_ckpt_cv, &ctx->sc_ckpt_mtx,
+		    deadline) || ctx->sc_ckpt_stop)
+			continue;
+
+		g_mutex_unlock(&ctx->sc_ckpt_mtx);
+		sqlite_checkpoint(ctx);
+		g_mutex_lock(&ctx->sc_ckpt_mtx);
+	}
+
+	g_mutex_unlock(&ctx->sc_ckpt_mtx);
+	return (NULL);
+}
+
+/*
+ * A passive checkpoint never waits on readers or writers, but can't
+ * restart the WAL while they hold on to it. Once the log grows past
+ * the limit, a restart makes the next writer wrap around to its start
+ * and, if it got way past it, truncating gives the disk space back.
+ */
+static void
+sqlite_checkpoint(struct sqlite_context *ctx)
+{
+	uint64_t *counter;
+	gint64 start;
+	int mode = SQLITE_CHECKPOINT_PASSIVE;
+	int nlog = 0;
+	int nckpt = 0;
+	int ret;
+
+	start = g_get_monotonic_time();
+	ret = sqlite3_wal_checkpoint_v2(ctx->sc_ckpt->sc_db, NULL, mode,
+	    &nlog, &nckpt);
+
+	if (ret == SQLITE_OK && ctx->sc_ckpt_limit > 0 &&
+	    nlog >= ctx->sc_ckpt_limit) {
+		mode = nlog >= ctx->sc_ckpt_limit * 4 ?
+		    SQLITE_CHECKPOINT_TRUNCATE : SQLITE_CHECKPOINT_RESTART;
+		ret = sqlite3_wal_checkpoint_v2(ctx->sc_ckpt->sc_db, NULL,
+		    mode, &nlog, &nckpt);
+	}
+
+	switch (mode) {
+	case SQLITE_CHECKPOINT_TRUNCATE:
+		counter = &ctx->sc_ckpt_truncate;
+		break;
+
+	case SQLITE_CHECKPOINT_RESTART:
+		counter = &ctx->sc_ckpt_restart;
+		break;
+
+	default:
+		counter = &ctx->sc_ckpt_passive;
+		break;
+	}
+
+	g_mutex_lock(&ctx->sc_ckpt_mtx);
+	if (ret == SQLITE_OK) {
+		(*counter)++;
+		ctx->sc_ckpt_frames += (uint64_t)MAX(nckpt, 0);
+		ctx->sc_ckpt_wal_frames = (uint64_t)MAX(nlog, 0);
+	} else
+		ctx->sc_ckpt_busy++;
+
+	ctx->sc_ckpt_time += (uint64_t)(g_get_monotonic_time() - start);
+	g_mutex_unlock(&ctx->sc_ckpt_mtx);
+}
+
+static void
+sqlite_close(struct persist_db *db)
+{
+	struct sqlite_context *ctx = db->pdb_arg;
+
+	if (ctx->sc_ckpt_thread != NULL) {
+		g_mutex_lock(&ctx->sc_ckpt_mtx);
+		ctx->sc_ckpt_stop = true;
+		g_cond_broadcast(&ctx->sc_ckpt_cv);
+		g_mutex_unlock(&ctx->sc_ckpt_mtx);
+		g_thread_join(ctx->sc_ckpt_thread);
+		sqlite_context_free(ctx->sc_ckpt);
+	}
+
+	g_mutex_clear(&ctx->sc_ckpt_mtx);
+	g_cond_clear(&ctx->sc_ckpt_cv);
+	g_mutex_clear(&ctx->sc_tx_mtx);
+
+	sqlite_context_free(ctx);
+}
+
+static void
+sqlite_context_free(struct sqlite_context *ctx)
+{
+	struct sqlite_stmt_cache *cache;
+	GHashTable *caches;
+	guint i;
+
+	/*
+	 * Statements cached by other threads need to be finalized before
+	 * closing the connection. Their now empty caches get reclaimed
+	 * when the owning thread exits or touches the database again.
+	 */
+	g_mutex_lock(&sqlite_cache_mtx);
+	for (i = 0; i < ctx->sc_caches->len; i++) {
+		cache = g_ptr_array_index(ctx->sc_caches, i);
+		sqlite_stmt_cache_clear(cache);
+		cache->ssc_sc = NULL;
+	}
+
+	g_ptr_array_free(ctx->sc_caches, true);
+	g_mutex_unlock(&sqlite_cache_mtx);
+
+	caches = g_private_get(&sqlite_thread_caches);
+	if (caches != NULL)
+		g_hash_table_remove(caches, ctx);
+
+	sqlite3_close(ctx->sc_db);
+	g_free(ctx);
+}
+
+/*
+ * Opens another connection to the database file, tuned the same way as
+ * the main one. It gets a page cache of its own, otherwise it would be
+ * serialized on the shared cache of the main connection.
+ */
+static struct sqlite_context *
+sqlite_open_private(struct sqlite_context *sqlite, int flags)
+{
+	struct sqlite_context *result;
+	const char *path;
+	int err;
+
+	path = sqlite3_db_filename(sqlite->sc_db, "main");
+	if (path == NULL || *path == '\0') {
+		persist_set_last_error_static(ENOTSUP,
+		    "In-memory databases can't have extra connections");
+		return (NULL);
+	}
+
+	result = g_malloc0(sizeof(*result));
+	result->sc_persist = sqlite->sc_persist;
+	result->sc_caches = g_ptr_array_new();
+
+	err = sqlite3_open_v2(path, &result->sc_db,
+	    flags | SQLITE_OPEN_PRIVATECACHE, NULL);
+	if (err != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s", sqlite3_errstr(err));
+		sqlite_context_free(result);
+		return (NULL);
+	}
+
+	if (sqlite_init_tuning(sqlite->sc_persist, result) != 0) {
+		sqlite_context_free(result);
+		return (NULL);
+	}
+
+	return (result);
+}
+
+/*
+ * Readers are extra read-only connections used by parallel scans.
+ */
+static void *
+sqlite_open_reader(void *arg)
+{
+	struct sqlite_context *sqlite = arg;
+	struct sqlite_context *reader;
+
+	reader = sqlite_open_private(sqlite, SQLITE_OPEN_READONLY);
+	if (reader == NULL)
+		return (NULL);
+
+	if (sqlite_init_functions(reader) != 0) {
+		sqlite_context_free(reader);
+		return (NULL);
+	}
+
+	reader->sc_trace = sqlite->sc_trace;
+	reader->sc_single = sqlite->sc_single;
+	reader->sc_cache_limit = sqlite->sc_cache_limit;
+	return (reader);
+}
+
+static void
+sqlite_close_reader(void *arg)
+{
+
+	sqlite_context_free(arg);
+}
+
+/*
+ * Pins the current state of the database for a reader. In WAL mode,
+ * the read transaction only starts with the first read, which makes
+ * it see the last commit from then on, no matter what writers do.
+ */
+static int
+sqlite_begin_snapshot(void *arg)
+{
+	struct sqlite_context *sqlite = arg;
+
+	if (sqlite_exec(sqlite, "BEGIN;") != 0)
+		return (-1);
+
+	if (sqlite_exec(sqlite, "SELECT count(*) FROM sqlite_master;") != 0) {
+		sqlite_exec(sqlite, "ROLLBACK;");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Pins several readers to one state. Every commit on this database
+ * handle goes through the main connection, so holding its mutex keeps
+ * them all from landing in between.
+ */
+static int
+sqlite_begin_snapshots(void *arg, void **readers, guint count)
+{
+	struct sqlite_context *sqlite = arg;
+	sqlite3_mutex *mtx;
+	int ret = 0;
+	guint i;
+
+	mtx = sqlite3_db_mutex(sqlite->sc_db);
+	sqlite3_mutex_enter(mtx);
+
+	for (i = 0; i < count; i++) {
+		if (sqlite_begin_snapshot(readers[i]) != 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	sqlite3_mutex_leave(mtx);
+	return (ret);
+}
+
+/*
+ * Picks ids splitting the collection into @count ranges of similar
+ * size in a single pass over the primary key.
+ */
+static int
+sqlite_get_splits(void *arg, const char *collection, guint count,
+    GPtrArray *splits)
+{
+	struct sqlite_context *sqlite = arg;
+	sqlite3_stmt *stmt;
+	ssize_t total;
+	int64_t row = 0;
+	guint next = 1;
+	char *sql;
+	int ret = 0;
+
+	total = sqlite_count(sqlite, collection, NULL);
+	if (total < 0)
+		return (-1);
+
+	if (count < 2 || total < count)
+		return (0);
+
+	if (sqlite->sc_single)
+		sql = sqlite3_mprintf(SQL_SINGLE_IDS, collection);
+	else
+		sql = sqlite3_mprintf(SQL_IDS, collection);
+
+	ret = sqlite3_prepare_v2(sqlite->sc_db, sql, -1, &stmt, NULL);
+	sqlite3_free(sql);
+	if (ret != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s",
+		    sqlite3_errmsg(sqlite->sc_db));
+		return (-1);
+	}
+
+	while (next < count) {
+		switch (sqlite3_step(stmt)) {
+		case SQLITE_ROW:
+			if (row++ < (int64_t)total * next / count)
+				continue;
+
+			g_ptr_array_add(splits, g_strdup(
+			    (const char *)sqlite3_column_text(stmt, 0)));
+			next++;
+			continue;
+
+		case SQLITE_LOCKED:
+		case SQLITE_BUSY:
+			g_usleep(SQLITE_YIELD_DELAY);
+			continue;
+
+		case SQLITE_DONE:
+			break;
+
+		default:
+			persist_set_last_error(EFAULT, "%s",
+			    sqlite3_errmsg(sqlite->sc_db));
+			ret = -1;
+			break;
+		}
+
+		break;
+	}
+
+	sqlite3_finalize(stmt);
+	return (ret == SQLITE_OK ? 0 : -1);
+}
+
+static int
+sqlite_create_collection(void *arg, const char *name)
+{
+	struct sqlite_context *sqlite = arg;
+	g_autofree char *sql = NULL;
+
+	/* All collections live in the shared table */
+	if (sqlite->sc_single)
+		return (0);
+
+	sql = g_strdup_printf(SQL_CREATE_TABLE, name);
+	return (sqlite_exec(sqlite, sql));
+}
+
+static int
+sqlite_destroy_collection(void *arg, const char *name)
+{
+	struct sqlite_context *sqlite = arg;
+	g_autoptr(GPtrArray) indexes = NULL;
+	struct sqlite_stmt_cache *cache;
+	struct sqlite_prepared_stmts *stmts;
+	sqlite3_stmt *stmt;
+	char *list_sql;
+	char *sql;
+	guint i;
+	int ret;
+
+	cache = sqlite_get_stmt_cache(sqlite);
+	stmts = g_hash_table_lookup(cache->ssc_stmts, name);
+	if (stmts != NULL)
+		sqlite_stmt_cache_evict(cache, stmts);
+
+	/* Auxiliary index tables aren't dropped along with the table */
+	indexes = g_ptr_array_new_with_free_func(g_free);
+	list_sql = sqlite3_mprintf(SQL_LIST_INDEXES, name);
+
+	if (sqlite3_prepare_v2(sqlite->sc_db, list_sql, -1, &stmt,
+	    NULL) != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s",
+		    sqlite3_errmsg(sqlite->sc_db));
+		sqlite3_free(list_sql);
+		return (-1);
+	}
+
+	sqlite3_free(list_sql);
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		g_ptr_array_add(indexes,
+		    g_strdup((const char *)sqlite3_column_text(stmt, 0)));
+	}
+
+	sqlite3_finalize(stmt);
+
+	for (i = 0; i < indexes->len; i++) {
+		if (sqlite_drop_index(sqlite, name,
+		    g_ptr_array_index(indexes, i)) != 0)
+			return (-1);
+	}
+
+	if (sqlite->sc_single) {
+		sql = sqlite3_mprintf(SQL_SINGLE_DESTROY, name);
+		ret = sqlite_exec(sqlite, sql);
+		sqlite3_free(sql);
+		return (ret);
+	}
+
+	sql = sqlite3_mprintf(SQL_DROP_TABLE, name);
+	ret = sqlite_exec(sqlite, sql);
+	sqlite3_free(sql);
+	return (ret);
+}
+
+static int
+sqlite_get_collections(void *arg, GPtrArray *result)
+{
+	struct sqlite_context *sqlite = arg;
+	sqlite3_stmt *stmt;
+	char *name;
+	int column = sqlite->sc_single ? 0 : 2;
+
+	if (sqlite3_prepare_v2(sqlite->sc_db,
+	    sqlite->sc_single ? SQL_SINGLE_LIST : SQL_LIST_TABLES, -1,
+	    &stmt, NULL) != SQLITE_OK) {
+		persist_set_last_error(errno, "%s", sqlite3_errmsg(sqlite->sc_db));
+		return (-1);
+	}
+
+	for (;;) {
+		retry:
+		switch (sqlite3_step(stmt)) {
+		case SQLITE_ROW:
+			name = (char *)sqlite3_column_text(stmt, column);
+			g_ptr_array_add(result, name);
+			continue;
+
+		case SQLITE_LOCKED:
+		case SQLITE_BUSY:
+			g_usleep(SQLITE_YIELD_DELAY);
+			goto retry;
+
+		case SQLITE_DONE:
+			goto endloop;
+
+		default:
+			persist_set_last_error(EFAULT, "%s",
+			    sqlite3_errmsg(sqlite->sc_db));
+			sqlite3_finalize(stmt);
+			return (-1);
+		}
+
+endloop:
+		break;
+	}
+
+	sqlite3_finalize(stmt);
+	return (0);
+}
+
+static int
+sqlite_add_index(void *arg, const char *collection, const char *name,
+    const char *path, persist_index_type_t type)
+{
+	struct sqlite_context *sqlite = arg;
+	g_autofree char *existing = NULL;
+	g_autofree char *aux = NULL;
+	GString *sql;
+	char *record;
+	int ret;
+
+	existing = sqlite_get_index_type(sqlite, collection, name);
+	if (existing != NULL) {
+		if (g_strcmp0(existing, sqlite_index_types[type]) == 0)
+			return (0);
+
+		persist_set_last_error(EEXIST,
+		    "Index %s already exists with a different type", name);
+		return (-1);
+	}
+
+	sql = g_string_new("SAVEPOINT add_index; ");
+
+	switch (type) {
+	case PERSIST_INDEX_VALUE:
+		if (sqlite->sc_single) {
+			/* Partial index, matched by the collection scope */
+			sqlite_append_printf(sql, SQL_SINGLE_ADD_INDEX("%s"),
+			    collection, name, path, collection);
+			break;
+		}
+
+		g_string_append_printf(sql, SQL_ADD_INDEX("%s"),
+		    collection, name, collection, path);
+		break;
+
+	case PERSIST_INDEX_FULLTEXT:
+		/* fts5 rows are keyed by rowid, which __objects doesn't have */
+		if (sqlite->sc_single) {
+			persist_set_last_error(ENOTSUP,
+			    "Full-text indexes are not supported in "
+			    "single-table storage mode");
+			g_string_free(sql, true);
+			return (-1);
+		}
+
+		/*
+		 * Full-text rows share rowids with the collection table.
+		 * INSERT OR REPLACE doesn't fire delete triggers, hence the
+		 * stale row is removed before the insert takes place.
+		 */
+		aux = g_strdup_printf("%s_%s", collection, name);
+		g_string_append_printf(sql, SQL_FTS_CREATE, aux);
+		g_string_append_printf(sql, SQL_FTS_TRIGGER_BI, aux, collection,
+		    aux, collection);
+		g_string_append_printf(sql, SQL_FTS_TRIGGER_AI, aux, collection,
+		    aux, path);
+		g_string_append_printf(sql, SQL_FTS_TRIGGER_AD, aux, collection,
+		    aux);
+		g_string_append_printf(sql, SQL_FTS_POPULATE, aux, path,
+		    collection);
+		break;
+
+	case PERSIST_INDEX_ARRAY:
+		/* (element, id) pairs, kept in sync the same way */
+		aux = g_strdup_printf("%s_%s", collection, name);
+		g_string_append_printf(sql, SQL_ARRAY_CREATE, aux, aux, aux);
+
+		if (sqlite->sc_single) {
+			sqlite_append_printf(sql, SQL_SINGLE_ARRAY_TRIGGER_AI,
+			    aux, collection, aux, aux, path);
+			sqlite_append_printf(sql, SQL_SINGLE_ARRAY_TRIGGER_AD,
+			    aux, collection, aux);
+			sqlite_append_printf(sql, SQL_SINGLE_ARRAY_POPULATE,
+			    aux, path, collection);
+			break;
+		}
+
+		g_string_append_printf(sql, SQL_ARRAY_TRIGGER_AI, aux,
+		    collection, aux, aux, path);
+		g_string_append_printf(sql, SQL_ARRAY_TRIGGER_AD, aux,
+		    collection, aux);
+		g_string_append_printf(sql, SQL_ARRAY_POPULATE, aux, collection,
+		    path);
+		break;
+
+	default:
+		persist_set_last_error_static(EINVAL, "Invalid index type");
+		g_string_free(sql, true);
+		return (-1);
+	}
+
+	record = sqlite3_mprintf(SQL_RECORD_INDEX, collection, name, path,
+	    sqlite_index_types[type]);
+	g_string_append(sql, record);
+	g_string_append(sql, "RELEASE add_index;");
+	sqlite3_free(record);
+
+	ret = sqlite_exec(sqlite, sql->str);
+	g_string_free(sql, true);
+
+	if (ret != 0)
+		sqlite3_exec(sqlite->sc_db,
+		    "ROLLBACK TO add_index; RELEASE add_index;", NULL, NULL, NULL);
+
+	return (ret);
+}
+
+static int
+sqlite_drop_index(void *arg, const char *collection, const char *name)
+{
+	struct sqlite_context *sqlite = arg;
+	g_autofree char *type = NULL;
+	g_autofree char *aux = NULL;
+	g_autofree char *sql = NULL;
+	char *forget;
+	int ret;
+
+	type = sqlite_get_index_type(sqlite, collection, name);
+	aux = g_strdup_printf("%s_%s", collection, name);
+
+	if (g_strcmp0(type, sqlite_index_types[PERSIST_INDEX_FULLTEXT]) == 0)
+		sql = g_strdup_printf(SQL_FTS_DROP, aux, aux, aux, aux);
+	else if (g_strcmp0(type, sqlite_index_types[PERSIST_INDEX_ARRAY]) == 0)
+		sql = g_strdup_printf(SQL_ARRAY_DROP, aux, aux, aux);
+	else
+		sql = g_strdup_printf(SQL_DROP_INDEX, collection, name);
+
+	if (sqlite_exec(sqlite, sql) != 0)
+		return (-1);
+
+	forget = sqlite3_mprintf(SQL_FORGET_INDEX, collection, name);
+	ret = sqlite_exec(sqlite, forget);
+	sqlite3_free(forget);
+	return (ret);
+}
+
+static int
+sqlite_get_object(void *arg, const char *collection, const char *id,
+    rpc_object_t *obj)
+{
+
+	return (sqlite_fetch(arg, collection, id, obj, NULL));
+}
+
+static int
+sqlite_get_raw(void *arg, const char *collection, const char *id,
+    struct persist_raw *raw)
+{
+
+	return (sqlite_fetch(arg, collection, id, NULL, raw));
+}
+
+static int
+sqlite_fetch(struct sqlite_context *sqlite, const char *collection,
+    const char *id, rpc_object_t *obj, struct persist_raw *raw)
+{
+	struct sqlite_stmt_cache *cache;
+	struct sqlite_prepared_stmts *stmts;
+	sqlite3_stmt *stmt;
+	int ret = 0;
+
+	stmts = sqlite_get_prepared_stmts(sqlite, collection);
+	if (stmts == NULL)
+		return (-1);
+
+	stmt = stmts->sc_prepared_get;
+
+	if (sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC) != SQLITE_OK) {
+		persist_set_last_error(errno, "%s", sqlite3_errmsg(sqlite->sc_db));
+		return (-1);
+	}
+
+retry:
+	switch (sqlite3_step(stmt)) {
+	case SQLITE_ROW:
+		if (raw == NULL) {
+			ret = sqlite_unpack(stmt, NULL, obj);
+			break;
+		}
+
+		/*
+		 * Row memory is gone once the statement is reset, so keep
+		 * a copy in a per-thread buffer that's reused by the next
+		 * raw read.
+		 */
+		ret = sqlite_unpack_raw(stmt, NULL, raw);
+		if (ret != 0)
+			break;
+
+		cache = sqlite_get_stmt_cache(sqlite);
+		if (cache->ssc_raw == NULL)
+			cache->ssc_raw = g_byte_array_new();
+
+		g_byte_array_set_size(cache->ssc_raw, 0);
+		g_byte_array_append(cache->ssc_raw, raw->data, (guint)raw->len);
+		raw->data = cache->ssc_raw->data;
+		break;
+
+	case SQLITE_DONE:
+		persist_set_last_error_static(ENOENT, "Not found");
+		ret = -1;
+		break;
+
+	case SQLITE_LOCKED:
+	case SQLITE_BUSY:
+		g_usleep(SQLITE_YIELD_DELAY); /* 10ms sleep */
+		goto retry;
+
+	default:
+		persist_set_last_error(EFAULT, "%s",
+		    sqlite3_errmsg(sqlite->sc_db));
+		sqlite3_clear_bindings(stmt);
+		sqlite3_reset(stmt);
+		return (-1);
+	}
+
+	sqlite3_clear_bindings(stmt);
+	sqlite3_reset(stmt);
+	return (ret);
+}
+
+/*
+ * Converts a dotted field path into a JSON path understood by sqlite.
+ * Returns NULL if the path can't be expressed without knowing the
+ * document: persist_get_path() treats numeric components as array
+ * subscripts or dictionary keys depending on the container, and sqlite
+ * can't match keys containing quotes or control characters.
+ */
+static char *
+sqlite_json_path(const char *path)
+{
+	g_auto(GStrv) parts = NULL;
+	GString *result;
+	const char *c;
+	size_t i;
+
+	parts = g_strsplit(path, ".", -1);
+	result = g_string_new("$.");
+
+	for (i = 0; parts[i] != NULL; i++) {
+		if (*parts[i] != '\0' &&
+		    strspn(parts[i], "0123456789") == strlen(parts[i]))
+			goto ambiguous;
+
+		if (i > 0)
+			g_string_append_c(result, '.');
+
+		g_string_append_c(result, '"');
+		for (c = parts[i]; *c != '\0'; c++) {
+			if (*c == '"' || (unsigned char)*c < 0x20)
+				goto ambiguous;
+
+			/* Keys are matched against their escaped JSON form */
+			if (*c == '\\')
+				g_string_append_c(result, '\\');
+
+			g_string_append_c(result, *c);
+		}
+
+		g_string_append_c(result, '"');
+	}
+
+	return (g_string_free(result, false));
+
+ambiguous:
+	g_string_free(result, true);
+	return (NULL);
+}
+
+static int
+sqlite_get_field_decoded(struct sqlite_context *sqlite,
+    const char *collection, const char *id, const char *path,
+    rpc_object_t *result)
+{
+	rpc_object_t obj;
+
+	if (sqlite_fetch(sqlite, collection, id, &obj, NULL) != 0)
+		return (-1);
+
+	*result = persist_get_path(obj, path);
+	if (*result == NULL) {
+		persist_set_last_error_static(ENOENT, "No such field");
+		rpc_release(obj);
+		return (-1);
+	}
+
+	rpc_retain(*result);
+	rpc_release(obj);
+	return (0);
+}
+
+static int
+sqlite_get_field(void *arg, const char *collection, const char *id,
+    const char *path, rpc_object_t *result)
+{
+	struct sqlite_context *sqlite = arg;
 	struct sqlite_prepared_stmts *stmts;
 	sqlite3_stmt *stmt;
+	const char *type;
+	const void *text;
+	char *json_path;
 	int ret = 0;
 
+	json_path = sqlite_json_path(path);
+	if (json_path == NULL) {
+		return (sqlite_get_field_decoded(sqlite, collection, id, path,
+		    result));
+	}
+
 	stmts = sqlite_get_prepared_stmts(sqlite, collection);
-	stmt = stmts->sc_prepared_get;
+	if (stmts == NULL) {
+		g_free(json_path);
+		return (-1);
+	}
 
-	if (sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC) != SQLITE_OK) {
-		persist_set_last_error(errno, "%s", sqlite3_errmsg(sqlite->sc_db));
+	stmt = stmts->sc_prepared_field;
+
+	if (sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC) != SQLITE_OK ||
+	    sqlite3_bind_text(stmt, 2, json_path, -1, g_free) != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s",
+		    sqlite3_errmsg(sqlite->sc_db));
+		sqlite3_clear_bindings(stmt);
 		return (-1);
 	}
 
 retry:
 	switch (sqlite3_step(stmt)) {
 	case SQLITE_ROW:
-		ret = sqlite_unpack(stmt, NULL, obj);
+		type = (const char *)sqlite3_column_text(stmt, 0);
+		if (type == NULL) {
+			persist_set_last_error_static(ENOENT, "No such field");
+			ret = -1;
+			break;
+		}
+
+		if (g_strcmp0(type, "true") == 0 ||
+		    g_strcmp0(type, "false") == 0) {
+			*result = rpc_bool_create(*type == 't');
+			break;
+		}
+
+		if (g_strcmp0(type, "object") != 0 &&
+		    g_strcmp0(type, "array") != 0) {
+			*result = sqlite_column_object(stmt, 1);
+			break;
+		}
+
+		/* Let the serializer restore librpc-specific types */
+		text = sqlite3_column_text(stmt, 1);
+		*result = rpc_serializer_load("json", text,
+		    (size_t)sqlite3_column_bytes(stmt, 1));
+		if (*result == NULL) {
+			persist_set_last_error(
+			    rpc_error_get_code(rpc_get_last_error()), "%s",
+			    rpc_error_get_message(rpc_get_last_error()));
+			ret = -1;
+		}
 		break;
 
 	case SQLITE_DONE:
-		persist_set_last_error(ENOENT, "Not found");
+		persist_set_last_error_static(ENOENT, "Not found");
 		ret = -1;
 		break;
 
 	case SQLITE_LOCKED:
 	case SQLITE_BUSY:
-		g_usleep(SQLITE_YIELD_DELAY); /* 10ms sleep */
+		g_usleep(SQLITE_YIELD_DELAY);
 		goto retry;
 
 	default:
 		persist_set_last_error(EFAULT, "%s",
 		    sqlite3_errmsg(sqlite->sc_db));
-		sqlite3_clear_bindings(stmt);
-		sqlite3_reset(stmt);
+		ret = -1;
+		break;
+	}
+
+	sqlite3_clear_bindings(stmt);
+	sqlite3_reset(stmt);
+	return (ret);
+}
+
+static int
+sqlite_exists(void *arg, const char *collection, const char *id)
+{
+	struct sqlite_context *sqlite = arg;
+	struct sqlite_prepared_stmts *stmts;
+	sqlite3_stmt *stmt;
+	int ret;
+
+	stmts = sqlite_get_prepared_stmts(sqlite, collection);
+	if (stmts == NULL)
+		return (-1);
+
+	stmt = stmts->sc_prepared_exists;
+
+	if (sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC) != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s",
+		    sqlite3_errmsg(sqlite->sc_db));
 		return (-1);
 	}
 
+retry:
+	switch (sqlite3_step(stmt)) {
+	case SQLITE_ROW:
+		ret = 1;
+		break;
+
+	case SQLITE_DONE:
+		ret = 0;
+		break;
+
+	case SQLITE_LOCKED:
+	case SQLITE_BUSY:
+		g_usleep(SQLITE_YIELD_DELAY);
+		goto retry;
+
+	default:
+		persist_set_last_error(EFAULT, "%s",
+		    sqlite3_errmsg(sqlite->sc_db));
+		ret = -1;
+		break;
+	}
+
 	sqlite3_clear_bindings(stmt);
 	sqlite3_reset(stmt);
 	return (ret);
@@ -459,6 +1918,11 @@ sqlite_save_object(void *arg, const char *collection, const char *id,
 	}
 
 	stmts = sqlite_get_prepared_stmts(sqlite, collection);
+	if (stmts == NULL) {
+		g_free(buf);
+		return (-1);
+	}
+
 	stmt = stmts->sc_prepared_insert;
 
 	if (sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC) != SQLITE_OK) {
@@ -505,16 +1969,16 @@ sqlite_save_objects(void *arg, const char *collection, rpc_object_t objects)
 	bool stop;
 
 	stop = rpc_array_apply(objects, ^bool(size_t idx, rpc_object_t item) {
-		rpc_auto_object_t id = NULL;
+		const char *id;
 
-		id = rpc_dictionary_detach_key(item, "id");
+		id = rpc_dictionary_get_string(item, "id");
 		if (id == NULL) {
-			persist_set_last_error(EINVAL, "Object has no 'id' key");
+			persist_set_last_error_static(EINVAL,
+			    "'id' field not present or not a string");
 			return (false);
 		}
 
-		if (sqlite_save_object(arg, collection,
-		    rpc_string_get_string_ptr(id), item) != 0)
+		if (sqlite_save_object(arg, collection, id, item) != 0)
 			return (false);
 
 		return (true);
@@ -532,6 +1996,9 @@ sqlite_delete_object(void *arg, const char *collection, const char *id)
 	int ret = 0;
 
 	stmts = sqlite_get_prepared_stmts(sqlite, collection);
+	if (stmts == NULL)
+		return (-1);
+
 	stmt = stmts->sc_prepared_delete;
 
 	if (sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC) != SQLITE_OK) {
@@ -556,28 +2023,170 @@ sqlite_delete_object(void *arg, const char *collection, const char *id)
 	return (ret);
 }
 
+/*
+ * Transactions nest: the outermost one is a real transaction, inner
+ * ones are savepoints named after their depth. The connection has a
+ * single transaction, so it belongs to the thread that started it.
+ * Must be called with sc_tx_mtx held.
+ */
+static guint
+sqlite_tx_depth(struct sqlite_context *sqlite)
+{
+
+	/* sqlite may have rolled the transaction back on its own */
+	if (sqlite3_get_autocommit(sqlite->sc_db)) {
+		sqlite->sc_tx_depth = 0;
+		sqlite->sc_tx_owner = NULL;
+		sqlite_end_override(sqlite);
+	}
+
+	return (sqlite->sc_tx_depth);
+}
+
+static bool
+sqlite_tx_owned(struct sqlite_context *sqlite, guint depth)
+{
+
+	if (depth == 0 || sqlite->sc_tx_owner == g_thread_self())
+		return (true);
+
+	persist_set_last_error_static(EBUSY,
+	    "Transaction belongs to another thread");
+	return (false);
+}
+
+static void
+sqlite_end_override(struct sqlite_context *sqlite)
+{
+
+	if (!sqlite->sc_tx_override)
+		return;
+
+	sqlite->sc_tx_override = false;
+	sqlite_set_sync(sqlite, sqlite->sc_durability);
+}
+
 static int
-sqlite_start_tx(void *arg)
+sqlite_start_tx(void *arg, persist_durability_t durability)
 {
 	struct sqlite_context *sqlite = arg;
+	char sql[64];
+	guint depth;
+	int ret = -1;
+
+	g_mutex_lock(&sqlite->sc_tx_mtx);
+	depth = sqlite_tx_depth(sqlite);
+	if (!sqlite_tx_owned(sqlite, depth))
+		goto out;
 
-	return (sqlite_exec(sqlite, "BEGIN TRANSACTION;"));
+	if (depth == 0)
+		g_strlcpy(sql, "BEGIN TRANSACTION;", sizeof(sql));
+	else
+		g_snprintf(sql, sizeof(sql), "SAVEPOINT tx%u;", depth);
+
+	/* synchronous can't be changed once the transaction is open */
+	if (depth == 0 && durability != PERSIST_DURABILITY_DEFAULT &&
+	    durability != sqlite->sc_durability) {
+		if (sqlite_set_sync(sqlite, durability) != 0)
+			goto out;
+
+		sqlite->sc_tx_override = true;
+	}
+
+	if (sqlite_exec(sqlite, sql) != 0) {
+		if (depth == 0)
+			sqlite_end_override(sqlite);
+
+		goto out;
+	}
+
+	sqlite->sc_tx_owner = g_thread_self();
+	sqlite->sc_tx_depth++;
+	ret = 0;
+
+out:
+	g_mutex_unlock(&sqlite->sc_tx_mtx);
+	return (ret);
 }
 
 static int
 sqlite_commit_tx(void *arg)
 {
 	struct sqlite_context *sqlite = arg;
+	char sql[64];
+	guint depth;
+	int ret = -1;
+
+	g_mutex_lock(&sqlite->sc_tx_mtx);
+	depth = sqlite_tx_depth(sqlite);
+	if (depth == 0) {
+		persist_set_last_error_static(EINVAL, "No transaction active");
+		goto out;
+	}
+
+	if (!sqlite_tx_owned(sqlite, depth))
+		goto out;
+
+	if (depth == 1)
+		g_strlcpy(sql, "COMMIT TRANSACTION;", sizeof(sql));
+	else
+		g_snprintf(sql, sizeof(sql), "RELEASE SAVEPOINT tx%u;",
+		    depth - 1);
 
-	return (sqlite_exec(sqlite, "COMMIT TRANSACTION;"));
+	if (sqlite_exec(sqlite, sql) != 0)
+		goto out;
+
+	if (--sqlite->sc_tx_depth == 0) {
+		sqlite->sc_tx_owner = NULL;
+		sqlite_end_override(sqlite);
+	}
+
+	ret = 0;
+
+out:
+	g_mutex_unlock(&sqlite->sc_tx_mtx);
+	return (ret);
 }
 
 static int
 sqlite_rollback_tx(void *arg)
 {
 	struct sqlite_context *sqlite = arg;
+	char sql[96];
+	guint depth;
+	int ret = -1;
+
+	g_mutex_lock(&sqlite->sc_tx_mtx);
+	depth = sqlite_tx_depth(sqlite);
+	if (depth == 0) {
+		persist_set_last_error_static(EINVAL, "No transaction active");
+		goto out;
+	}
+
+	if (!sqlite_tx_owned(sqlite, depth))
+		goto out;
+
+	/* Rolling back to a savepoint leaves it in place, so drop it too */
+	if (depth == 1)
+		g_strlcpy(sql, "ROLLBACK TRANSACTION;", sizeof(sql));
+	else
+		g_snprintf(sql, sizeof(sql),
+		    "ROLLBACK TO SAVEPOINT tx%u; RELEASE SAVEPOINT tx%u;",
+		    depth - 1, depth - 1);
+
+	if (sqlite_exec(sqlite, sql) != 0)
+		goto out;
+
+	if (--sqlite->sc_tx_depth == 0) {
+		sqlite->sc_tx_owner = NULL;
+		sqlite_end_override(sqlite);
+	}
 
-	return (sqlite_exec(sqlite, "ROLLBACK TRANSACTION;"));
+	ret = 0;
+
+out:
+	g_mutex_unlock(&sqlite->sc_tx_mtx);
+	return (ret);
 }
 
 static bool
@@ -589,87 +2198,219 @@ sqlite_in_tx(void *arg)
 }
 
 static bool
-sqlite_eval_logic_and(GString *sql, rpc_object_t lst)
+sqlite_eval_logic(struct sqlite_filter *filter, struct persist_filter *node,
+    const char *sep)
 {
-	size_t len;
-	bool stop;
+	guint i;
 
-	if (rpc_get_type(lst) != RPC_TYPE_ARRAY) {
-		persist_set_last_error(EINVAL, "'and' predicate is not an array");
-		return (false);
+	g_string_append(filter->sf_sql, "(");
+
+	for (i = 0; i < node->pf_children->len; i++) {
+		if (i > 0)
+			g_string_append(filter->sf_sql, sep);
+
+		if (!sqlite_eval_node(filter,
+		    g_ptr_array_index(node->pf_children, i)))
+			return (false);
 	}
 
-	if (rpc_array_get_count(lst) == 0) {
-		g_string_append_printf(sql, "(1==1)");
+	g_string_append(filter->sf_sql, ")");
+	return (true);
+}
+
+static bool
+sqlite_eval_node(struct sqlite_filter *filter, struct persist_filter *node)
+{
+
+	switch (node->pf_type) {
+	case FILTER_TRUE:
+		g_string_append(filter->sf_sql, "(1==1)");
+		return (true);
+
+	case FILTER_FALSE:
+		g_string_append(filter->sf_sql, "(1==0)");
 		return (true);
+
+	case FILTER_AND:
+		return (sqlite_eval_logic(filter, node, " AND "));
+
+	case FILTER_OR:
+		return (sqlite_eval_logic(filter, node, " OR "));
+
+	case FILTER_NOR:
+		g_string_append(filter->sf_sql, "NOT ");
+		return (sqlite_eval_logic(filter, node, " OR "));
+
+	case FILTER_FIELD:
+		return (sqlite_eval_field_operator(filter, node));
 	}
 
-	len = rpc_array_get_count(lst);
-	g_string_append(sql, "(");
+	return (false);
+}
 
-	stop = rpc_array_apply(lst, ^(size_t idx, rpc_object_t v) {
-		if (!sqlite_eval_rule(sql, v))
-			return ((bool)false);
+static bool
+sqlite_eval_field_operator(struct sqlite_filter *filter,
+    struct persist_filter *node)
+{
+	const struct sqlite_operator *op;
+	const char *rule_op = node->pf_op;
+	const char *field = node->pf_field;
+	char *pattern;
+	char *value_str;
+	size_t value_len;
+	rpc_object_t value = node->pf_value;
 
-		if (idx != len - 1)
-			g_string_append(sql, " AND ");
+	if (g_strcmp0(rule_op, "search") == 0)
+		return (sqlite_eval_search(filter, field, value));
 
-		return ((bool)true);
-	});
+	if (g_strcmp0(rule_op, "contains") == 0)
+		return (sqlite_eval_contains(filter, field, value));
 
-	g_string_append(sql, ")");
-	return (!stop);
+	if (g_strcmp0(rule_op, "in") == 0)
+		return (sqlite_eval_in(filter, field, value));
+
+	for (op = &sqlite_operator_table[0]; op->so_librpc != NULL; op++) {
+		if (g_strcmp0(rule_op, op->so_librpc) == 0)
+			break;
+	}
+
+	if (op->so_librpc == NULL) {
+		persist_set_last_error(EINVAL, "Invalid operator: %s", rule_op);
+		return (false);
+	}
+
+	/*
+	 * Pattern operators match against the raw string, not against
+	 * its quoted JSON representation.
+	 */
+	if (op->so_string) {
+		if (rpc_get_type(value) != RPC_TYPE_STRING) {
+			persist_set_last_error(EINVAL,
+			    "'%s' operand is not a string", rule_op);
+			return (false);
+		}
+
+		pattern = sqlite3_mprintf(SQL_EXTRACT_RAW("%s") " %s %Q",
+		    field, op->so_sqlite, rpc_string_get_string_ptr(value));
+		g_string_append(filter->sf_sql, pattern);
+		sqlite3_free(pattern);
+		return (true);
+	}
+
+	if (rpc_serializer_dump("json", value, (void **)&value_str,
+	    &value_len) != 0) {
+		persist_set_last_error_static(EFAULT, "Cannot serialize value");
+		return (false);
+	}
+
+	g_string_append_printf(filter->sf_sql,
+	    SQL_EXTRACT("%s") " %s " SQL_JSON("%.*s"),
+	    field, op->so_sqlite, (int)value_len, value_str);
+	g_free(value_str);
+	return (true);
 }
 
 static bool
-sqlite_eval_logic_or(GString *sql, rpc_object_t lst)
+sqlite_eval_search(struct sqlite_filter *filter, const char *field,
+    rpc_object_t value)
 {
-	size_t len;
-	bool stop;
+	g_autofree char *index = NULL;
+	char *sql;
 
-	if (rpc_get_type(lst) != RPC_TYPE_ARRAY) {
-		persist_set_last_error(EINVAL, "'or' predicate is not an array");
+	if (rpc_get_type(value) != RPC_TYPE_STRING) {
+		persist_set_last_error_static(EINVAL,
+		    "'search' operand is not a string");
 		return (false);
 	}
 
-	len = rpc_array_get_count(lst);
-	g_string_append(sql, "(");
+	index = sqlite_find_index(filter->sf_sc, filter->sf_collection, field,
+	    PERSIST_INDEX_FULLTEXT);
+	if (index == NULL) {
+		persist_set_last_error(EINVAL, "No full-text index on field %s",
+		    field);
+		return (false);
+	}
 
-	stop = rpc_array_apply(lst, ^(size_t idx, rpc_object_t v) {
-		if (!sqlite_eval_rule(sql, v))
-			return ((bool)false);
+	sql = sqlite3_mprintf(SQL_FTS_SEARCH, filter->sf_collection, index,
+	    filter->sf_collection, index, rpc_string_get_string_ptr(value));
+	g_string_append(filter->sf_sql, sql);
+	sqlite3_free(sql);
+	return (true);
+}
+
+static char *
+sqlite_dump_json(rpc_object_t value)
+{
+	void *buf;
+	size_t len;
+	char *result;
 
-		if (idx == len - 1)
-			g_string_append(sql, " OR ");
+	if (rpc_serializer_dump("json", value, &buf, &len) != 0) {
+		persist_set_last_error_static(EFAULT, "Cannot serialize value");
+		return (NULL);
+	}
 
-		return ((bool)true);
-	});
+	result = g_strndup(buf, len);
+	g_free(buf);
+	return (result);
+}
+
+static bool
+sqlite_eval_contains(struct sqlite_filter *filter, const char *field,
+    rpc_object_t value)
+{
+	g_autofree char *index = NULL;
+	g_autofree char *json = NULL;
+	char *sql;
+
+	json = sqlite_dump_json(value);
+	if (json == NULL)
+		return (false);
+
+	index = sqlite_find_index(filter->sf_sc, filter->sf_collection, field,
+	    PERSIST_INDEX_ARRAY);
 
-	g_string_append(sql, ")");
-	return (!stop);
+	if (index != NULL) {
+		sql = sqlite3_mprintf(SQL_ARRAY_CONTAINS, filter->sf_collection,
+		    index, json);
+	} else
+		sql = sqlite3_mprintf(SQL_JSON_CONTAINS, field, json);
+
+	g_string_append(filter->sf_sql, sql);
+	sqlite3_free(sql);
+	return (true);
 }
 
 static bool
-sqlite_eval_logic_nor(GString *sql, rpc_object_t lst)
+sqlite_eval_in(struct sqlite_filter *filter, const char *field,
+    rpc_object_t value)
 {
-	size_t len;
+	GString *sql = filter->sf_sql;
 	bool stop;
 
-	if (rpc_get_type(lst) != RPC_TYPE_ARRAY) {
-		persist_set_last_error(EINVAL, "'nor' predicate is not an array");
+	if (rpc_get_type(value) != RPC_TYPE_ARRAY) {
+		persist_set_last_error_static(EINVAL,
+		    "'in' operand is not an array");
 		return (false);
 	}
 
-	len = rpc_array_get_count(lst);
-	g_string_append(sql, "(");
+	if (rpc_array_get_count(value) == 0) {
+		g_string_append(sql, "(1==0)");
+		return (true);
+	}
 
-	stop = rpc_array_apply(lst, ^(size_t idx, rpc_object_t v) {
-		if (!sqlite_eval_rule(sql, v))
-			return ((bool)false);
+	g_string_append_printf(sql, SQL_EXTRACT("%s") " IN (", field);
+	stop = rpc_array_apply(value, ^(size_t idx, rpc_object_t v) {
+		g_autofree char *json = NULL;
+		char *item;
 
-		if (idx == len - 1)
-			g_string_append(sql, " AND "); /* XXX should be NOR */
+		json = sqlite_dump_json(v);
+		if (json == NULL)
+			return ((bool)false);
 
+		item = sqlite3_mprintf("%sjson(%Q)", idx > 0 ? ", " : "", json);
+		g_string_append(sql, item);
+		sqlite3_free(item);
 		return ((bool)true);
 	});
 
@@ -677,87 +2418,66 @@ sqlite_eval_logic_nor(GString *sql, rpc_object_t lst)
 	return (!stop);
 }
 
-static bool
-sqlite_eval_logic_operator(GString *sql, rpc_object_t rule)
+static void
+sqlite_append_printf(GString *str, const char *fmt, ...)
 {
-	const char *op;
-	rpc_object_t value;
-
-	if (rpc_object_unpack(rule, "[s,v]", &op, &value) < 2) {
-		persist_set_last_error(EINVAL, "Cannot unpack logic tuple");
-		return (false);
-	}
-
-	if (g_strcmp0(op, "and") == 0)
-		return (sqlite_eval_logic_and(sql, value));
+	va_list ap;
+	char *result;
 
-	if (g_strcmp0(op, "or") == 0)
-		return (sqlite_eval_logic_or(sql, value));
+	va_start(ap, fmt);
+	result = sqlite3_vmprintf(fmt, ap);
+	va_end(ap);
 
-	if (g_strcmp0(op, "nor") == 0)
-		return (sqlite_eval_logic_nor(sql, value));
-
-	return (false);
+	g_string_append(str, result);
+	sqlite3_free(result);
 }
 
+/*
+ * Appends FROM and WHERE clauses selecting objects of a collection
+ * that match rules.
+ */
 static bool
-sqlite_eval_field_operator(GString *sql, rpc_object_t rule)
+sqlite_eval_source(struct sqlite_context *sqlite, const char *collection,
+    GString *sql, rpc_object_t rules)
 {
-	const struct sqlite_operator *op;
-	const char *sql_op = NULL;
-	const char *rule_op;
-	const char *field;
-	char *value_str;
-	size_t value_len;
-	rpc_object_t value;
 
-	if (rpc_object_unpack(rule, "[s,s,v]", &field, &rule_op, &value) < 3)
-		return (false);
-
-	if (rpc_serializer_dump("json", value, (void **)&value_str,
-	    &value_len) != 0) {
-		persist_set_last_error(EFAULT, "Cannot serialize value");
-		return (false);
-	}
+	if (!sqlite->sc_single) {
+		g_string_append_printf(sql, " FROM %s ", collection);
+		if (rules == NULL)
+			return (true);
 
-	for (op = &sqlite_operator_table[0]; op->so_librpc != NULL; op++) {
-		if (g_strcmp0(rule_op, op->so_librpc) == 0) {
-			sql_op = op->so_sqlite;
-			break;
-		}
+		g_string_append(sql, "WHERE ");
+		return (sqlite_eval_filter(sqlite, collection, sql, rules));
 	}
 
-	if (sql_op == NULL) {
-		persist_set_last_error(EINVAL, "Invalid operator: %s", rule_op);
-		return (false);
-	}
+	sqlite_append_printf(sql, SQL_SINGLE_SCOPE, collection);
+	if (rules == NULL)
+		return (true);
 
-	g_string_append_printf(sql, SQL_EXTRACT("%s") " %s " SQL_JSON("%*s"),
-	    field, sql_op, (int)value_len, value_str);
-	return (true);
+	g_string_append(sql, "AND ");
+	return (sqlite_eval_filter(sqlite, collection, sql, rules));
 }
 
 static bool
-sqlite_eval_rule(GString *sql, rpc_object_t rule)
+sqlite_eval_filter(struct sqlite_context *sqlite, const char *collection,
+    GString *sql, rpc_object_t rules)
 {
-	if (rpc_get_type(rule) != RPC_TYPE_ARRAY) {
-		persist_set_last_error(EINVAL, "Rule is not an array");
+	struct sqlite_filter filter = {
+		.sf_sc = sqlite,
+		.sf_collection = collection,
+		.sf_sql = sql
+	};
+	struct persist_filter *node;
+	bool ret;
+
+	node = persist_filter_parse(rules);
+	if (node == NULL)
 		return (false);
-	}
-
-	switch (rpc_array_get_count(rule)) {
-	case 2:
-		return (sqlite_eval_logic_operator(sql, rule));
 
-	case 3:
-		return (sqlite_eval_field_operator(sql, rule));
-
-	default:
-		persist_set_last_error(EINVAL,
-		    "Invalid number of items in a rule tuple");
-
-		return (false);
-	}
+	node = persist_filter_optimize(node);
+	ret = sqlite_eval_node(&filter, node);
+	persist_filter_free(node);
+	return (ret);
 }
 
 static ssize_t
@@ -769,15 +2489,11 @@ sqlite_count(void *arg, const char *collection, rpc_object_t rules)
 	ssize_t result;
 	int ret;
 
-	sql = g_string_new("SELECT ");
-	g_string_append_printf(sql, "count(id) FROM %s ", collection);
+	sql = g_string_new("SELECT count(id)");
 
-	if (rules != NULL) {
-		g_string_append_printf(sql, "WHERE ");
-		if (!sqlite_eval_logic_and(sql, rules)) {
-			g_string_free(sql, true);
-			return (-1);
-		}
+	if (!sqlite_eval_source(sqlite, collection, sql, rules)) {
+		g_string_free(sql, true);
+		return (-1);
 	}
 
 	g_string_append(sql, ";");
@@ -796,7 +2512,8 @@ retry:
 	ret = sqlite3_step(stmt);
 	switch (ret) {
 	case SQLITE_DONE:
-		persist_set_last_error(ENOENT, "sqlite returned no rows");
+		persist_set_last_error_static(ENOENT,
+		    "sqlite returned no rows");
 		result = -1;
 		break;
 
@@ -820,26 +2537,262 @@ retry:
 	return (result);
 }
 
+static rpc_object_t
+sqlite_aggregate(void *arg, const char *collection, rpc_object_t rules,
+    rpc_object_t group_by, rpc_object_t aggregates)
+{
+	struct sqlite_context *sqlite = arg;
+	GString *sql;
+	GPtrArray *names;
+	sqlite3_stmt *stmt;
+	rpc_object_t result;
+	rpc_object_t row;
+	rpc_object_t value;
+	size_t n_groups;
+	guint i;
+	int ret;
+
+	n_groups = group_by != NULL ? rpc_array_get_count(group_by) : 0;
+	names = g_ptr_array_new();
+	sql = g_string_new("SELECT ");
+
+	if (group_by != NULL) {
+		rpc_array_apply(group_by, ^(size_t idx, rpc_object_t path) {
+			g_string_append_printf(sql, SQL_EXTRACT("%s") ", ",
+			    rpc_string_get_string_ptr(path));
+			return ((bool)true);
+		});
+	}
+
+	rpc_dictionary_apply(aggregates, ^(const char *name, rpc_object_t v) {
+		const struct sqlite_operator *op;
+		const char *fn;
+		const char *path = NULL;
+		rpc_object_t path_obj;
+
+		fn = rpc_string_get_string_ptr(rpc_array_get_value(v, 0));
+		path_obj = rpc_array_get_value(v, 1);
+		if (path_obj != NULL && rpc_get_type(path_obj) == RPC_TYPE_STRING)
+			path = rpc_string_get_string_ptr(path_obj);
+
+		for (op = &sqlite_aggregate_table[0]; op->so_librpc != NULL; op++) {
+			if (g_strcmp0(fn, op->so_librpc) == 0)
+				break;
+		}
+
+		if (path == NULL)
+			g_string_append_printf(sql, "%s(*), ", op->so_sqlite);
+		else {
+			g_string_append_printf(sql,
+			    "%s(" SQL_EXTRACT_RAW("%s") "), ",
+			    op->so_sqlite, path);
+		}
+
+		g_ptr_array_add(names, (gpointer)name);
+		return ((bool)true);
+	});
+
+	g_string_truncate(sql, sql->len - 2);
+
+	if (!sqlite_eval_source(sqlite, collection, sql, rules)) {
+		g_string_free(sql, true);
+		g_ptr_array_free(names, true);
+		return (NULL);
+	}
+
+	if (n_groups > 0) {
+		g_string_append(sql, " GROUP BY ");
+		for (i = 1; i <= n_groups; i++)
+			g_string_append_printf(sql, i < n_groups ? "%u, " : "%u", i);
+	}
+
+	g_string_append(sql, ";");
+
+	if (sqlite->sc_trace)
+		fprintf(stderr, "(%p): query string: %s\n", sqlite, sql->str);
+
+	if (sqlite3_prepare_v2(sqlite->sc_db, sql->str, -1, &stmt, NULL) != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s", sqlite3_errmsg(sqlite->sc_db));
+		g_string_free(sql, true);
+		g_ptr_array_free(names, true);
+		return (NULL);
+	}
+
+	g_string_free(sql, true);
+	result = rpc_array_create();
+
+	for (;;) {
+retry:
+		ret = sqlite3_step(stmt);
+		switch (ret) {
+		case SQLITE_ROW:
+			row = rpc_dictionary_create();
+			for (i = 0; i < n_groups; i++) {
+				value = rpc_serializer_load("json",
+				    sqlite3_column_text(stmt, (int)i),
+				    (size_t)sqlite3_column_bytes(stmt, (int)i));
+
+				rpc_dictionary_steal_value(row,
+				    rpc_string_get_string_ptr(
+				    rpc_array_get_value(group_by, i)),
+				    value != NULL ? value : rpc_null_create());
+			}
+
+			for (i = 0; i < names->len; i++) {
+				rpc_dictionary_steal_value(row,
+				    g_ptr_array_index(names, i),
+				    sqlite_column_object(stmt, (int)(n_groups + i)));
+			}
+
+			rpc_array_append_stolen_value(result, row);
+			continue;
+
+		case SQLITE_DONE:
+			break;
+
+		case SQLITE_LOCKED:
+		case SQLITE_BUSY:
+			g_usleep(SQLITE_YIELD_DELAY);
+			goto retry;
+
+		default:
+			persist_set_last_error(EFAULT, "%s",
+			    sqlite3_errmsg(sqlite->sc_db));
+			rpc_release(result);
+			result = NULL;
+			break;
+		}
+
+		break;
+	}
+
+	sqlite3_finalize(stmt);
+	g_ptr_array_free(names, true);
+	return (result);
+}
+
+static rpc_object_t
+sqlite_distinct(void *arg, const char *collection, const char *path,
+    rpc_object_t rules, uint64_t limit)
+{
+	struct sqlite_context *sqlite = arg;
+	GString *sql;
+	sqlite3_stmt *stmt;
+	rpc_object_t result;
+	rpc_object_t value;
+	int ret;
+
+	/*
+	 * Grouping on the very same expression persist_add_index() creates
+	 * lets sqlite walk the index instead of the table.
+	 */
+	sql = g_string_new("SELECT ");
+	g_string_append_printf(sql, SQL_EXTRACT("%s") ", count(*)", path);
+
+	if (!sqlite_eval_source(sqlite, collection, sql, rules)) {
+		g_string_free(sql, true);
+		return (NULL);
+	}
+
+	g_string_append(sql, " GROUP BY 1 ORDER BY 2 DESC, 1 ");
+
+	if (limit)
+		g_string_append_printf(sql, "LIMIT %" PRIu64 " ", limit);
+
+	g_string_append(sql, ";");
+
+	if (sqlite->sc_trace)
+		fprintf(stderr, "(%p): query string: %s\n", sqlite, sql->str);
+
+	if (sqlite3_prepare_v2(sqlite->sc_db, sql->str, -1, &stmt, NULL) != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s", sqlite3_errmsg(sqlite->sc_db));
+		g_string_free(sql, true);
+		return (NULL);
+	}
+
+	g_string_free(sql, true);
+	result = rpc_array_create();
+
+	for (;;) {
+retry:
+		ret = sqlite3_step(stmt);
+		switch (ret) {
+		case SQLITE_ROW:
+			value = rpc_serializer_load("json",
+			    sqlite3_column_text(stmt, 0),
+			    (size_t)sqlite3_column_bytes(stmt, 0));
+
+			rpc_array_append_stolen_value(result,
+			    rpc_object_pack("{v,i}",
+			    "value", value != NULL ? value : rpc_null_create(),
+			    "count", (int64_t)sqlite3_column_int64(stmt, 1)));
+			continue;
+
+		case SQLITE_DONE:
+			break;
+
+		case SQLITE_LOCKED:
+		case SQLITE_BUSY:
+			g_usleep(SQLITE_YIELD_DELAY);
+			goto retry;
+
+		default:
+			persist_set_last_error(EFAULT, "%s",
+			    sqlite3_errmsg(sqlite->sc_db));
+			rpc_release(result);
+			result = NULL;
+			break;
+		}
+
+		break;
+	}
+
+	sqlite3_finalize(stmt);
+	return (result);
+}
+
 static void *
 sqlite_query(void *arg, const char *collection, rpc_object_t rules,
     persist_query_params_t params)
 {
+
+	return (sqlite_query_range(arg, collection, rules, params, NULL,
+	    NULL));
+}
+
+static void *
+sqlite_query_range(void *arg, const char *collection, rpc_object_t rules,
+    persist_query_params_t params, const char *lo, const char *hi)
+{
 	struct sqlite_context *sqlite = arg;
 	struct sqlite_iter *iter;
+	const char *sep;
 	GString *sql;
 	sqlite3_stmt *stmt;
 
-	sql = g_string_new("SELECT ");
-	g_string_append_printf(sql, "id, value FROM %s ", collection);
+	sql = g_string_new("SELECT id, value");
 
-	if (rules != NULL) {
-		g_string_append_printf(sql, "WHERE ");
-		if (!sqlite_eval_logic_and(sql, rules)) {
-			g_string_free(sql, true);
-			return (NULL);
-		}
+	/* Rows carry the key they're sorted on, merges need to agree on it */
+	if (params != NULL && params->sort_field != NULL) {
+		g_string_append_printf(sql, ", " SQL_EXTRACT("%s"),
+		    params->sort_field);
 	}
 
+	if (!sqlite_eval_source(sqlite, collection, sql, rules)) {
+		g_string_free(sql, true);
+		return (NULL);
+	}
+
+	/* Ranges are half-open, [lo, hi) */
+	sep = rules == NULL && !sqlite->sc_single ? "WHERE" : "AND";
+	if (lo != NULL) {
+		sqlite_append_printf(sql, " %s id >= %Q ", sep, lo);
+		sep = "AND";
+	}
+
+	if (hi != NULL)
+		sqlite_append_printf(sql, " %s id < %Q ", sep, hi);
+
 	if (params != NULL) {
 		if (params->sort_field != NULL) {
 			g_string_append_printf(sql,
@@ -881,7 +2834,7 @@ sqlite_query(void *arg, const char *collection, rpc_object_t rules,
 }
 
 static int
-sqlite_query_next(void *q_arg, char **id, rpc_object_t *result)
+sqlite_query_next(void *q_arg, const char **id, rpc_object_t *result)
 {
 	struct sqlite_iter *iter = q_arg;
 	int ret;
@@ -913,6 +2866,48 @@ retry:
 	}
 }
 
+static int
+sqlite_query_next_raw(void *q_arg, const char **id, struct persist_raw *raw)
+{
+	struct sqlite_iter *iter = q_arg;
+	int ret;
+
+retry:
+	ret = sqlite3_step(iter->si_stmt);
+	switch (ret) {
+	case SQLITE_DONE:
+		*id = NULL;
+		raw->format = NULL;
+		raw->data = NULL;
+		raw->len = 0;
+		return (0);
+
+	case SQLITE_ROW:
+		return (sqlite_unpack_raw(iter->si_stmt, id, raw));
+
+	case SQLITE_LOCKED:
+	case SQLITE_BUSY:
+		g_usleep(SQLITE_YIELD_DELAY);
+		goto retry;
+
+	default:
+		persist_set_last_error(EFAULT, "%s",
+		    sqlite3_errmsg(iter->si_sc->sc_db));
+		return (-1);
+	}
+}
+
+static const char *
+sqlite_query_sort_key(void *q_arg)
+{
+	struct sqlite_iter *iter = q_arg;
+
+	if (sqlite3_column_count(iter->si_stmt) < 3)
+		return (NULL);
+
+	return ((const char *)sqlite3_column_text(iter->si_stmt, 2));
+}
+
 static void
 sqlite_query_close(void *q_arg)
 {
@@ -923,6 +2918,128 @@ sqlite_query_close(void *q_arg)
 
 }
 
+static rpc_object_t
+sqlite_get_stats(void *arg)
+{
+	struct sqlite_context *sqlite = arg;
+	struct sqlite_stmt_cache *cache;
+	rpc_object_t result;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t size = 0;
+	guint threads;
+	guint i;
+
+	/*
+	 * Owners update their counters atomically, so they can be read
+	 * without stopping them. The mutex keeps the caches around.
+	 */
+	g_mutex_lock(&sqlite_cache_mtx);
+	hits = sqlite->sc_cache_hits;
+	misses = sqlite->sc_cache_misses;
+	evictions = sqlite->sc_cache_evictions;
+
+	for (i = 0; i < sqlite->sc_caches->len; i++) {
+		cache = g_ptr_array_index(sqlite->sc_caches, i);
+		hits += __atomic_load_n(&cache->ssc_hits, __ATOMIC_RELAXED);
+		misses += __atomic_load_n(&cache->ssc_misses,
+		    __ATOMIC_RELAXED);
+		evictions += __atomic_load_n(&cache->ssc_evictions,
+		    __ATOMIC_RELAXED);
+		size += __atomic_load_n(&cache->ssc_entries,
+		    __ATOMIC_RELAXED);
+	}
+
+	threads = sqlite->sc_caches->len;
+	g_mutex_unlock(&sqlite_cache_mtx);
+
+	g_mutex_lock(&sqlite->sc_ckpt_mtx);
+	result = rpc_object_pack("{i,i,i,i,i,i,i,i,i,i,i,i,i}",
+	    "stmt_cache_hits", (int64_t)hits,
+	    "stmt_cache_misses", (int64_t)misses,
+	    "stmt_cache_evictions", (int64_t)evictions,
+	    "stmt_cache_entries", (int64_t)size,
+	    "stmt_cache_threads", (int64_t)threads,
+	    "stmt_cache_size", (int64_t)sqlite->sc_cache_limit,
+	    "checkpoint_passive", (int64_t)sqlite->sc_ckpt_passive,
+	    "checkpoint_restart", (int64_t)sqlite->sc_ckpt_restart,
+	    "checkpoint_truncate", (int64_t)sqlite->sc_ckpt_truncate,
+	    "checkpoint_busy", (int64_t)sqlite->sc_ckpt_busy,
+	    "checkpoint_frames", (int64_t)sqlite->sc_ckpt_frames,
+	    "checkpoint_wal_frames", (int64_t)sqlite->sc_ckpt_wal_frames,
+	    "checkpoint_time", (int64_t)sqlite->sc_ckpt_time);
+	g_mutex_unlock(&sqlite->sc_ckpt_mtx);
+
+	return (result);
+}
+
+/*
+ * Every step holds the connection only while copying a handful of
+ * pages. Writes made through the same connection in between get
+ * copied over by the backup itself, so it never has to start over.
+ */
+static int
+sqlite_backup(void *arg, const char *path, persist_backup_cb_t progress)
+{
+	struct sqlite_context *sqlite = arg;
+	sqlite3_backup *backup;
+	sqlite3 *dest;
+	bool aborted = false;
+	int err;
+
+	err = sqlite3_open(path, &dest);
+	if (err != SQLITE_OK) {
+		persist_set_last_error(EFAULT, "%s", sqlite3_errstr(err));
+		sqlite3_close(dest);
+		return (-1);
+	}
+
+	backup = sqlite3_backup_init(dest, "main", sqlite->sc_db, "main");
+	if (backup == NULL) {
+		persist_set_last_error(EFAULT, "%s", sqlite3_errmsg(dest));
+		sqlite3_close(dest);
+		return (-1);
+	}
+
+	for (;;) {
+		err = sqlite3_backup_step(backup, SQLITE_BACKUP_PAGES);
+		if (err != SQLITE_OK && err != SQLITE_DONE &&
+		    err != SQLITE_BUSY && err != SQLITE_LOCKED)
+			break;
+
+		if (progress != NULL && !progress(
+		    (size_t)sqlite3_backup_remaining(backup),
+		    (size_t)sqlite3_backup_pagecount(backup))) {
+			aborted = true;
+			break;
+		}
+
+		if (err == SQLITE_DONE)
+			break;
+
+		/* Let writers in before copying the next batch */
+		g_usleep(SQLITE_BACKUP_DELAY);
+	}
+
+	sqlite3_backup_finish(backup);
+
+	if (aborted) {
+		persist_set_last_error_static(ECANCELED, "Backup aborted");
+		sqlite3_close(dest);
+		return (-1);
+	}
+
+	if (err != SQLITE_DONE) {
+		persist_set_last_error(EFAULT, "%s", sqlite3_errmsg(dest));
+		sqlite3_close(dest);
+		return (-1);
+	}
+
+	sqlite3_close(dest);
+	return (0);
+}
+
 static const struct persist_driver sqlite_driver = {
 	.pd_name = "sqlite",
 	.pd_open = sqlite_open,
@@ -933,17 +3050,32 @@ static const struct persist_driver sqlite_driver = {
 	.pd_add_index = sqlite_add_index,
 	.pd_drop_index = sqlite_drop_index,
 	.pd_get_object = sqlite_get_object,
+	.pd_get_raw = sqlite_get_raw,
 	.pd_save_object = sqlite_save_object,
 	.pd_save_objects = sqlite_save_objects,
 	.pd_delete_object = sqlite_delete_object,
+	.pd_get_field = sqlite_get_field,
+	.pd_exists = sqlite_exists,
 	.pd_start_tx = sqlite_start_tx,
 	.pd_commit_tx = sqlite_commit_tx,
 	.pd_rollback_tx = sqlite_rollback_tx,
 	.pd_in_tx = sqlite_in_tx,
 	.pd_count = sqlite_count,
+	.pd_aggregate = sqlite_aggregate,
+	.pd_distinct = sqlite_distinct,
 	.pd_query = sqlite_query,
+	.pd_query_range = sqlite_query_range,
 	.pd_query_next = sqlite_query_next,
+	.pd_query_next_raw = sqlite_query_next_raw,
+	.pd_query_sort_key = sqlite_query_sort_key,
 	.pd_query_close = sqlite_query_close,
+	.pd_get_stats = sqlite_get_stats,
+	.pd_backup = sqlite_backup,
+	.pd_open_reader = sqlite_open_reader,
+	.pd_close_reader = sqlite_close_reader,
+	.pd_begin_snapshot = sqlite_begin_snapshot,
+	.pd_begin_snapshots = sqlite_begin_snapshots,
+	.pd_get_splits = sqlite_get_splits,
 };
 
 DECLARE_DRIVER(sqlite_driver);
@@ -0,0 +1,470 @@
+/*
+ * Copyright 2018 Jakub Klama <jakub.klama@gmail.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <persist.h>
+#include "internal.h"
+
+struct persist_filter_cost
+{
+	const char *		pfc_op;
+	int			pfc_cost;
+};
+
+static struct persist_filter *persist_filter_new(enum persist_filter_type);
+static struct persist_filter *persist_filter_parse_rule(rpc_object_t);
+static struct persist_filter *persist_filter_parse_list(
+    enum persist_filter_type, rpc_object_t);
+static struct persist_filter *persist_filter_fold(struct persist_filter *);
+static void persist_filter_flatten(struct persist_filter *);
+static void persist_filter_merge_in(struct persist_filter *);
+static int persist_filter_cost(struct persist_filter *);
+static gint persist_filter_compare(gconstpointer, gconstpointer);
+static void persist_filter_reorder(struct persist_filter *);
+
+/*
+ * Rough estimate of how many rows a predicate lets through, relative
+ * to each other. Cheap and selective predicates get evaluated first.
+ */
+static const struct persist_filter_cost persist_filter_costs[] = {
+	{ "=", 1 },
+	{ "in", 2 },
+	{ "contains", 2 },
+	{ "search", 3 },
+	{ ">", 4 },
+	{ ">=", 4 },
+	{ "<", 4 },
+	{ "<=", 4 },
+	{ "!=", 6 },
+	{ "match", 7 },
+	{ "~", 8 },
+	{ }
+};
+
+static struct persist_filter *
+persist_filter_new(enum persist_filter_type type)
+{
+	struct persist_filter *node;
+
+	node = g_malloc0(sizeof(*node));
+	node->pf_type = type;
+
+	if (type == FILTER_AND || type == FILTER_OR || type == FILTER_NOR) {
+		node->pf_children = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify)persist_filter_free);
+	}
+
+	return (node);
+}
+
+static struct persist_filter *
+persist_filter_parse_list(enum persist_filter_type type, rpc_object_t lst)
+{
+	struct persist_filter *node;
+	bool stop;
+
+	if (rpc_get_type(lst) != RPC_TYPE_ARRAY) {
+		persist_set_last_error_static(EINVAL,
+		    "Logic predicate is not an array");
+		return (NULL);
+	}
+
+	node = persist_filter_new(type);
+	stop = rpc_array_apply(lst, ^(size_t idx, rpc_object_t v) {
+		struct persist_filter *child;
+
+		child = persist_filter_parse_rule(v);
+		if (child == NULL)
+			return ((bool)false);
+
+		g_ptr_array_add(node->pf_children, child);
+		return ((bool)true);
+	});
+
+	if (stop) {
+		persist_filter_free(node);
+		return (NULL);
+	}
+
+	return (node);
+}
+
+static struct persist_filter *
+persist_filter_parse_rule(rpc_object_t rule)
+{
+	struct persist_filter *node;
+	const char *field;
+	const char *op;
+	rpc_object_t value;
+
+	if (rpc_get_type(rule) != RPC_TYPE_ARRAY) {
+		persist_set_last_error_static(EINVAL, "Rule is not an array");
+		return (NULL);
+	}
+
+	switch (rpc_array_get_count(rule)) {
+	case 2:
+		if (rpc_object_unpack(rule, "[s,v]", &op, &value) < 2) {
+			persist_set_last_error(EINVAL,
+			    "Cannot unpack logic tuple");
+			return (NULL);
+		}
+
+		if (g_strcmp0(op, "and") == 0)
+			return (persist_filter_parse_list(FILTER_AND, value));
+
+		if (g_strcmp0(op, "or") == 0)
+			return (persist_filter_parse_list(FILTER_OR, value));
+
+		if (g_strcmp0(op, "nor") == 0)
+			return (persist_filter_parse_list(FILTER_NOR, value));
+
+		persist_set_last_error(EINVAL, "Invalid logic operator: %s", op);
+		return (NULL);
+
+	case 3:
+		if (rpc_object_unpack(rule, "[s,s,v]", &field, &op,
+		    &value) < 3) {
+			persist_set_last_error(EINVAL,
+			    "Cannot unpack field tuple");
+			return (NULL);
+		}
+
+		node = persist_filter_new(FILTER_FIELD);
+		node->pf_field = g_strdup(field);
+		node->pf_op = g_strdup(op);
+		node->pf_value = rpc_retain(value);
+		return (node);
+
+	default:
+		persist_set_last_error(EINVAL,
+		    "Invalid number of items in a rule tuple");
+		return (NULL);
+	}
+}
+
+struct persist_filter *
+persist_filter_parse(rpc_object_t rules)
+{
+
+	if (rules == NULL)
+		return (persist_filter_new(FILTER_TRUE));
+
+	/* Top-level list of rules is an implicit conjunction */
+	return (persist_filter_parse_list(FILTER_AND, rules));
+}
+
+void
+persist_filter_free(struct persist_filter *node)
+{
+
+	if (node->pf_children != NULL)
+		g_ptr_array_free(node->pf_children, true);
+
+	if (node->pf_value != NULL)
+		rpc_release(node->pf_value);
+
+	g_free(node->pf_field);
+	g_free(node->pf_op);
+	g_free(node);
+}
+
+static void
+persist_filter_flatten(struct persist_filter *node)
+{
+	struct persist_filter *child;
+	GPtrArray *flat;
+	guint i, j;
+
+	if (node->pf_children == NULL)
+		return;
+
+	for (i = 0; i < node->pf_children->len; i++)
+		persist_filter_flatten(g_ptr_array_index(node->pf_children, i));
+
+	if (node->pf_type == FILTER_NOR)
+		return;
+
+	/* and(a, and(b, c)) -> and(a, b, c), same for or */
+	flat = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)persist_filter_free);
+
+	for (i = 0; i < node->pf_children->len; i++) {
+		child = g_ptr_array_index(node->pf_children, i);
+		if (child->pf_type != node->pf_type) {
+			g_ptr_array_add(flat, child);
+			continue;
+		}
+
+		for (j = 0; j < child->pf_children->len; j++) {
+			g_ptr_array_add(flat,
+			    g_ptr_array_index(child->pf_children, j));
+		}
+
+		g_ptr_array_set_free_func(child->pf_children, NULL);
+		persist_filter_free(child);
+	}
+
+	g_ptr_array_set_free_func(node->pf_children, NULL);
+	g_ptr_array_free(node->pf_children, true);
+	node->pf_children = flat;
+}
+
+static struct persist_filter *
+persist_filter_fold(struct persist_filter *node)
+{
+	struct persist_filter *child;
+	struct persist_filter *result;
+	enum persist_filter_type absorbing;
+	enum persist_filter_type neutral;
+	guint i;
+
+	switch (node->pf_type) {
+	case FILTER_FIELD:
+		if (g_strcmp0(node->pf_op, "in") == 0 &&
+		    rpc_get_type(node->pf_value) == RPC_TYPE_ARRAY &&
+		    rpc_array_get_count(node->pf_value) == 0) {
+			persist_filter_free(node);
+			return (persist_filter_new(FILTER_FALSE));
+		}
+
+		return (node);
+
+	case FILTER_AND:
+		absorbing = FILTER_FALSE;
+		neutral = FILTER_TRUE;
+		break;
+
+	case FILTER_OR:
+	case FILTER_NOR:
+		absorbing = FILTER_TRUE;
+		neutral = FILTER_FALSE;
+		break;
+
+	default:
+		return (node);
+	}
+
+	for (i = 0; i < node->pf_children->len;) {
+		child = persist_filter_fold(g_ptr_array_index(
+		    node->pf_children, i));
+		node->pf_children->pdata[i] = child;
+
+		if (child->pf_type == absorbing) {
+			result = persist_filter_new(
+			    node->pf_type == FILTER_OR ? FILTER_TRUE :
+			    FILTER_FALSE);
+			persist_filter_free(node);
+			return (result);
+		}
+
+		if (child->pf_type == neutral) {
+			g_ptr_array_remove_index(node->pf_children, i);
+			continue;
+		}
+
+		i++;
+	}
+
+	if (node->pf_children->len == 0) {
+		result = persist_filter_new(
+		    node->pf_type == FILTER_OR ? FILTER_FALSE : FILTER_TRUE);
+		persist_filter_free(node);
+		return (result);
+	}
+
+	if (node->pf_children->len == 1 && node->pf_type != FILTER_NOR) {
+		result = g_ptr_array_index(node->pf_children, 0);
+		g_ptr_array_set_free_func(node->pf_children, NULL);
+		persist_filter_free(node);
+		return (result);
+	}
+
+	return (node);
+}
+
+static void
+persist_filter_merge_in(struct persist_filter *node)
+{
+	struct persist_filter *child;
+	struct persist_filter *target;
+	GHashTable *fields;
+	GHashTable *owned;
+	rpc_object_t values;
+	guint i;
+
+	if (node->pf_children == NULL)
+		return;
+
+	for (i = 0; i < node->pf_children->len; i++)
+		persist_filter_merge_in(g_ptr_array_index(node->pf_children, i));
+
+	if (node->pf_type != FILTER_OR && node->pf_type != FILTER_NOR)
+		return;
+
+	/* or(a = 1, a = 2, a in [3]) -> a in [1, 2, 3] */
+	fields = g_hash_table_new(g_str_hash, g_str_equal);
+	owned = g_hash_table_new(NULL, NULL);
+
+	for (i = 0; i < node->pf_children->len;) {
+		child = g_ptr_array_index(node->pf_children, i);
+		if (child->pf_type != FILTER_FIELD) {
+			i++;
+			continue;
+		}
+
+		if (g_strcmp0(child->pf_op, "=") != 0 &&
+		    (g_strcmp0(child->pf_op, "in") != 0 ||
+		    rpc_get_type(child->pf_value) != RPC_TYPE_ARRAY)) {
+			i++;
+			continue;
+		}
+
+		target = g_hash_table_lookup(fields, child->pf_field);
+		if (target == NULL) {
+			g_hash_table_insert(fields, child->pf_field, child);
+			i++;
+			continue;
+		}
+
+		/* Build a private value array, never modify the caller's */
+		if (!g_hash_table_contains(owned, target)) {
+			if (g_strcmp0(target->pf_op, "=") == 0) {
+				values = rpc_array_create();
+				rpc_array_append_value(values, target->pf_value);
+				g_free(target->pf_op);
+				target->pf_op = g_strdup("in");
+			} else
+				values = rpc_copy(target->pf_value);
+
+			rpc_release(target->pf_value);
+			target->pf_value = values;
+			g_hash_table_add(owned, target);
+		}
+
+		if (g_strcmp0(child->pf_op, "=") == 0)
+			rpc_array_append_value(target->pf_value, child->pf_value);
+		else {
+			rpc_array_apply(child->pf_value,
+			    ^(size_t idx, rpc_object_t v) {
+				rpc_array_append_value(target->pf_value, v);
+				return ((bool)true);
+			});
+		}
+
+		g_ptr_array_remove_index(node->pf_children, i);
+	}
+
+	g_hash_table_destroy(owned);
+	g_hash_table_destroy(fields);
+}
+
+static int
+persist_filter_cost(struct persist_filter *node)
+{
+	const struct persist_filter_cost *c;
+	int cost;
+	guint i;
+
+	switch (node->pf_type) {
+	case FILTER_TRUE:
+	case FILTER_FALSE:
+		return (0);
+
+	case FILTER_FIELD:
+		for (c = &persist_filter_costs[0]; c->pfc_op != NULL; c++) {
+			if (g_strcmp0(c->pfc_op, node->pf_op) == 0)
+				return (c->pfc_cost);
+		}
+
+		return (5);
+
+	case FILTER_AND:
+		/* Conjunction is as selective as its best member */
+		cost = G_MAXINT;
+		for (i = 0; i < node->pf_children->len; i++) {
+			cost = MIN(cost, persist_filter_cost(
+			    g_ptr_array_index(node->pf_children, i)));
+		}
+
+		return (cost);
+
+	case FILTER_OR:
+		/* Disjunction is as selective as its worst member */
+		cost = 0;
+		for (i = 0; i < node->pf_children->len; i++) {
+			cost = MAX(cost, persist_filter_cost(
+			    g_ptr_array_index(node->pf_children, i)));
+		}
+
+		return (cost + 1);
+
+	case FILTER_NOR:
+		return (9);
+	}
+
+	return (0);
+}
+
+static gint
+persist_filter_compare(gconstpointer a, gconstpointer b)
+{
+	struct persist_filter *n1 = *(struct persist_filter **)a;
+	struct persist_filter *n2 = *(struct persist_filter **)b;
+
+	return (persist_filter_cost(n1) - persist_filter_cost(n2));
+}
+
+static void
+persist_filter_reorder(struct persist_filter *node)
+{
+	guint i;
+
+	if (node->pf_children == NULL)
+		return;
+
+	for (i = 0; i < node->pf_children->len; i++)
+		persist_filter_reorder(g_ptr_array_index(node->pf_children, i));
+
+	/* g_ptr_array_sort() is stable, equal-cost rules keep their order */
+	if (node->pf_type == FILTER_AND)
+		g_ptr_array_sort(node->pf_children, persist_filter_compare);
+}
+
+struct persist_filter *
+persist_filter_optimize(struct persist_filter *node)
+{
+
+	persist_filter_flatten(node);
+	node = persist_filter_fold(node);
+	persist_filter_merge_in(node);
+	node = persist_filter_fold(node);
+	persist_filter_flatten(node);
+	persist_filter_reorder(node);
+	return (node);
+}
@@ -45,20 +45,41 @@ struct persist_driver
 	int (*pd_get_collections)(void *, GPtrArray *);
 	int (*pd_create_collection)(void *, const char *);
 	int (*pd_destroy_collection)(void *, const char *);
-	int (*pd_add_index)(void *, const char *, const char *, const char *);
+	int (*pd_add_index)(void *, const char *, const char *, const char *,
+	    persist_index_type_t);
 	int (*pd_drop_index)(void *, const char *, const char *);
 	int (*pd_get_object)(void *, const char *, const char *, rpc_object_t *);
+	int (*pd_get_raw)(void *, const char *, const char *,
+	    struct persist_raw *);
 	int (*pd_save_object)(void *, const char *, const char *, rpc_object_t);
 	int (*pd_save_objects)(void *, const char *, rpc_object_t);
 	int (*pd_delete_object)(void *, const char *, const char *);
-	int (*pd_start_tx)(void *);
+	int (*pd_get_field)(void *, const char *, const char *, const char *,
+	    rpc_object_t *);
+	int (*pd_exists)(void *, const char *, const char *);
+	int (*pd_start_tx)(void *, persist_durability_t);
 	int (*pd_commit_tx)(void *);
 	int (*pd_rollback_tx)(void *);
 	bool (*pd_in_tx)(void *);
 	ssize_t (*pd_count)(void *, const char *, rpc_object_t);
+	rpc_object_t (*pd_aggregate)(void *, const char *, rpc_object_t,
+	    rpc_object_t, rpc_object_t);
+	rpc_object_t (*pd_distinct)(void *, const char *, const char *,
+	    rpc_object_t, uint64_t);
 	void *(*pd_query)(void *, const char *, rpc_object_t, persist_query_params_t);
-	int (*pd_query_next)(void *, char **, rpc_object_t *);
+	void *(*pd_query_range)(void *, const char *, rpc_object_t,
+	    persist_query_params_t, const char *, const char *);
+	int (*pd_query_next)(void *, const char **, rpc_object_t *);
+	int (*pd_query_next_raw)(void *, const char **, struct persist_raw *);
+	const char *(*pd_query_sort_key)(void *);
 	void (*pd_query_close)(void *);
+	rpc_object_t (*pd_get_stats)(void *);
+	int (*pd_backup)(void *, const char *, persist_backup_cb_t);
+	void *(*pd_open_reader)(void *);
+	void (*pd_close_reader)(void *);
+	int (*pd_begin_snapshot)(void *);
+	int (*pd_begin_snapshots)(void *, void **, guint);
+	int (*pd_get_splits)(void *, const char *, guint, GPtrArray *);
 };
 
 struct persist_db
@@ -66,22 +87,88 @@ struct persist_db
 	const struct persist_driver *	pdb_driver;
 	void *				pdb_arg;
 	const char *			pdb_path;
+	rpc_object_t			pdb_params;
+	GMutex				pdb_mtx;
+	GHashTable *			pdb_collections;
+	GHashTable *			pdb_caches;
 };
 
 struct persist_collection
 {
 	struct persist_db *		pc_db;
 	char *				pc_name;
-	rpc_object_t			pc_metadata;
+	rpc_object_t			pc_record;
+	struct persist_cache *		pc_cache;
+	volatile gint			pc_refcnt;
+};
+
+struct persist_snapshot
+{
+	struct persist_db *		ps_db;
+	void *				ps_arg;
 };
 
 struct persist_iter
 {
 	struct persist_collection *	pi_col;
 	void *				pi_arg;
+	struct persist_lazy *		pi_lazy;
+	struct persist_prefetch *	pi_prefetch;
+};
+
+enum persist_filter_type
+{
+	FILTER_TRUE,
+	FILTER_FALSE,
+	FILTER_AND,
+	FILTER_OR,
+	FILTER_NOR,
+	FILTER_FIELD
+};
+
+struct persist_filter
+{
+	enum persist_filter_type	pf_type;
+	char *				pf_field;
+	char *				pf_op;
+	rpc_object_t			pf_value;
+	GPtrArray *			pf_children;
 };
 
 const struct persist_driver *persist_find_driver(const char *name);
 void persist_set_last_error(int code, const char *fmt, ...);
+void persist_set_last_error_static(int code, const char *msg);
+rpc_object_t persist_get_param(struct persist_db *db, const char *name);
+int persist_get_param_int(struct persist_db *db, const char *name,
+    int64_t def, int64_t *result);
+const char *persist_get_param_string(struct persist_db *db, const char *name,
+    const char *def);
+rpc_object_t persist_get_path(rpc_object_t obj, const char *path);
+int persist_compare(rpc_object_t o1, rpc_object_t o2);
+bool persist_aggregate_validate(rpc_object_t group_by, rpc_object_t aggregates);
+rpc_object_t persist_aggregate_fallback(struct persist_collection *col,
+    rpc_object_t filter, rpc_object_t group_by, rpc_object_t aggregates);
+rpc_object_t persist_distinct_fallback(struct persist_collection *col,
+    const char *path, rpc_object_t filter, uint64_t limit);
+struct persist_cache *persist_cache_new(void);
+void persist_cache_free(struct persist_cache *cache);
+bool persist_cache_enabled(struct persist_cache *cache);
+void persist_cache_set_capacity(struct persist_cache *cache, size_t capacity);
+rpc_object_t persist_cache_get(struct persist_cache *cache, const char *id,
+    uint64_t *generation);
+void persist_cache_put(struct persist_cache *cache, const char *id,
+    rpc_object_t obj, uint64_t generation);
+void persist_cache_remove(struct persist_cache *cache, const char *id);
+void persist_cache_flush(struct persist_cache *cache);
+void persist_cache_get_stats(struct persist_cache *cache, uint64_t *hits,
+    uint64_t *misses, uint64_t *entries);
+struct persist_prefetch *persist_prefetch_new(struct persist_iter *iter,
+    size_t size, size_t threads);
+int persist_prefetch_next(struct persist_prefetch *prefetch,
+    rpc_object_t *result);
+void persist_prefetch_free(struct persist_prefetch *prefetch);
+struct persist_filter *persist_filter_parse(rpc_object_t rules);
+struct persist_filter *persist_filter_optimize(struct persist_filter *node);
+void persist_filter_free(struct persist_filter *node);
 
 #endif /* LIBPERSIST_INTERNAL_H */
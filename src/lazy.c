@@ -0,0 +1,344 @@
+/*
+ * Copyright 2018 Jakub Klama <jakub.klama@gmail.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/serializer.h>
+#include "internal.h"
+
+struct persist_lazy_field
+{
+	const char *			plf_key;
+	size_t				plf_keylen;
+	const char *			plf_value;
+	size_t				plf_len;
+	bool				plf_escaped;
+};
+
+struct persist_lazy
+{
+	const char *			pl_format;
+	const char *			pl_data;
+	size_t				pl_len;
+	bool				pl_indexed;
+	bool				pl_valid;
+	GArray *			pl_fields;
+	rpc_object_t			pl_doc;
+};
+
+static const char *persist_lazy_skip_ws(const char *, const char *);
+static const char *persist_lazy_skip_string(const char *, const char *,
+    bool *);
+static const char *persist_lazy_skip_value(const char *, const char *);
+static bool persist_lazy_index(struct persist_lazy *);
+static bool persist_lazy_key_equal(struct persist_lazy_field *,
+    const char *, size_t);
+static rpc_object_t persist_lazy_document(struct persist_lazy *);
+
+static const char *
+persist_lazy_skip_ws(const char *p, const char *end)
+{
+
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' ||
+	    *p == '\r'))
+		p++;
+
+	return (p);
+}
+
+static const char *
+persist_lazy_skip_string(const char *p, const char *end, bool *escaped)
+{
+
+	/* p points at the opening quote */
+	for (p++; p < end; p++) {
+		if (*p == '\\') {
+			*escaped = true;
+			p++;
+			continue;
+		}
+
+		if (*p == '"')
+			return (p + 1);
+	}
+
+	return (NULL);
+}
+
+static const char *
+persist_lazy_skip_value(const char *p, const char *end)
+{
+	bool escaped;
+	int depth = 0;
+
+	if (p >= end)
+		return (NULL);
+
+	if (*p == '"')
+		return (persist_lazy_skip_string(p, end, &escaped));
+
+	if (*p != '{' && *p != '[') {
+		/* Number or a literal */
+		while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+		    *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+			p++;
+
+		return (p);
+	}
+
+	while (p < end) {
+		switch (*p) {
+		case '"':
+			p = persist_lazy_skip_string(p, end, &escaped);
+			if (p == NULL)
+				return (NULL);
+			continue;
+
+		case '{':
+		case '[':
+			depth++;
+			break;
+
+		case '}':
+		case ']':
+			if (--depth == 0)
+				return (p + 1);
+			break;
+		}
+
+		p++;
+	}
+
+	return (NULL);
+}
+
+static bool
+persist_lazy_index(struct persist_lazy *lazy)
+{
+	struct persist_lazy_field field;
+	const char *end = lazy->pl_data + lazy->pl_len;
+	const char *p;
+
+	g_array_set_size(lazy->pl_fields, 0);
+
+	p = persist_lazy_skip_ws(lazy->pl_data, end);
+	if (p == end || *p != '{')
+		return (false);
+
+	p = persist_lazy_skip_ws(p + 1, end);
+	if (p < end && *p == '}')
+		return (true);
+
+	while (p < end) {
+		if (*p != '"')
+			return (false);
+
+		field.plf_escaped = false;
+		field.plf_key = p + 1;
+		p = persist_lazy_skip_string(p, end, &field.plf_escaped);
+		if (p == NULL)
+			return (false);
+
+		field.plf_keylen = (size_t)(p - field.plf_key - 1);
+		p = persist_lazy_skip_ws(p, end);
+		if (p == end || *p != ':')
+			return (false);
+
+		field.plf_value = persist_lazy_skip_ws(p + 1, end);
+		p = persist_lazy_skip_value(field.plf_value, end);
+		if (p == NULL || p == field.plf_value)
+			return (false);
+
+		field.plf_len = (size_t)(p - field.plf_value);
+		g_array_append_val(lazy->pl_fields, field);
+
+		p = persist_lazy_skip_ws(p, end);
+		if (p == end)
+			return (false);
+
+		if (*p == '}')
+			return (true);
+
+		if (*p != ',')
+			return (false);
+
+		p = persist_lazy_skip_ws(p + 1, end);
+	}
+
+	return (false);
+}
+
+static bool
+persist_lazy_key_equal(struct persist_lazy_field *field, const char *key,
+    size_t len)
+{
+	rpc_auto_object_t decoded = NULL;
+
+	if (!field->plf_escaped) {
+		return (field->plf_keylen == len &&
+		    memcmp(field->plf_key, key, len) == 0);
+	}
+
+	/* Escaped keys are rare, let the serializer deal with them */
+	decoded = rpc_serializer_load("json", field->plf_key - 1,
+	    field->plf_keylen + 2);
+	if (decoded == NULL || rpc_get_type(decoded) != RPC_TYPE_STRING)
+		return (false);
+
+	return (rpc_string_get_length(decoded) == len &&
+	    memcmp(rpc_string_get_string_ptr(decoded), key, len) == 0);
+}
+
+static rpc_object_t
+persist_lazy_document(struct persist_lazy *lazy)
+{
+	rpc_object_t err;
+
+	if (lazy->pl_doc != NULL)
+		return (lazy->pl_doc);
+
+	lazy->pl_doc = rpc_serializer_load(lazy->pl_format, lazy->pl_data,
+	    lazy->pl_len);
+	if (lazy->pl_doc == NULL) {
+		err = rpc_get_last_error();
+		persist_set_last_error(rpc_error_get_code(err), "%s",
+		    rpc_error_get_message(err));
+	}
+
+	return (lazy->pl_doc);
+}
+
+persist_lazy_t
+persist_lazy_new(void)
+{
+	struct persist_lazy *lazy;
+
+	lazy = g_malloc0(sizeof(*lazy));
+	lazy->pl_fields = g_array_new(false, false,
+	    sizeof(struct persist_lazy_field));
+
+	return (lazy);
+}
+
+void
+persist_lazy_set(persist_lazy_t lazy, const struct persist_raw *raw)
+{
+
+	lazy->pl_format = raw->format;
+	lazy->pl_data = raw->data;
+	lazy->pl_len = raw->len;
+	lazy->pl_indexed = false;
+	lazy->pl_valid = false;
+
+	if (lazy->pl_doc != NULL) {
+		rpc_release(lazy->pl_doc);
+		lazy->pl_doc = NULL;
+	}
+}
+
+rpc_object_t
+persist_lazy_get(persist_lazy_t lazy, const char *path)
+{
+	struct persist_lazy_field *field;
+	rpc_object_t value;
+	rpc_object_t result;
+	const char *rest;
+	size_t len;
+	guint i;
+
+	if (lazy->pl_data == NULL) {
+		persist_set_last_error_static(EINVAL, "No document");
+		return (NULL);
+	}
+
+	if (!lazy->pl_indexed) {
+		lazy->pl_indexed = true;
+		lazy->pl_valid = g_strcmp0(lazy->pl_format, "json") == 0 &&
+		    persist_lazy_index(lazy);
+	}
+
+	/* Formats we can't scan and documents already decoded */
+	if (!lazy->pl_valid || lazy->pl_doc != NULL) {
+		if (persist_lazy_document(lazy) == NULL)
+			return (NULL);
+
+		result = persist_get_path(lazy->pl_doc, path);
+		return (result != NULL ? rpc_retain(result) : NULL);
+	}
+
+	rest = strchr(path, '.');
+	len = rest != NULL ? (size_t)(rest - path) : strlen(path);
+
+	for (i = 0; i < lazy->pl_fields->len; i++) {
+		field = &g_array_index(lazy->pl_fields,
+		    struct persist_lazy_field, i);
+
+		if (!persist_lazy_key_equal(field, path, len))
+			continue;
+
+		value = rpc_serializer_load("json", field->plf_value,
+		    field->plf_len);
+		if (value == NULL || rest == NULL)
+			return (value);
+
+		result = persist_get_path(value, rest + 1);
+		if (result != NULL)
+			rpc_retain(result);
+
+		rpc_release(value);
+		return (result);
+	}
+
+	return (NULL);
+}
+
+rpc_object_t
+persist_lazy_load(persist_lazy_t lazy)
+{
+
+	if (lazy->pl_data == NULL) {
+		persist_set_last_error_static(EINVAL, "No document");
+		return (NULL);
+	}
+
+	if (persist_lazy_document(lazy) == NULL)
+		return (NULL);
+
+	return (rpc_retain(lazy->pl_doc));
+}
+
+void
+persist_lazy_free(persist_lazy_t lazy)
+{
+
+	if (lazy->pl_doc != NULL)
+		rpc_release(lazy->pl_doc);
+
+	g_array_free(lazy->pl_fields, true);
+	g_free(lazy);
+}
@@ -30,24 +30,112 @@
 #include <persist.h>
 #include "internal.h"
 
-static int
+static rpc_object_t
 persist_create_collection(persist_db_t db, const char *name)
 {
-	rpc_auto_object_t col;
+	rpc_object_t col;
 
 	col = rpc_object_pack("{v,[],{}}",
 	    "created_at", rpc_date_create_from_current(),
 	    "migrations",
 	    "metadata");
 
-	if (db->pdb_driver->pd_create_collection(db->pdb_arg, name) != 0)
-		return (-1);
+	if (db->pdb_driver->pd_create_collection(db->pdb_arg, name) != 0) {
+		rpc_release(col);
+		return (NULL);
+	}
 
 	if (db->pdb_driver->pd_save_object(db->pdb_arg, COLLECTIONS,
-	    name, col) != 0)
-		return (-1);
+	    name, col) != 0) {
+		rpc_release(col);
+		return (NULL);
+	}
 
-	return (0);
+	return (col);
+}
+
+/*
+ * Collection handles are shared and cached together with their
+ * __collections record. The cache itself holds one reference to
+ * every handle it contains.
+ */
+static struct persist_collection *
+persist_collection_lookup(persist_db_t db, const char *name, bool create)
+{
+	struct persist_collection *result;
+	struct persist_collection *existing;
+	rpc_object_t record = NULL;
+
+	g_mutex_lock(&db->pdb_mtx);
+	result = g_hash_table_lookup(db->pdb_collections, name);
+	if (result != NULL)
+		g_atomic_int_inc(&result->pc_refcnt);
+
+	g_mutex_unlock(&db->pdb_mtx);
+
+	if (result != NULL)
+		return (result);
+
+	if (db->pdb_driver->pd_get_object(db->pdb_arg, COLLECTIONS,
+	    name, &record) != 0) {
+		if (errno != ENOENT || !create)
+			return (NULL);
+
+		record = persist_create_collection(db, name);
+		if (record == NULL)
+			return (NULL);
+	}
+
+	result = g_malloc0(sizeof(*result));
+	result->pc_db = db;
+	result->pc_name = g_strdup(name);
+	result->pc_record = record;
+	result->pc_refcnt = 2;
+
+	g_mutex_lock(&db->pdb_mtx);
+	existing = g_hash_table_lookup(db->pdb_collections, name);
+	if (existing != NULL) {
+		/* Another thread loaded the same collection in the meantime */
+		g_atomic_int_inc(&existing->pc_refcnt);
+		g_mutex_unlock(&db->pdb_mtx);
+		result->pc_refcnt = 1;
+		persist_collection_close(result);
+		return (existing);
+	}
+
+	/* Object caches outlive handles, so all handles share one */
+	result->pc_cache = g_hash_table_lookup(db->pdb_caches, name);
+	if (result->pc_cache == NULL) {
+		result->pc_cache = persist_cache_new();
+		g_hash_table_insert(db->pdb_caches, g_strdup(name),
+		    result->pc_cache);
+	}
+
+	g_hash_table_insert(db->pdb_collections, result->pc_name, result);
+	g_mutex_unlock(&db->pdb_mtx);
+	return (result);
+}
+
+static void
+persist_collection_invalidate(persist_db_t db, const char *name)
+{
+	struct persist_cache *cache;
+	GHashTableIter iter;
+
+	g_mutex_lock(&db->pdb_mtx);
+	if (name != NULL) {
+		g_hash_table_remove(db->pdb_collections, name);
+		cache = g_hash_table_lookup(db->pdb_caches, name);
+		if (cache != NULL)
+			persist_cache_flush(cache);
+	} else {
+		g_hash_table_remove_all(db->pdb_collections);
+		g_hash_table_iter_init(&iter, db->pdb_caches);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&cache))
+			persist_cache_flush(cache);
+	}
+
+	g_mutex_unlock(&db->pdb_mtx);
 }
 
 persist_db_t
@@ -58,101 +146,219 @@ persist_open(const char *path, const char *driver, rpc_object_t params)
 	db = g_malloc0(sizeof(*db));
 	db->pdb_path = path;
 	db->pdb_driver = persist_find_driver(driver);
+	db->pdb_params = params != NULL ? rpc_retain(params) : NULL;
 
-	if (db->pdb_driver->pd_open(db) != 0) {
-		g_free(db);
-		return (NULL);
-	}
+	if (db->pdb_driver->pd_open(db) != 0)
+		goto error;
 
 	if (db->pdb_driver->pd_create_collection(db->pdb_arg,
-	    COLLECTIONS) != 0) {
-		g_free(db);
-		return (NULL);
-	}
+	    COLLECTIONS) != 0)
+		goto error;
+
+	g_mutex_init(&db->pdb_mtx);
+	db->pdb_collections = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    NULL, (GDestroyNotify)persist_collection_close);
+	db->pdb_caches = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, (GDestroyNotify)persist_cache_free);
 
 	return (db);
+
+error:
+	if (db->pdb_params != NULL)
+		rpc_release(db->pdb_params);
+
+	g_free(db);
+	return (NULL);
 }
 
 void
 persist_close(persist_db_t db)
 {
 
+	g_hash_table_destroy(db->pdb_collections);
+	g_hash_table_destroy(db->pdb_caches);
+	g_mutex_clear(&db->pdb_mtx);
 	db->pdb_driver->pd_close(db);
+
+	if (db->pdb_params != NULL)
+		rpc_release(db->pdb_params);
+
+	g_free(db);
+}
+
+rpc_object_t
+persist_get_stats(persist_db_t db)
+{
+	struct persist_cache *cache;
+	GHashTableIter iter;
+	rpc_object_t result;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t entries = 0;
+
+	if (db->pdb_driver->pd_get_stats == NULL)
+		result = rpc_dictionary_create();
+	else
+		result = db->pdb_driver->pd_get_stats(db->pdb_arg);
+
+	g_mutex_lock(&db->pdb_mtx);
+	g_hash_table_iter_init(&iter, db->pdb_caches);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&cache))
+		persist_cache_get_stats(cache, &hits, &misses, &entries);
+
+	g_mutex_unlock(&db->pdb_mtx);
+
+	rpc_dictionary_set_int64(result, "object_cache_hits", (int64_t)hits);
+	rpc_dictionary_set_int64(result, "object_cache_misses",
+	    (int64_t)misses);
+	rpc_dictionary_set_int64(result, "object_cache_entries",
+	    (int64_t)entries);
+	return (result);
+}
+
+int
+persist_backup(persist_db_t db, const char *path,
+    persist_backup_cb_t progress)
+{
+
+	if (db->pdb_driver->pd_backup == NULL) {
+		persist_set_last_error_static(ENOTSUP,
+		    "Backups not supported by the driver");
+		return (-1);
+	}
+
+	return (db->pdb_driver->pd_backup(db->pdb_arg, path, progress));
 }
 
 persist_collection_t
 persist_collection_get(persist_db_t db, const char *name, bool create)
 {
-	persist_collection_t result;
-	rpc_auto_object_t col = NULL;
 
-	if (db->pdb_driver->pd_get_object(db->pdb_arg, COLLECTIONS,
-	    name, &col) != 0) {
-		if (errno == ENOENT && create) {
-			if (persist_create_collection(db, name) == 0)
-				goto ok;
-		}
+	return (persist_collection_lookup(db, name, create));
+}
 
-		return (NULL);
-	}
+static int
+persist_object_exists(persist_db_t db, const char *collection,
+    const char *id)
+{
 
-ok:
-	result = g_malloc0(sizeof(*result));
-	result->pc_db = db;
-	result->pc_name = g_strdup(name);
-	return (result);
+	if (db->pdb_driver->pd_exists != NULL)
+		return (db->pdb_driver->pd_exists(db->pdb_arg, collection, id));
+
+	if (db->pdb_driver->pd_get_object(db->pdb_arg, collection, id,
+	    NULL) == 0)
+		return (1);
+
+	return (errno == ENOENT ? 0 : -1);
 }
 
 bool
 persist_collection_exists(persist_db_t db, const char *name)
 {
+	bool cached;
+
+	g_mutex_lock(&db->pdb_mtx);
+	cached = g_hash_table_contains(db->pdb_collections, name);
+	g_mutex_unlock(&db->pdb_mtx);
 
-	return (db->pdb_driver->pd_get_object(db->pdb_arg, COLLECTIONS,
-	    name, NULL) == 0);
+	if (cached)
+		return (true);
+
+	return (persist_object_exists(db, COLLECTIONS, name) == 1);
 }
 
 int
 persist_collection_remove(persist_db_t db, const char *name)
 {
 
-	return (db->pdb_driver->pd_destroy_collection(db->pdb_arg, name));
+	persist_collection_invalidate(db, name);
+
+	if (db->pdb_driver->pd_destroy_collection(db->pdb_arg, name) != 0)
+		return (-1);
+
+	return (db->pdb_driver->pd_delete_object(db->pdb_arg, COLLECTIONS,
+	    name));
 }
 
 rpc_object_t
 persist_collection_get_metadata(persist_db_t db, const char *name)
 {
+	struct persist_collection *col;
 	rpc_object_t result;
 
-	if (db->pdb_driver->pd_get_object(db->pdb_arg, COLLECTIONS,
-	    name, &result) != 0) {
-		persist_set_last_error(ENOENT, "Collection not found");
+	col = persist_collection_lookup(db, name, false);
+	if (col == NULL) {
+		persist_set_last_error_static(ENOENT, "Collection not found");
 		return (NULL);
 	}
 
-	return (rpc_dictionary_get_value(result, "metadata"));
+	/* Record may get swapped by persist_collection_set_metadata() */
+	g_mutex_lock(&db->pdb_mtx);
+	result = rpc_dictionary_get_value(col->pc_record, "metadata");
+	if (result != NULL)
+		rpc_retain(result);
+
+	g_mutex_unlock(&db->pdb_mtx);
+	persist_collection_close(col);
+	return (result);
 }
 
 int
 persist_collection_set_metadata(persist_db_t db, const char *name,
     rpc_object_t metadata)
 {
-	rpc_object_t result;
+	struct persist_collection *col;
+	rpc_object_t record;
+	rpc_object_t old;
 
-	if (db->pdb_driver->pd_get_object(db->pdb_arg, COLLECTIONS,
-	    name, &result) != 0) {
-		persist_set_last_error(ENOENT, "Collection not found");
+	col = persist_collection_lookup(db, name, false);
+	if (col == NULL) {
+		persist_set_last_error_static(ENOENT, "Collection not found");
+		return (-1);
+	}
+
+	g_mutex_lock(&db->pdb_mtx);
+	record = rpc_copy(col->pc_record);
+	g_mutex_unlock(&db->pdb_mtx);
+
+	rpc_dictionary_set_value(record, "metadata", metadata);
+	if (db->pdb_driver->pd_save_object(db->pdb_arg, COLLECTIONS,
+	    name, record) != 0) {
+		rpc_release(record);
+		persist_collection_close(col);
 		return (-1);
 	}
 
-	rpc_dictionary_set_value(result, "metadata", metadata);
-	return (db->pdb_driver->pd_save_object(db->pdb_arg, COLLECTIONS,
-	    name, result));
+	g_mutex_lock(&db->pdb_mtx);
+	old = col->pc_record;
+	col->pc_record = record;
+	g_mutex_unlock(&db->pdb_mtx);
+
+	rpc_release(old);
+	persist_collection_close(col);
+	return (0);
+}
+
+void
+persist_collection_set_cache_size(persist_collection_t col, size_t size)
+{
+
+	/* Serializes against other resizes of the same cache */
+	g_mutex_lock(&col->pc_db->pdb_mtx);
+	persist_cache_set_capacity(col->pc_cache, size);
+	g_mutex_unlock(&col->pc_db->pdb_mtx);
 }
 
 void
 persist_collection_close(persist_collection_t collection)
 {
 
+	if (!g_atomic_int_dec_and_test(&collection->pc_refcnt))
+		return;
+
+	if (collection->pc_record != NULL)
+		rpc_release(collection->pc_record);
+
 	g_free(collection->pc_name);
 	g_free(collection);
 }
@@ -161,7 +367,7 @@ void
 persist_collections_apply(persist_db_t db, persist_collection_iter_t fn)
 {
 	void *iter;
-	char *id;
+	const char *id;
 
 	iter = db->pdb_driver->pd_query(db->pdb_arg, COLLECTIONS, NULL, NULL);
 
@@ -180,8 +386,16 @@ int
 persist_add_index(persist_collection_t col, const char *name, const char *path)
 {
 
+	return (persist_add_index_ex(col, name, path, PERSIST_INDEX_VALUE));
+}
+
+int
+persist_add_index_ex(persist_collection_t col, const char *name,
+    const char *path, persist_index_type_t type)
+{
+
 	return (col->pc_db->pdb_driver->pd_add_index(col->pc_db->pdb_arg,
-	    col->pc_name, name, path));
+	    col->pc_name, name, path, type));
 }
 
 
@@ -197,6 +411,15 @@ rpc_object_t
 persist_get(persist_collection_t col, const char *id)
 {
 	rpc_object_t result;
+	uint64_t generation = 0;
+	bool cached;
+
+	cached = persist_cache_enabled(col->pc_cache);
+	if (cached) {
+		result = persist_cache_get(col->pc_cache, id, &generation);
+		if (result != NULL)
+			return (result);
+	}
 
 	if (col->pc_db->pdb_driver->pd_get_object(col->pc_db->pdb_arg,
 	    col->pc_name, id, &result) != 0)
@@ -210,28 +433,98 @@ persist_get(persist_collection_t col, const char *id)
 	}
 
 	rpc_dictionary_set_string(result, "id", id);
+
+	/* Uncommitted data must not outlive a possible rollback */
+	if (cached && !persist_transaction_active(col->pc_db))
+		persist_cache_put(col->pc_cache, id, result, generation);
+
 	return (result);
 }
 
-persist_iter_t
-persist_query(persist_collection_t col, rpc_object_t rules,
+int
+persist_get_raw(persist_collection_t col, const char *id,
+    struct persist_raw *raw)
+{
+
+	if (col->pc_db->pdb_driver->pd_get_raw == NULL) {
+		persist_set_last_error_static(ENOTSUP,
+		    "Raw access not supported by the driver");
+		return (-1);
+	}
+
+	return (col->pc_db->pdb_driver->pd_get_raw(col->pc_db->pdb_arg,
+	    col->pc_name, id, raw));
+}
+
+rpc_object_t
+persist_get_field(persist_collection_t col, const char *id, const char *path)
+{
+	rpc_object_t obj;
+	rpc_object_t result;
+
+	if (col->pc_db->pdb_driver->pd_get_field != NULL &&
+	    !persist_cache_enabled(col->pc_cache)) {
+		if (col->pc_db->pdb_driver->pd_get_field(col->pc_db->pdb_arg,
+		    col->pc_name, id, path, &result) != 0)
+			return (NULL);
+
+		return (result);
+	}
+
+	/* Cached objects are already decoded, so walk them instead */
+	obj = persist_get(col, id);
+	if (obj == NULL)
+		return (NULL);
+
+	result = persist_get_path(obj, path);
+	if (result != NULL)
+		rpc_retain(result);
+	else
+		persist_set_last_error_static(ENOENT, "No such field");
+
+	rpc_release(obj);
+	return (result);
+}
+
+bool
+persist_exists(persist_collection_t col, const char *id)
+{
+
+	return (persist_object_exists(col->pc_db, col->pc_name, id) == 1);
+}
+
+static persist_iter_t
+persist_query_on(persist_collection_t col, void *arg, rpc_object_t rules,
     persist_query_params_t params)
 {
 	struct persist_iter *iter;
 
 	iter = g_malloc0(sizeof(*iter));
 	iter->pi_col = col;
-	iter->pi_arg = col->pc_db->pdb_driver->pd_query(
-	    col->pc_db->pdb_arg, col->pc_name, rules, params);
+	iter->pi_arg = col->pc_db->pdb_driver->pd_query(arg, col->pc_name,
+	    rules, params);
 
 	if (iter->pi_arg == NULL) {
 		g_free(iter);
 		return (NULL);
 	}
 
+	if (params != NULL && params->prefetch > 0) {
+		iter->pi_prefetch = persist_prefetch_new(iter, params->prefetch,
+		    params->decode_threads);
+	}
+
 	return (iter);
 }
 
+persist_iter_t
+persist_query(persist_collection_t col, rpc_object_t rules,
+    persist_query_params_t params)
+{
+
+	return (persist_query_on(col, col->pc_db->pdb_arg, rules, params));
+}
+
 ssize_t
 persist_count(persist_collection_t col, rpc_object_t filter)
 {
@@ -240,13 +533,44 @@ persist_count(persist_collection_t col, rpc_object_t filter)
 	    col->pc_name, filter));
 }
 
+rpc_object_t
+persist_aggregate(persist_collection_t col, rpc_object_t filter,
+    rpc_object_t group_by, rpc_object_t aggregates)
+{
+	const struct persist_driver *drv = col->pc_db->pdb_driver;
+
+	if (!persist_aggregate_validate(group_by, aggregates))
+		return (NULL);
+
+	if (drv->pd_aggregate == NULL) {
+		return (persist_aggregate_fallback(col, filter, group_by,
+		    aggregates));
+	}
+
+	return (drv->pd_aggregate(col->pc_db->pdb_arg, col->pc_name, filter,
+	    group_by, aggregates));
+}
+
+rpc_object_t
+persist_distinct(persist_collection_t col, const char *path,
+    rpc_object_t filter, uint64_t limit)
+{
+	const struct persist_driver *drv = col->pc_db->pdb_driver;
+
+	if (drv->pd_distinct == NULL)
+		return (persist_distinct_fallback(col, path, filter, limit));
+
+	return (drv->pd_distinct(col->pc_db->pdb_arg, col->pc_name, path,
+	    filter, limit));
+}
+
 int
 persist_save(persist_collection_t col, rpc_object_t obj)
 {
 	const char *id;
 
 	if (rpc_get_type(obj) != RPC_TYPE_DICTIONARY) {
-		persist_set_last_error(EINVAL, "Not a dictionary");
+		persist_set_last_error_static(EINVAL, "Not a dictionary");
 		return (-1);
 	}
 
@@ -261,6 +585,9 @@ persist_save(persist_collection_t col, rpc_object_t obj)
 	    col->pc_name, id, obj) != 0)
 		return (-1);
 
+	if (persist_cache_enabled(col->pc_cache))
+		persist_cache_remove(col->pc_cache, id);
+
 	return (0);
 }
 
@@ -269,14 +596,18 @@ persist_save_many(persist_collection_t col, rpc_object_t objects)
 {
 
 	if (rpc_get_type(objects) != RPC_TYPE_ARRAY) {
-		persist_set_last_error(EINVAL, "Not an array");
+		persist_set_last_error_static(EINVAL, "Not an array");
 		return (-1);
 	}
 
+	/* Ids are not known up front, just drop everything */
 	if (col->pc_db->pdb_driver->pd_save_objects(col->pc_db->pdb_arg,
-	    col->pc_name, objects) != 0)
+	    col->pc_name, objects) != 0) {
+		persist_cache_flush(col->pc_cache);
 		return (-1);
+	}
 
+	persist_cache_flush(col->pc_cache);
 	return (0);
 }
 
@@ -284,7 +615,20 @@ int
 persist_start_transaction(persist_db_t db)
 {
 
-	return (db->pdb_driver->pd_start_tx(db->pdb_arg));
+	return (persist_start_transaction_ex(db, PERSIST_DURABILITY_DEFAULT));
+}
+
+int
+persist_start_transaction_ex(persist_db_t db, persist_durability_t durability)
+{
+
+	if ((unsigned int)durability > PERSIST_DURABILITY_OFF) {
+		persist_set_last_error_static(EINVAL,
+		    "Invalid durability level");
+		return (-1);
+	}
+
+	return (db->pdb_driver->pd_start_tx(db->pdb_arg, durability));
 }
 
 
@@ -299,6 +643,8 @@ int
 persist_rollback_transaction(persist_db_t db)
 {
 
+	/* Collections created or changed in the transaction are gone */
+	persist_collection_invalidate(db, NULL);
 	return (db->pdb_driver->pd_rollback_tx(db->pdb_arg));
 }
 
@@ -314,13 +660,17 @@ persist_transaction_active(_Nonnull persist_db_t db)
 int
 persist_iter_next(persist_iter_t iter, rpc_object_t *result)
 {
-	char *id;
+	const char *id;
 
 	if (result == NULL) {
-		persist_set_last_error(EINVAL, "result must not be NULL");
+		persist_set_last_error_static(EINVAL,
+		    "result must not be NULL");
 		return (-1);
 	}
 
+	if (iter->pi_prefetch != NULL)
+		return (persist_prefetch_next(iter->pi_prefetch, result));
+
 	if (iter->pi_col->pc_db->pdb_driver->pd_query_next(iter->pi_arg,
 	    &id, result) != 0)
 		return (-1);
@@ -329,7 +679,62 @@ persist_iter_next(persist_iter_t iter, rpc_object_t *result)
 		return (0);
 
 	rpc_dictionary_set_string(*result, "id", id);
-	g_free(id);
+	return (0);
+}
+
+int
+persist_iter_next_raw(persist_iter_t iter, const char **idp,
+    struct persist_raw *raw)
+{
+	const struct persist_driver *driver = iter->pi_col->pc_db->pdb_driver;
+
+	if (idp == NULL || raw == NULL) {
+		persist_set_last_error_static(EINVAL,
+		    "idp and raw must not be NULL");
+		return (-1);
+	}
+
+	if (driver->pd_query_next_raw == NULL) {
+		persist_set_last_error_static(ENOTSUP,
+		    "Raw access not supported by the driver");
+		return (-1);
+	}
+
+	if (iter->pi_prefetch != NULL) {
+		persist_set_last_error_static(ENOTSUP,
+		    "Raw access not supported by prefetching iterators");
+		return (-1);
+	}
+
+	return (driver->pd_query_next_raw(iter->pi_arg, idp, raw));
+}
+
+int
+persist_iter_next_lazy(persist_iter_t iter, const char **idp,
+    persist_lazy_t *result)
+{
+	struct persist_raw raw;
+
+	if (result == NULL) {
+		persist_set_last_error_static(EINVAL,
+		    "result must not be NULL");
+		return (-1);
+	}
+
+	if (persist_iter_next_raw(iter, idp, &raw) != 0)
+		return (-1);
+
+	if (*idp == NULL) {
+		*result = NULL;
+		return (0);
+	}
+
+	/* One view per iterator, so its index storage gets reused */
+	if (iter->pi_lazy == NULL)
+		iter->pi_lazy = persist_lazy_new();
+
+	persist_lazy_set(iter->pi_lazy, &raw);
+	*result = iter->pi_lazy;
 	return (0);
 }
 
@@ -337,14 +742,121 @@ void
 persist_iter_close(persist_iter_t iter)
 {
 
+	/* The prefetch thread has to be done with the query first */
+	if (iter->pi_prefetch != NULL)
+		persist_prefetch_free(iter->pi_prefetch);
+
 	iter->pi_col->pc_db->pdb_driver->pd_query_close(iter->pi_arg);
+
+	if (iter->pi_lazy != NULL)
+		persist_lazy_free(iter->pi_lazy);
+
 	g_free(iter);
 }
 
+persist_snapshot_t
+persist_snapshot_open(persist_db_t db)
+{
+	struct persist_snapshot *snap;
+
+	if (db->pdb_driver->pd_open_reader == NULL ||
+	    db->pdb_driver->pd_begin_snapshot == NULL) {
+		persist_set_last_error_static(ENOTSUP,
+		    "Snapshots not supported by the driver");
+		return (NULL);
+	}
+
+	snap = g_malloc0(sizeof(*snap));
+	snap->ps_db = db;
+	snap->ps_arg = db->pdb_driver->pd_open_reader(db->pdb_arg);
+	if (snap->ps_arg == NULL) {
+		g_free(snap);
+		return (NULL);
+	}
+
+	if (db->pdb_driver->pd_begin_snapshot(snap->ps_arg) != 0) {
+		db->pdb_driver->pd_close_reader(snap->ps_arg);
+		g_free(snap);
+		return (NULL);
+	}
+
+	return (snap);
+}
+
+void
+persist_snapshot_close(persist_snapshot_t snap)
+{
+
+	snap->ps_db->pdb_driver->pd_close_reader(snap->ps_arg);
+	g_free(snap);
+}
+
+rpc_object_t
+persist_snapshot_get(persist_snapshot_t snap, persist_collection_t col,
+    const char *id)
+{
+	rpc_object_t result;
+
+	if (col->pc_db != snap->ps_db) {
+		persist_set_last_error_static(EINVAL,
+		    "Collection belongs to a different database");
+		return (NULL);
+	}
+
+	if (col->pc_db->pdb_driver->pd_get_object(snap->ps_arg, col->pc_name,
+	    id, &result) != 0)
+		return (NULL);
+
+	if (rpc_get_type(result) != RPC_TYPE_DICTIONARY) {
+		persist_set_last_error_static(EINVAL,
+		    "A non-dictionary object returned");
+		rpc_release(result);
+		return (NULL);
+	}
+
+	rpc_dictionary_set_string(result, "id", id);
+	return (result);
+}
+
+persist_iter_t
+persist_snapshot_query(persist_snapshot_t snap, persist_collection_t col,
+    rpc_object_t rules, persist_query_params_t params)
+{
+
+	if (col->pc_db != snap->ps_db) {
+		persist_set_last_error_static(EINVAL,
+		    "Collection belongs to a different database");
+		return (NULL);
+	}
+
+	return (persist_query_on(col, snap->ps_arg, rules, params));
+}
+
+ssize_t
+persist_snapshot_count(persist_snapshot_t snap, persist_collection_t col,
+    rpc_object_t filter)
+{
+
+	if (col->pc_db != snap->ps_db) {
+		persist_set_last_error_static(EINVAL,
+		    "Collection belongs to a different database");
+		return (-1);
+	}
+
+	return (col->pc_db->pdb_driver->pd_count(snap->ps_arg, col->pc_name,
+	    filter));
+}
+
 int
 persist_delete(persist_collection_t col, const char *id)
 {
 
-	return (col->pc_db->pdb_driver->pd_delete_object(col->pc_db->pdb_arg,
-	    col->pc_name, id));
+	if (col->pc_db->pdb_driver->pd_delete_object(col->pc_db->pdb_arg,
+	    col->pc_name, id) != 0)
+		return (-1);
+
+	if (persist_cache_enabled(col->pc_cache))
+		persist_cache_remove(col->pc_cache, id);
+
+	return (0);
 }
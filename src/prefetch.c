@@ -0,0 +1,320 @@
+/*
+ * Copyright 2018 Jakub Klama <jakub.klama@gmail.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include <rpc/serializer.h>
+#include "internal.h"
+
+/*
+ * Prefetching iterators step the driver query on a worker thread,
+ * which keeps up to pp_size rows ahead of the consumer in a ring.
+ * With decode threads, parsing of those rows is spread over a thread
+ * pool, while the consumer still gets them in query order.
+ *
+ * Last error slots are per-thread, so errors hit by workers are
+ * recorded in the ring and re-raised on the consumer thread.
+ */
+
+struct persist_prefetch_item
+{
+	struct persist_prefetch *	ppi_prefetch;
+	GString *			ppi_id;
+	GByteArray *			ppi_data;
+	const char *			ppi_format;
+	rpc_object_t			ppi_result;
+	bool				ppi_done;
+	int				ppi_errcode;
+	char *				ppi_errmsg;
+};
+
+struct persist_prefetch
+{
+	struct persist_iter *		pp_iter;
+	GThread *			pp_thread;
+	GThreadPool *			pp_pool;
+	GMutex				pp_mtx;
+	GCond				pp_cv;
+	struct persist_prefetch_item *	pp_ring;
+	size_t				pp_size;
+	uint64_t			pp_head;
+	uint64_t			pp_tail;
+	bool				pp_eof;
+	bool				pp_stop;
+	int				pp_errcode;
+	char *				pp_errmsg;
+};
+
+static void persist_prefetch_fail(int *, char **);
+static void persist_prefetch_decode(gpointer, gpointer);
+static void persist_prefetch_finish(struct persist_prefetch *, bool);
+static gpointer persist_prefetch_worker(gpointer);
+
+static void
+persist_prefetch_fail(int *codep, char **msgp)
+{
+	const char *msg;
+
+	*codep = persist_get_last_error(&msg);
+	*msgp = g_strdup(msg);
+}
+
+static void
+persist_prefetch_decode(gpointer data, gpointer user_data)
+{
+	struct persist_prefetch_item *item = data;
+	struct persist_prefetch *prefetch = item->ppi_prefetch;
+	rpc_object_t result;
+	rpc_object_t err;
+
+	result = rpc_serializer_load(item->ppi_format, item->ppi_data->data,
+	    item->ppi_data->len);
+
+	if (result != NULL && rpc_get_type(result) != RPC_TYPE_DICTIONARY) {
+		rpc_release(result);
+		result = NULL;
+		persist_set_last_error_static(EINVAL,
+		    "A non-dictionary object returned");
+	} else if (result == NULL) {
+		err = rpc_get_last_error();
+		persist_set_last_error(rpc_error_get_code(err), "%s",
+		    rpc_error_get_message(err));
+	}
+
+	if (result != NULL)
+		rpc_dictionary_set_string(result, "id", item->ppi_id->str);
+
+	g_mutex_lock(&prefetch->pp_mtx);
+	item->ppi_result = result;
+	if (result == NULL)
+		persist_prefetch_fail(&item->ppi_errcode, &item->ppi_errmsg);
+
+	item->ppi_done = true;
+	g_cond_broadcast(&prefetch->pp_cv);
+	g_mutex_unlock(&prefetch->pp_mtx);
+}
+
+static void
+persist_prefetch_finish(struct persist_prefetch *prefetch, bool failed)
+{
+
+	g_mutex_lock(&prefetch->pp_mtx);
+	if (failed) {
+		persist_prefetch_fail(&prefetch->pp_errcode,
+		    &prefetch->pp_errmsg);
+	}
+
+	prefetch->pp_eof = true;
+	g_cond_broadcast(&prefetch->pp_cv);
+	g_mutex_unlock(&prefetch->pp_mtx);
+}
+
+static gpointer
+persist_prefetch_worker(gpointer arg)
+{
+	struct persist_prefetch *prefetch = arg;
+	struct persist_iter *iter = prefetch->pp_iter;
+	const struct persist_driver *driver = iter->pi_col->pc_db->pdb_driver;
+	struct persist_prefetch_item *item;
+	struct persist_raw raw;
+	rpc_object_t result;
+	const char *id;
+	bool pending;
+	int ret;
+
+	for (;;) {
+		g_mutex_lock(&prefetch->pp_mtx);
+		while (!prefetch->pp_stop &&
+		    prefetch->pp_tail - prefetch->pp_head == prefetch->pp_size)
+			g_cond_wait(&prefetch->pp_cv, &prefetch->pp_mtx);
+
+		if (prefetch->pp_stop) {
+			g_mutex_unlock(&prefetch->pp_mtx);
+			return (NULL);
+		}
+
+		item = &prefetch->pp_ring[
+		    prefetch->pp_tail % prefetch->pp_size];
+		g_mutex_unlock(&prefetch->pp_mtx);
+
+		/* Drivers without raw access decode rows themselves */
+		pending = driver->pd_query_next_raw != NULL;
+		if (pending) {
+			result = NULL;
+			ret = driver->pd_query_next_raw(iter->pi_arg, &id,
+			    &raw);
+		} else {
+			ret = driver->pd_query_next(iter->pi_arg, &id, &result);
+			if (ret == 0 && result == NULL)
+				id = NULL;
+		}
+
+		if (ret != 0 || id == NULL) {
+			persist_prefetch_finish(prefetch, ret != 0);
+			return (NULL);
+		}
+
+		if (!pending)
+			rpc_dictionary_set_string(result, "id", id);
+
+		/* The consumer doesn't look at the slot until pp_tail moves */
+		item->ppi_result = result;
+		item->ppi_done = !pending;
+		g_string_assign(item->ppi_id, id);
+
+		if (pending) {
+			item->ppi_format = raw.format;
+			g_byte_array_set_size(item->ppi_data, 0);
+			g_byte_array_append(item->ppi_data, raw.data,
+			    (guint)raw.len);
+
+			if (prefetch->pp_pool == NULL)
+				persist_prefetch_decode(item, NULL);
+		}
+
+		g_mutex_lock(&prefetch->pp_mtx);
+		prefetch->pp_tail++;
+		g_cond_broadcast(&prefetch->pp_cv);
+		g_mutex_unlock(&prefetch->pp_mtx);
+
+		if (pending && prefetch->pp_pool != NULL)
+			g_thread_pool_push(prefetch->pp_pool, item, NULL);
+	}
+}
+
+struct persist_prefetch *
+persist_prefetch_new(struct persist_iter *iter, size_t size, size_t threads)
+{
+	struct persist_prefetch *prefetch;
+	size_t i;
+
+	prefetch = g_malloc0(sizeof(*prefetch));
+	prefetch->pp_iter = iter;
+	prefetch->pp_size = size;
+	prefetch->pp_ring = g_malloc0_n(size, sizeof(*prefetch->pp_ring));
+	g_mutex_init(&prefetch->pp_mtx);
+	g_cond_init(&prefetch->pp_cv);
+
+	for (i = 0; i < size; i++) {
+		prefetch->pp_ring[i].ppi_prefetch = prefetch;
+		prefetch->pp_ring[i].ppi_id = g_string_new(NULL);
+		prefetch->pp_ring[i].ppi_data = g_byte_array_new();
+	}
+
+	if (threads > 0) {
+		prefetch->pp_pool = g_thread_pool_new(persist_prefetch_decode,
+		    NULL, (gint)MIN(threads, size), false, NULL);
+	}
+
+	prefetch->pp_thread = g_thread_new("persist prefetch",
+	    persist_prefetch_worker, prefetch);
+
+	return (prefetch);
+}
+
+int
+persist_prefetch_next(struct persist_prefetch *prefetch, rpc_object_t *result)
+{
+	struct persist_prefetch_item *item;
+	int ret = 0;
+
+	g_mutex_lock(&prefetch->pp_mtx);
+	for (;;) {
+		if (prefetch->pp_head < prefetch->pp_tail) {
+			item = &prefetch->pp_ring[
+			    prefetch->pp_head % prefetch->pp_size];
+			if (item->ppi_done)
+				break;
+		} else if (prefetch->pp_eof) {
+			item = NULL;
+			break;
+		}
+
+		g_cond_wait(&prefetch->pp_cv, &prefetch->pp_mtx);
+	}
+
+	if (item == NULL) {
+		*result = NULL;
+		if (prefetch->pp_errmsg != NULL) {
+			persist_set_last_error(prefetch->pp_errcode, "%s",
+			    prefetch->pp_errmsg);
+			ret = -1;
+		}
+
+		g_mutex_unlock(&prefetch->pp_mtx);
+		return (ret);
+	}
+
+	*result = item->ppi_result;
+	item->ppi_result = NULL;
+	if (*result == NULL) {
+		persist_set_last_error(item->ppi_errcode, "%s",
+		    item->ppi_errmsg);
+		g_free(item->ppi_errmsg);
+		item->ppi_errmsg = NULL;
+		ret = -1;
+	}
+
+	prefetch->pp_head++;
+	g_cond_broadcast(&prefetch->pp_cv);
+	g_mutex_unlock(&prefetch->pp_mtx);
+	return (ret);
+}
+
+void
+persist_prefetch_free(struct persist_prefetch *prefetch)
+{
+	struct persist_prefetch_item *item;
+	size_t i;
+
+	g_mutex_lock(&prefetch->pp_mtx);
+	prefetch->pp_stop = true;
+	g_cond_broadcast(&prefetch->pp_cv);
+	g_mutex_unlock(&prefetch->pp_mtx);
+
+	g_thread_join(prefetch->pp_thread);
+
+	/* Drops queued rows, but waits for those being decoded */
+	if (prefetch->pp_pool != NULL)
+		g_thread_pool_free(prefetch->pp_pool, true, true);
+
+	for (i = 0; i < prefetch->pp_size; i++) {
+		item = &prefetch->pp_ring[i];
+		if (item->ppi_result != NULL)
+			rpc_release(item->ppi_result);
+
+		g_free(item->ppi_errmsg);
+		g_string_free(item->ppi_id, true);
+		g_byte_array_unref(item->ppi_data);
+	}
+
+	g_mutex_clear(&prefetch->pp_mtx);
+	g_cond_clear(&prefetch->pp_cv);
+	g_free(prefetch->pp_errmsg);
+	g_free(prefetch->pp_ring);
+	g_free(prefetch);
+}
@@ -0,0 +1,391 @@
+/*
+ * Copyright 2018 Jakub Klama <jakub.klama@gmail.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib.h>
+#include <rpc/object.h>
+#include "internal.h"
+
+#define	PERSIST_SCAN_QUEUE	256
+
+/*
+ * Parallel scans split a collection into id ranges, each scanned by
+ * a thread of its own on a separate reader connection. All readers are
+ * pinned to the same state before any thread starts. Unordered scans
+ * hand objects to the callback right on those threads. Ordered scans
+ * queue them per partition and merge them on the calling thread.
+ */
+
+struct persist_scan;
+
+struct persist_scan_part
+{
+	struct persist_scan *		psp_scan;
+	GThread *			psp_thread;
+	void *				psp_reader;
+	const char *			psp_lo;
+	const char *			psp_hi;
+	GQueue				psp_queue;
+	bool				psp_done;
+};
+
+struct persist_scan_item
+{
+	rpc_object_t			psi_obj;
+	char *				psi_key;
+};
+
+struct persist_scan
+{
+	struct persist_collection *	ps_col;
+	rpc_object_t			ps_filter;
+	struct persist_query_params	ps_params;
+	persist_scan_cb_t		ps_cb;
+	bool				ps_ordered;
+	GMutex				ps_mtx;
+	GCond				ps_cv;
+	volatile gint			ps_stop;
+	int				ps_errcode;
+	char *				ps_errmsg;
+	struct persist_scan_part *	ps_parts;
+	guint				ps_nparts;
+};
+
+static void persist_scan_fail(struct persist_scan *);
+static bool persist_scan_emit(struct persist_scan_part *, rpc_object_t,
+    const char *);
+static void persist_scan_item_free(struct persist_scan_item *);
+static gpointer persist_scan_worker(gpointer);
+static int persist_scan_compare(struct persist_scan *,
+    struct persist_scan_item *, struct persist_scan_item *);
+static void persist_scan_merge(struct persist_scan *);
+
+static void
+persist_scan_fail(struct persist_scan *scan)
+{
+	const char *msg;
+	int code;
+
+	code = persist_get_last_error(&msg);
+
+	g_mutex_lock(&scan->ps_mtx);
+	if (scan->ps_errmsg == NULL) {
+		scan->ps_errcode = code;
+		scan->ps_errmsg = g_strdup(msg);
+	}
+
+	g_atomic_int_set(&scan->ps_stop, 1);
+	g_cond_broadcast(&scan->ps_cv);
+	g_mutex_unlock(&scan->ps_mtx);
+}
+
+static bool
+persist_scan_emit(struct persist_scan_part *part, rpc_object_t obj,
+    const char *key)
+{
+	struct persist_scan *scan = part->psp_scan;
+	struct persist_scan_item *item;
+	bool ret;
+
+	if (!scan->ps_ordered) {
+		ret = scan->ps_cb(obj);
+		rpc_release(obj);
+		if (!ret)
+			g_atomic_int_set(&scan->ps_stop, 1);
+
+		return (ret);
+	}
+
+	item = g_malloc(sizeof(*item));
+	item->psi_obj = obj;
+	item->psi_key = g_strdup(key);
+
+	g_mutex_lock(&scan->ps_mtx);
+	while (part->psp_queue.length >= PERSIST_SCAN_QUEUE &&
+	    !g_atomic_int_get(&scan->ps_stop))
+		g_cond_wait(&scan->ps_cv, &scan->ps_mtx);
+
+	g_queue_push_tail(&part->psp_queue, item);
+	g_cond_broadcast(&scan->ps_cv);
+	g_mutex_unlock(&scan->ps_mtx);
+	return (!g_atomic_int_get(&scan->ps_stop));
+}
+
+static void
+persist_scan_item_free(struct persist_scan_item *item)
+{
+
+	rpc_release(item->psi_obj);
+	g_free(item->psi_key);
+	g_free(item);
+}
+
+static gpointer
+persist_scan_worker(gpointer arg)
+{
+	struct persist_scan_part *part = arg;
+	struct persist_scan *scan = part->psp_scan;
+	const struct persist_driver *driver = scan->ps_col->pc_db->pdb_driver;
+	rpc_object_t obj;
+	const char *key;
+	const char *id;
+	void *iter;
+
+	iter = driver->pd_query_range(part->psp_reader, scan->ps_col->pc_name,
+	    scan->ps_filter, &scan->ps_params, part->psp_lo, part->psp_hi);
+	if (iter == NULL) {
+		persist_scan_fail(scan);
+		goto done;
+	}
+
+	while (!g_atomic_int_get(&scan->ps_stop)) {
+		if (driver->pd_query_next(iter, &id, &obj) != 0) {
+			persist_scan_fail(scan);
+			break;
+		}
+
+		if (id == NULL || obj == NULL)
+			break;
+
+		key = NULL;
+		if (scan->ps_ordered && driver->pd_query_sort_key != NULL)
+			key = driver->pd_query_sort_key(iter);
+
+		rpc_dictionary_set_string(obj, "id", id);
+		if (!persist_scan_emit(part, obj, key))
+			break;
+	}
+
+	driver->pd_query_close(iter);
+
+done:
+	g_mutex_lock(&scan->ps_mtx);
+	part->psp_done = true;
+	g_cond_broadcast(&scan->ps_cv);
+	g_mutex_unlock(&scan->ps_mtx);
+	return (NULL);
+}
+
+/*
+ * Partitions come sorted by the driver, so they have to be merged in
+ * the very same order. Keys it hands out are compared as it would
+ * compare them, values are only compared when there are none.
+ */
+static int
+persist_scan_compare(struct persist_scan *scan, struct persist_scan_item *i1,
+    struct persist_scan_item *i2)
+{
+	const char *field = scan->ps_params.sort_field;
+	int ret;
+
+	if (i1->psi_key != NULL && i2->psi_key != NULL)
+		ret = strcmp(i1->psi_key, i2->psi_key);
+	else {
+		ret = persist_compare(persist_get_path(i1->psi_obj, field),
+		    persist_get_path(i2->psi_obj, field));
+	}
+
+	return (scan->ps_params.descending ? -ret : ret);
+}
+
+static void
+persist_scan_merge(struct persist_scan *scan)
+{
+	struct persist_scan_part *part;
+	struct persist_scan_part *best;
+	struct persist_scan_item *item;
+	uint64_t skip = scan->ps_params.offset;
+	uint64_t left = scan->ps_params.limit;
+	guint i;
+
+	if (scan->ps_params.single)
+		left = 1;
+
+	g_mutex_lock(&scan->ps_mtx);
+	while (!g_atomic_int_get(&scan->ps_stop)) {
+		/*
+		 * Wait until every partition either has an object queued
+		 * or is finished, then take the smallest head. Ties go to
+		 * the lower id range, which keeps the merge stable.
+		 */
+		best = NULL;
+		for (i = 0; i < scan->ps_nparts; i++) {
+			part = &scan->ps_parts[i];
+			if (part->psp_queue.length == 0) {
+				if (part->psp_done)
+					continue;
+
+				break;
+			}
+
+			if (best == NULL || persist_scan_compare(scan,
+			    g_queue_peek_head(&part->psp_queue),
+			    g_queue_peek_head(&best->psp_queue)) < 0)
+				best = part;
+		}
+
+		if (i < scan->ps_nparts) {
+			g_cond_wait(&scan->ps_cv, &scan->ps_mtx);
+			continue;
+		}
+
+		if (best == NULL)
+			break;
+
+		item = g_queue_pop_head(&best->psp_queue);
+		g_cond_broadcast(&scan->ps_cv);
+
+		if (skip > 0) {
+			skip--;
+			persist_scan_item_free(item);
+			continue;
+		}
+
+		g_mutex_unlock(&scan->ps_mtx);
+		if (!scan->ps_cb(item->psi_obj) || (left > 0 && --left == 0))
+			g_atomic_int_set(&scan->ps_stop, 1);
+
+		persist_scan_item_free(item);
+		g_mutex_lock(&scan->ps_mtx);
+	}
+
+	g_cond_broadcast(&scan->ps_cv);
+	g_mutex_unlock(&scan->ps_mtx);
+}
+
+int
+persist_query_parallel(persist_collection_t col, rpc_object_t filter,
+    persist_query_params_t params, size_t nthreads, persist_scan_cb_t cb)
+{
+	const struct persist_driver *driver = col->pc_db->pdb_driver;
+	struct persist_scan scan = { 0 };
+	struct persist_scan_part *part;
+	struct persist_scan_item *item;
+	GPtrArray *readers = NULL;
+	GPtrArray *splits;
+	int ret = 0;
+	guint i;
+
+	if (driver->pd_open_reader == NULL || driver->pd_query_range == NULL ||
+	    driver->pd_get_splits == NULL ||
+	    driver->pd_begin_snapshots == NULL) {
+		persist_set_last_error_static(ENOTSUP,
+		    "Parallel scans not supported by the driver");
+		return (-1);
+	}
+
+	if (params != NULL)
+		scan.ps_params = *params;
+
+	scan.ps_ordered = scan.ps_params.sort_field != NULL;
+	if (!scan.ps_ordered && (scan.ps_params.offset > 0 ||
+	    scan.ps_params.limit > 0 || scan.ps_params.single)) {
+		persist_set_last_error_static(EINVAL,
+		    "offset and limit require a sort field");
+		return (-1);
+	}
+
+	/* Partitions can't know about each other, so offsets apply later */
+	if (scan.ps_params.single)
+		scan.ps_params.limit = 1;
+
+	if (scan.ps_params.limit > 0)
+		scan.ps_params.limit += scan.ps_params.offset;
+
+	scan.ps_params.offset = 0;
+	scan.ps_params.single = false;
+	scan.ps_params.prefetch = 0;
+	scan.ps_col = col;
+	scan.ps_filter = filter;
+	scan.ps_cb = cb;
+
+	splits = g_ptr_array_new_with_free_func(g_free);
+	if (driver->pd_get_splits(col->pc_db->pdb_arg, col->pc_name,
+	    (guint)MAX(nthreads, 1), splits) != 0) {
+		g_ptr_array_free(splits, true);
+		return (-1);
+	}
+
+	g_mutex_init(&scan.ps_mtx);
+	g_cond_init(&scan.ps_cv);
+	scan.ps_nparts = splits->len + 1;
+	scan.ps_parts = g_malloc0_n(scan.ps_nparts, sizeof(*scan.ps_parts));
+	readers = g_ptr_array_new_with_free_func(driver->pd_close_reader);
+
+	for (i = 0; i < scan.ps_nparts; i++) {
+		part = &scan.ps_parts[i];
+		part->psp_scan = &scan;
+		part->psp_lo = i > 0 ? g_ptr_array_index(splits, i - 1) : NULL;
+		part->psp_hi = i < splits->len ?
+		    g_ptr_array_index(splits, i) : NULL;
+		g_queue_init(&part->psp_queue);
+		part->psp_reader = driver->pd_open_reader(col->pc_db->pdb_arg);
+		if (part->psp_reader == NULL) {
+			ret = -1;
+			goto out;
+		}
+
+		g_ptr_array_add(readers, part->psp_reader);
+	}
+
+	/* Otherwise partitions would each see the commit of their own */
+	if (driver->pd_begin_snapshots(col->pc_db->pdb_arg, readers->pdata,
+	    readers->len) != 0) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < scan.ps_nparts; i++) {
+		part = &scan.ps_parts[i];
+		part->psp_thread = g_thread_new("persist scan",
+		    persist_scan_worker, part);
+	}
+
+	if (scan.ps_ordered)
+		persist_scan_merge(&scan);
+
+	for (i = 0; i < scan.ps_nparts; i++) {
+		part = &scan.ps_parts[i];
+		g_thread_join(part->psp_thread);
+		while ((item = g_queue_pop_head(&part->psp_queue)) != NULL)
+			persist_scan_item_free(item);
+	}
+
+	if (scan.ps_errmsg != NULL) {
+		persist_set_last_error(scan.ps_errcode, "%s", scan.ps_errmsg);
+		ret = -1;
+	}
+
+out:
+	g_ptr_array_free(readers, true);
+	g_mutex_clear(&scan.ps_mtx);
+	g_cond_clear(&scan.ps_cv);
+	g_free(scan.ps_errmsg);
+	g_free(scan.ps_parts);
+	g_ptr_array_free(splits, true);
+	return (ret);
+}
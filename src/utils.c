@@ -25,21 +25,29 @@
  */
 
 #include <errno.h>
+#include <string.h>
 #include <glib.h>
-#include <errno.h>
 #include "linker_set.h"
 #include "internal.h"
 
+#define	ERROR_BUFSIZE	1024
+
+/*
+ * Every thread owns a single error slot, allocated the first time it
+ * reports an error and reused afterwards. Messages are formatted into
+ * the slot buffer, static ones are merely pointed to.
+ */
 struct error
 {
-	int	code;
-	char *	message;
+	int		code;
+	const char *	message;
+	char		buffer[ERROR_BUFSIZE];
 };
 
-static void persist_error_free(void *);
+static struct error *persist_error_slot(void);
 
 SET_DECLARE(drv_set, struct persist_driver);
-static GPrivate persist_last_error = G_PRIVATE_INIT(persist_error_free);
+static GPrivate persist_last_error = G_PRIVATE_INIT(g_free);
 
 const struct persist_driver *
 persist_find_driver(const char *name)
@@ -54,13 +62,18 @@ persist_find_driver(const char *name)
 	return (NULL);
 }
 
-static void
-persist_error_free(void *error)
+static struct error *
+persist_error_slot(void)
 {
-	struct error *err = error;
+	struct error *err;
 
-	g_free(err->message);
-	g_free(err);
+	err = g_private_get(&persist_last_error);
+	if (err == NULL) {
+		err = g_malloc0(sizeof(*err));
+		g_private_set(&persist_last_error, err);
+	}
+
+	return (err);
 }
 
 int
@@ -70,7 +83,7 @@ persist_get_last_error(const char **msgp)
 
 	err = g_private_get(&persist_last_error);
 
-	if (err != NULL) {
+	if (err != NULL && err->message != NULL) {
 		*msgp = err->message;
 		return (err->code);
 	}
@@ -84,13 +97,193 @@ persist_set_last_error(int code, const char *fmt, ...)
 {
 	va_list ap;
 	struct error *err;
+	char buffer[ERROR_BUFSIZE];
 
+	err = persist_error_slot();
+
+	/* Arguments may point to the previous message */
 	va_start(ap, fmt);
-	err = g_malloc0(sizeof(*err));
+	g_vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+
+	memcpy(err->buffer, buffer, sizeof(buffer));
 	err->code = code;
-	err->message = g_strdup_vprintf(fmt, ap);
+	err->message = err->buffer;
 	errno = code;
-	va_end(ap);
+}
+
+void
+persist_set_last_error_static(int code, const char *msg)
+{
+	struct error *err;
 
-	g_private_replace(&persist_last_error, err);
+	err = persist_error_slot();
+	err->code = code;
+	err->message = msg;
+	errno = code;
+}
+
+rpc_object_t
+persist_get_param(struct persist_db *db, const char *name)
+{
+
+	if (db->pdb_params == NULL ||
+	    rpc_get_type(db->pdb_params) != RPC_TYPE_DICTIONARY)
+		return (NULL);
+
+	return (rpc_dictionary_get_value(db->pdb_params, name));
+}
+
+int
+persist_get_param_int(struct persist_db *db, const char *name, int64_t def,
+    int64_t *result)
+{
+	rpc_object_t value;
+
+	*result = def;
+	value = persist_get_param(db, name);
+	if (value == NULL)
+		return (0);
+
+	switch (rpc_get_type(value)) {
+	case RPC_TYPE_INT64:
+		*result = rpc_int64_get_value(value);
+		return (0);
+
+	case RPC_TYPE_UINT64:
+		*result = (int64_t)rpc_uint64_get_value(value);
+		return (0);
+
+	default:
+		persist_set_last_error(EINVAL, "Invalid %s value", name);
+		return (-1);
+	}
+}
+
+const char *
+persist_get_param_string(struct persist_db *db, const char *name,
+    const char *def)
+{
+	const char *value;
+
+	if (db->pdb_params == NULL ||
+	    rpc_get_type(db->pdb_params) != RPC_TYPE_DICTIONARY)
+		return (def);
+
+	value = rpc_dictionary_get_string(db->pdb_params, name);
+	return (value != NULL ? value : def);
+}
+
+rpc_object_t
+persist_get_path(rpc_object_t obj, const char *path)
+{
+	g_auto(GStrv) parts = NULL;
+	rpc_object_t cur = obj;
+	char *end;
+	uint64_t idx;
+	size_t i;
+
+	parts = g_strsplit(path, ".", -1);
+
+	for (i = 0; parts[i] != NULL; i++) {
+		if (cur == NULL)
+			return (NULL);
+
+		switch (rpc_get_type(cur)) {
+		case RPC_TYPE_DICTIONARY:
+			cur = rpc_dictionary_get_value(cur, parts[i]);
+			break;
+
+		case RPC_TYPE_ARRAY:
+			idx = g_ascii_strtoull(parts[i], &end, 10);
+			if (*end != '\0' || end == parts[i])
+				return (NULL);
+
+			cur = rpc_array_get_value(cur, (size_t)idx);
+			break;
+
+		default:
+			return (NULL);
+		}
+	}
+
+	return (cur);
+}
+
+static bool
+persist_is_number(rpc_object_t obj)
+{
+
+	switch (rpc_get_type(obj)) {
+	case RPC_TYPE_INT64:
+	case RPC_TYPE_UINT64:
+	case RPC_TYPE_DOUBLE:
+		return (true);
+
+	default:
+		return (false);
+	}
+}
+
+static double
+persist_get_number(rpc_object_t obj)
+{
+
+	switch (rpc_get_type(obj)) {
+	case RPC_TYPE_INT64:
+		return ((double)rpc_int64_get_value(obj));
+
+	case RPC_TYPE_UINT64:
+		return ((double)rpc_uint64_get_value(obj));
+
+	case RPC_TYPE_DOUBLE:
+		return (rpc_double_get_value(obj));
+
+	default:
+		g_assert_not_reached();
+	}
+}
+
+int
+persist_compare(rpc_object_t o1, rpc_object_t o2)
+{
+	double d1, d2;
+	int64_t i1, i2;
+
+	if (persist_is_number(o1) && persist_is_number(o2)) {
+		if (rpc_get_type(o1) == RPC_TYPE_INT64 &&
+		    rpc_get_type(o2) == RPC_TYPE_INT64) {
+			i1 = rpc_int64_get_value(o1);
+			i2 = rpc_int64_get_value(o2);
+			return (i1 < i2 ? -1 : i1 > i2);
+		}
+
+		d1 = persist_get_number(o1);
+		d2 = persist_get_number(o2);
+		return (d1 < d2 ? -1 : d1 > d2);
+	}
+
+	if (rpc_get_type(o1) != rpc_get_type(o2))
+		return (rpc_get_type(o1) < rpc_get_type(o2) ? -1 : 1);
+
+	switch (rpc_get_type(o1)) {
+	case RPC_TYPE_NULL:
+		return (0);
+
+	case RPC_TYPE_BOOL:
+		return ((int)rpc_bool_get_value(o1) -
+		    (int)rpc_bool_get_value(o2));
+
+	case RPC_TYPE_DATE:
+		i1 = rpc_date_get_value(o1);
+		i2 = rpc_date_get_value(o2);
+		return (i1 < i2 ? -1 : i1 > i2);
+
+	case RPC_TYPE_STRING:
+		return (g_strcmp0(rpc_string_get_string_ptr(o1),
+		    rpc_string_get_string_ptr(o2)));
+
+	default:
+		return (rpc_equal(o1, o2) ? 0 : (o1 < o2 ? -1 : 1));
+	}
 }
@@ -25,6 +25,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <glib.h>
 #include <persist.h>
 
@@ -73,6 +74,49 @@ static GOptionEntry arguments[] = {
 	{ }
 };
 
+#ifdef __GLIBC__
+/*
+ * Count heap allocations made while scanning, so that regressions in
+ * the per-row decode path show up as a number rather than a hunch.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static volatile int counting;
+static uint64_t n_allocs;
+
+void *
+malloc(size_t size)
+{
+
+	if (counting)
+		__atomic_fetch_add(&n_allocs, 1, __ATOMIC_RELAXED);
+
+	return (__libc_malloc(size));
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+
+	if (counting)
+		__atomic_fetch_add(&n_allocs, 1, __ATOMIC_RELAXED);
+
+	return (__libc_calloc(nmemb, size));
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+
+	if (counting)
+		__atomic_fetch_add(&n_allocs, 1, __ATOMIC_RELAXED);
+
+	return (__libc_realloc(ptr, size));
+}
+#endif
+
 int main(int argc, char *argv[])
 {
 	GError *err = NULL;
@@ -154,6 +198,9 @@ int main(int argc, char *argv[])
 	}
 
 	start = g_get_monotonic_time();
+#ifdef __GLIBC__
+	counting = 1;
+#endif
 
 	for (;;) {
 		if (persist_iter_next(iter, &obj) != 0)
@@ -165,10 +212,16 @@ int main(int argc, char *argv[])
 		rpc_release(obj);
 	}
 
+#ifdef __GLIBC__
+	counting = 0;
+#endif
 	end = g_get_monotonic_time();
 	diff = ((double)end - (double)start) / 1000 / 1000;
 	printf("Total query time: %f seconds\n", diff);
 	printf("Avg number of rows returned per second: %f\n", n_inserts / diff);
+#ifdef __GLIBC__
+	printf("Allocations per row: %f\n", (double)n_allocs / n_inserts);
+#endif
 
 	return (0);
 }
@@ -24,6 +24,8 @@
 # POSSIBILITY OF SUCH DAMAGE.
 #
 
+import json
+import threading
 import pytest
 import librpc
 import persist
@@ -109,3 +111,111 @@ class TestCollection(object):
         col = db.get_collection('test', True)
         assert col is not None
         assert col.get('nonexistent') is None
+
+    def test_concurrent_get(self, db):
+        col = db.get_collection('concurrent', True)
+        for i in range(16):
+            col.set({'id': 'obj{0}'.format(i), 'value': i})
+
+        errors = []
+
+        def reader(n):
+            for _ in range(200):
+                for i in range(16):
+                    obj = col.get('obj{0}'.format(i))
+                    if obj is None or obj['value'] != i:
+                        errors.append((n, i, obj))
+
+        threads = [threading.Thread(target=reader, args=(n,)) for n in range(8)]
+        for t in threads:
+            t.start()
+
+        for t in threads:
+            t.join()
+
+        assert errors == []
+
+    def test_object_cache(self, db):
+        col = db.get_collection('cached', True)
+        col.set_cache_size(4)
+
+        for i in range(8):
+            col.set({'id': 'obj{0}'.format(i), 'value': i})
+
+        # A working set that fits is only read from the database once
+        before = db.get_stats()
+        for _ in range(3):
+            for i in range(4):
+                assert col.get('obj{0}'.format(i))['value'] == i
+
+        stats = db.get_stats()
+        hits = stats['object_cache_hits'] - before['object_cache_hits']
+        misses = stats['object_cache_misses'] - before['object_cache_misses']
+        assert (hits, misses) == (8, 4)
+
+        for i in range(8):
+            assert col.get('obj{0}'.format(i))['value'] == i
+
+        stats = db.get_stats()
+        entries = stats['object_cache_entries'] - \
+            before['object_cache_entries']
+        assert entries == 4
+
+        col.set({'id': 'obj0', 'value': 100})
+        assert col.get('obj0')['value'] == 100
+
+        col.delete('obj1')
+        assert col.get('obj1') is None
+
+        col.set_cache_size(0)
+        assert col.get('obj2')['value'] == 2
+
+    def test_exists(self, db):
+        col = db.get_collection('test', True)
+        col.set({'id': 'exists_obj', 'value': 1})
+        assert col.exists('exists_obj')
+        assert not col.exists('exists_nonexistent')
+
+        col.delete('exists_obj')
+        assert not col.exists('exists_obj')
+
+    def test_raw(self, db):
+        col = db.get_collection('raw', True)
+        col.set({'id': 'raw0', 'value': 'foo'})
+        col.set({'id': 'raw1', 'value': 'bar'})
+
+        data = col.get_raw('raw0')
+        assert json.loads(data.decode('utf-8'))['value'] == 'foo'
+        assert col.get_raw('raw_nonexistent') is None
+
+        rows = dict(col.query(raw=True))
+        assert sorted(rows.keys()) == ['raw0', 'raw1']
+        assert json.loads(rows['raw1'].decode('utf-8'))['value'] == 'bar'
+
+    def test_get_field(self, db):
+        col = db.get_collection('fields', True)
+        col.set({
+            'id': 'field0',
+            'name': 'foo',
+            'enabled': True,
+            'nested': {'list': [1, {'deep': 'bar'}]},
+            'ports': {'22': 'ssh'},
+            'say "hi"': 'quoted',
+            'back\\slash': 'escaped'
+        })
+
+        assert col.get_field('field0', 'name') == 'foo'
+        assert col.get_field('field0', 'enabled') is True
+        assert col.get_field('field0', 'nested.list.1.deep') == 'bar'
+        assert col.get_field('field0', 'nested') == {
+            'list': [1, {'deep': 'bar'}]
+        }
+        assert col.get_field('field0', 'ports.22') == 'ssh'
+        assert col.get_field('field0', 'say "hi"') == 'quoted'
+        assert col.get_field('field0', 'back\\slash') == 'escaped'
+        assert col.get_field('field0', 'nested.list.2') is None
+        assert col.get_field('field0', 'missing') is None
+        assert col.get_field('nonexistent', 'name') is None
+
+        col.set_cache_size(16)
+        assert col.get_field('field0', 'nested.list.0') == 1
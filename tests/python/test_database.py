@@ -24,6 +24,9 @@
 # POSSIBILITY OF SUCH DAMAGE.
 #
 
+import time
+import sqlite3
+import threading
 import pytest
 import librpc
 import persist
@@ -38,4 +41,260 @@ class TestDatabase(object):
         pass
 
     def test_open_readonly(self):
-        pass
\ No newline at end of file
+        pass
+
+    def test_stmt_cache_bounded(self, tmpdir):
+        path = str(tmpdir.join('stmt_cache.db'))
+        with persist.Database(path, 'sqlite', {'stmt_cache_size': 4}) as db:
+            for i in range(16):
+                col = db.get_collection('tenant{0}'.format(i), True)
+                col.set({'id': 'obj', 'value': i})
+                assert col.get('obj')['value'] == i
+
+            stats = db.get_stats()
+            assert stats['stmt_cache_size'] == 4
+            assert stats['stmt_cache_entries'] <= 4
+            assert stats['stmt_cache_evictions'] > 0
+            assert stats['stmt_cache_hits'] > 0
+
+        for size in ('4', -1):
+            with pytest.raises(persist.PersistException):
+                params = {'stmt_cache_size': size}
+                persist.Database(path, 'sqlite', params).open()
+
+    def test_single_table_storage(self, tmpdir):
+        path = str(tmpdir.join('single.db'))
+        params = {'storage': 'single-table'}
+        with persist.Database(path, 'sqlite', params) as db:
+            for i in range(100):
+                col = db.get_collection('tenant{0}'.format(i), True)
+                col.set({'id': 'a', 'kind': 'x', 'size': i})
+                col.set({'id': 'b', 'kind': 'y', 'size': i})
+
+            col = db.get_collection('tenant7')
+            assert col.count() == 2
+            assert [o['id'] for o in col.query([['kind', '=', 'y']])] == ['b']
+
+            db.remove_collection('tenant7')
+            assert not db.collection_exists('tenant7')
+            assert db.get_collection('tenant8').get('a')['size'] == 8
+
+        # Storage mode is picked up from the file when reopening
+        with persist.Database(path, 'sqlite') as db:
+            assert db.get_collection('tenant9').get('b')['size'] == 9
+
+    def test_collection_metadata(self, tmpdir):
+        path = str(tmpdir.join('metadata.db'))
+        with persist.Database(path, 'sqlite') as db:
+            db.create_collection('meta')
+            db.set_collection_metadata('meta', {'version': 2})
+            assert db.get_collection_metadata('meta') == {'version': 2}
+
+            db.remove_collection('meta')
+            assert not db.collection_exists('meta')
+
+            db.create_collection('meta')
+            assert db.get_collection_metadata('meta') == {}
+
+    def test_snapshot(self, tmpdir):
+        path = str(tmpdir.join('snapshot.db'))
+        with persist.Database(path, 'sqlite') as db:
+            col = db.get_collection('snap', True)
+            col.set({'id': 'a', 'value': 1})
+
+            with db.snapshot() as snap:
+                col.set({'id': 'a', 'value': 2})
+                col.set({'id': 'b', 'value': 3})
+
+                assert snap.get(col, 'a')['value'] == 1
+                assert snap.get(col, 'b') is None
+                assert snap.count(col) == 1
+                assert [o['id'] for o in snap.query(col)] == ['a']
+
+            with db.snapshot() as snap:
+                assert snap.get(col, 'a')['value'] == 2
+                assert snap.count(col) == 2
+
+            snaps = [db.snapshot() for _ in range(3)]
+
+        # Closing the database closes every snapshot left open
+        assert not any(snap.is_open for snap in snaps)
+
+    def test_nested_transactions(self, tmpdir):
+        path = str(tmpdir.join('nested.db'))
+        with persist.Database(path, 'sqlite') as db:
+            col = db.get_collection('nested', True)
+
+            db.start_transaction()
+            col.set({'id': 'outer', 'value': 1})
+
+            # The transaction belongs to this thread
+            errors = []
+
+            def foreign():
+                for op in (db.start_transaction, db.commit_transaction):
+                    try:
+                        op()
+                    except persist.PersistException as err:
+                        errors.append(err)
+
+            thread = threading.Thread(target=foreign)
+            thread.start()
+            thread.join()
+            assert len(errors) == 2
+
+            db.start_transaction()
+            col.set({'id': 'inner', 'value': 2})
+            db.rollback_transaction()
+
+            db.start_transaction()
+            col.set({'id': 'kept', 'value': 3})
+            db.commit_transaction()
+
+            assert db.transaction_active
+            db.commit_transaction()
+            assert not db.transaction_active
+
+            assert col.get('outer')['value'] == 1
+            assert col.get('inner') is None
+            assert col.get('kept')['value'] == 3
+
+            with pytest.raises(persist.PersistException):
+                db.commit_transaction()
+
+    def test_durability(self, tmpdir):
+        for mode in ('full', 'normal', 'off', 'periodic'):
+            path = str(tmpdir.join('durability-{0}.db'.format(mode)))
+            params = {'durability': mode, 'durability_interval': 10}
+            with persist.Database(path, 'sqlite', params) as db:
+                col = db.get_collection('durable', True)
+                col.set({'id': 'a', 'value': mode})
+
+                db.start_transaction(durability='off')
+                col.set({'id': 'b', 'value': mode})
+                db.commit_transaction()
+
+                assert col.get('b')['value'] == mode
+
+        with pytest.raises(persist.PersistException):
+            path = str(tmpdir.join('durability-invalid.db'))
+            persist.Database(path, 'sqlite', {'durability': 'maybe'}).open()
+
+    def test_tuning_params(self, tmpdir):
+        path = str(tmpdir.join('tuning.db'))
+        params = {
+            'page_size': 8192,
+            'cache_size': -4000,
+            'mmap_size': 1 << 20,
+            'temp_store': 'memory',
+            'wal_autocheckpoint': 100,
+            'journal_size_limit': 1 << 20,
+            'lookaside': 64
+        }
+
+        with persist.Database(path, 'sqlite', params) as db:
+            col = db.get_collection('tuned', True)
+            col.set({'id': 'a', 'value': 1})
+            assert col.get('a')['value'] == 1
+
+        conn = sqlite3.connect(path)
+        assert conn.execute('PRAGMA page_size').fetchone()[0] == 8192
+        conn.close()
+
+        invalid = (
+            {'temp_store': 'disk'},
+            {'temp_store': 2},
+            {'cache_size': 'big'},
+            {'lookaside': 16, 'lookaside_slot_size': '64'},
+            {'durability': 'periodic', 'durability_interval': 1.5},
+            {'checkpoint': 'background', 'checkpoint_interval': '10'},
+            {'checkpoint': 'background', 'checkpoint_limit': None}
+        )
+        for params in invalid:
+            with pytest.raises(persist.PersistException):
+                persist.Database(path, 'sqlite', params).open()
+
+    def test_background_checkpoint(self, tmpdir):
+        path = str(tmpdir.join('checkpoint.db'))
+        params = {
+            'checkpoint': 'background',
+            'checkpoint_interval': 10,
+            'checkpoint_limit': 10
+        }
+
+        with persist.Database(path, 'sqlite', params) as db:
+            col = db.get_collection('logged', True)
+            for i in range(100):
+                col.set({'id': str(i), 'value': i})
+
+            for _ in range(200):
+                stats = db.get_stats()
+                escalated = stats['checkpoint_restart'] + \
+                    stats['checkpoint_truncate']
+                if escalated > 0:
+                    break
+
+                time.sleep(0.01)
+
+            assert stats['checkpoint_frames'] > 0
+            assert escalated > 0
+            assert col.get('99')['value'] == 99
+
+        with pytest.raises(persist.PersistException):
+            path = str(tmpdir.join('checkpoint-invalid.db'))
+            persist.Database(path, 'sqlite', {'checkpoint': 'never'}).open()
+
+    def test_checkpoint_doesnt_block_writers(self, tmpdir):
+        path = str(tmpdir.join('checkpoint-writers.db'))
+        params = {
+            'durability': 'off',
+            'checkpoint': 'background',
+            'checkpoint_interval': 100,
+            'checkpoint_limit': 1 << 30
+        }
+
+        with persist.Database(path, 'sqlite', params) as db:
+            col = db.get_collection('bulk', True)
+            blob = 'x' * 2048
+            db.start_transaction()
+            col.insert_many([
+                {'id': str(i), 'value': blob} for i in range(20000)
+            ])
+            db.commit_transaction()
+
+            # Keep committing while the thread copies the log back
+            latencies = []
+            deadline = time.monotonic() + 10
+            while time.monotonic() < deadline:
+                start = time.monotonic()
+                col.set({'id': 'small', 'value': len(latencies)})
+                latencies.append(time.monotonic() - start)
+                stats = db.get_stats()
+                if stats['checkpoint_frames'] >= 10000:
+                    break
+
+            assert stats['checkpoint_frames'] >= 10000
+            assert max(latencies) * 1e6 < stats['checkpoint_time'] / 2
+
+    def test_backup(self, tmpdir):
+        path = str(tmpdir.join('source.db'))
+        dest = str(tmpdir.join('backup.db'))
+        progress = []
+
+        with persist.Database(path, 'sqlite') as db:
+            col = db.get_collection('backed', True)
+            col.insert_many([{'id': str(i), 'value': i} for i in range(1000)])
+
+            db.backup(dest, lambda remaining, total: progress.append(
+                (remaining, total)))
+
+            with pytest.raises(persist.PersistException):
+                db.backup(str(tmpdir.join('aborted.db')), lambda r, t: False)
+
+        assert progress[-1][0] == 0
+        assert progress[-1][1] > 0
+
+        with persist.Database(dest, 'sqlite') as db:
+            col = db.get_collection('backed')
+            assert col.count() == 1000
+            assert col.get('999')['value'] == 999
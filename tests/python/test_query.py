@@ -23,3 +23,320 @@
 # IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 # POSSIBILITY OF SUCH DAMAGE.
 #
+
+import sqlite3
+import threading
+import pytest
+import persist
+
+
+AGGREGATE_OBJS = [
+    {'id': 'agg1', 'kind': 'a', 'size': 1},
+    {'id': 'agg2', 'kind': 'a', 'size': 5},
+    {'id': 'agg3', 'kind': 'b', 'size': 10},
+]
+
+
+class TestAggregate(object):
+    def test_aggregate(self, db):
+        col = db.get_collection('aggregate', True)
+        for obj in AGGREGATE_OBJS:
+            col.set(obj)
+
+        result = col.aggregate({
+            'n': ['count'],
+            'total': ['sum', 'size'],
+            'smallest': ['min', 'size'],
+            'largest': ['max', 'size']
+        })
+
+        assert result == [{'n': 3, 'total': 16, 'smallest': 1, 'largest': 10}]
+
+    def test_aggregate_group_by(self, db):
+        col = db.get_collection('aggregate', True)
+        result = col.aggregate(
+            {'n': ['count'], 'total': ['sum', 'size']},
+            group_by=['kind']
+        )
+
+        result = sorted(result, key=lambda r: r['kind'])
+        assert result == [
+            {'kind': 'a', 'n': 2, 'total': 6},
+            {'kind': 'b', 'n': 1, 'total': 10}
+        ]
+
+    def test_aggregate_invalid(self, db):
+        col = db.get_collection('aggregate', True)
+        with pytest.raises(persist.PersistException):
+            col.aggregate({'n': ['median', 'size']})
+
+
+class TestDistinct(object):
+    def test_distinct(self, db):
+        col = db.get_collection('aggregate', True)
+        for obj in AGGREGATE_OBJS:
+            col.set(obj)
+
+        result = col.distinct('kind')
+        assert result == [
+            {'value': 'a', 'count': 2},
+            {'value': 'b', 'count': 1}
+        ]
+
+    def test_distinct_limit(self, db):
+        col = db.get_collection('aggregate', True)
+        result = col.distinct('kind', limit=1)
+        assert result == [{'value': 'a', 'count': 2}]
+
+
+class TestOperators(object):
+    def test_regex(self, db):
+        col = db.get_collection('operators', True)
+        col.set({'id': 'regex1', 'name': 'disk0 failed'})
+        col.set({'id': 'regex2', 'name': 'disk1 ok'})
+
+        result = list(col.query([['name', '~', r'^disk\d fail']]))
+        assert [r['id'] for r in result] == ['regex1']
+
+    def test_invalid_regex(self, db):
+        col = db.get_collection('operators', True)
+        with pytest.raises(persist.PersistException):
+            list(col.query([['name', '~', '(unbalanced']]))
+
+    def test_contains(self, db):
+        col = db.get_collection('operators', True)
+        col.set({'id': 'tags1', 'tags': ['red', 'green']})
+        col.set({'id': 'tags2', 'tags': ['blue']})
+
+        result = list(col.query([['tags', 'contains', 'green']]))
+        assert [r['id'] for r in result] == ['tags1']
+
+    def test_in(self, db):
+        col = db.get_collection('operators', True)
+        col.set({'id': 'in1', 'size': 1})
+        col.set({'id': 'in2', 'size': 2})
+        col.set({'id': 'in3', 'size': 3})
+
+        result = list(col.query([['size', 'in', [1, 3]]], sort='size'))
+        assert [r['id'] for r in result] == ['in1', 'in3']
+
+
+class TestLogic(object):
+    def setup_objects(self, db):
+        col = db.get_collection('logic', True)
+        col.set({'id': 'logic1', 'size': 1, 'kind': 'a'})
+        col.set({'id': 'logic2', 'size': 2, 'kind': 'b'})
+        col.set({'id': 'logic3', 'size': 3, 'kind': 'a'})
+        return col
+
+    def ids(self, col, rules):
+        return [r['id'] for r in col.query(rules, sort='size')]
+
+    def test_or(self, db):
+        col = self.setup_objects(db)
+        rules = [['or', [['size', '=', 1], ['size', '=', 3]]]]
+        assert self.ids(col, rules) == ['logic1', 'logic3']
+
+    def test_or_mixed(self, db):
+        col = self.setup_objects(db)
+        rules = [['or', [
+            ['size', '=', 1],
+            ['kind', '=', 'b'],
+            ['size', 'in', [3]]
+        ]]]
+        assert self.ids(col, rules) == ['logic1', 'logic2', 'logic3']
+
+    def test_nor(self, db):
+        col = self.setup_objects(db)
+        rules = [['nor', [['size', '=', 1], ['kind', '=', 'b']]]]
+        assert self.ids(col, rules) == ['logic3']
+
+    def test_nested(self, db):
+        col = self.setup_objects(db)
+        rules = [
+            ['and', []],
+            ['and', [['kind', '=', 'a'], ['and', [['size', '>', 1]]]]]
+        ]
+        assert self.ids(col, rules) == ['logic3']
+
+    def test_empty_or(self, db):
+        col = self.setup_objects(db)
+        assert self.ids(col, [['or', []]]) == []
+
+
+class TestProjection(object):
+    def test_fields(self, db):
+        col = db.get_collection('projection', True)
+        col.set({
+            'id': 'proj1',
+            'name': 'disk\\"0',
+            'meta': {'size': 10, 'tags': ['a', 'b']},
+            'blob': 'x' * 4096
+        })
+
+        result = list(col.query(
+            [['id', '=', 'proj1']],
+            fields=['name', 'meta.size', 'meta.tags.1', 'missing']
+        ))
+
+        assert result == [{
+            'id': 'proj1',
+            'name': 'disk\\"0',
+            'meta.size': 10,
+            'meta.tags.1': 'b'
+        }]
+
+
+class TestPrefetch(object):
+    def test_prefetch(self, db):
+        col = db.get_collection('prefetch', True)
+        for i in range(100):
+            col.set({'id': 'pf{0:03d}'.format(i), 'value': i})
+
+        expected = list(col.query(sort='value'))
+        assert len(expected) == 100
+
+        for threads in (0, 3):
+            result = list(col.query(
+                sort='value',
+                prefetch=8,
+                decode_threads=threads
+            ))
+            assert result == expected
+
+    def test_prefetch_close_early(self, db):
+        col = db.get_collection('prefetch', True)
+        it = col.query(prefetch=4, decode_threads=2)
+        assert next(it)['id'].startswith('pf')
+        it.close()
+
+
+class TestParallel(object):
+    def test_parallel(self, tmpdir):
+        path = str(tmpdir.join('parallel.db'))
+        with persist.Database(path, 'sqlite') as db:
+            col = db.get_collection('parallel', True)
+            for i in range(200):
+                col.set({'id': 'par{0:03d}'.format(i), 'value': i % 50})
+
+            result = col.query_parallel(threads=4)
+            assert sorted(o['id'] for o in result) == \
+                sorted(o['id'] for o in col.query())
+
+            rules = [['value', '<', 10]]
+            result = col.query_parallel(rules, threads=3, sort='value')
+            assert [o['value'] for o in result] == \
+                [o['value'] for o in col.query(rules, sort='value')]
+
+            params = {
+                'sort': 'value',
+                'descending': True,
+                'offset': 5,
+                'limit': 10
+            }
+            result = col.query_parallel(threads=4, **params)
+            assert [o['value'] for o in result] == \
+                [o['value'] for o in col.query(**params)]
+
+    def test_parallel_consistent(self, tmpdir):
+        path = str(tmpdir.join('parallel-consistent.db'))
+        with persist.Database(path, 'sqlite') as db:
+            col = db.get_collection('pinned', True)
+            for i in range(200):
+                col.set({'id': 'pin{0:03d}'.format(i), 'value': 0})
+
+            # The first and last objects live in different partitions
+            stop = threading.Event()
+
+            def writer():
+                n = 0
+                while not stop.is_set():
+                    n += 1
+                    db.start_transaction()
+                    col.set({'id': 'pin000', 'value': n})
+                    col.set({'id': 'pin199', 'value': n})
+                    db.commit_transaction()
+
+            thread = threading.Thread(target=writer)
+            thread.start()
+            try:
+                for _ in range(20):
+                    result = {
+                        o['id']: o['value']
+                        for o in col.query_parallel(threads=4)
+                    }
+                    assert len(result) == 200
+                    assert result['pin000'] == result['pin199']
+            finally:
+                stop.set()
+                thread.join()
+
+
+class TestIndexes(object):
+    def test_fulltext(self, tmpdir):
+        path = str(tmpdir.join('fulltext.db'))
+        with persist.Database(path, 'sqlite') as db:
+            col = db.get_collection('docs', True)
+            col.set({'id': 'doc1', 'text': 'disk failure on node one'})
+            col.set({'id': 'doc2', 'text': 'network is fine'})
+
+            def search(term):
+                rules = [['text', 'search', term]]
+                return sorted(o['id'] for o in col.query(rules))
+
+            with pytest.raises(persist.PersistException):
+                search('disk')
+
+            # Existing objects get indexed when the index is created
+            col.add_index('text', 'text', 'fulltext')
+            assert search('disk') == ['doc1']
+
+            col.set({'id': 'doc3', 'text': 'another disk died'})
+            col.set({'id': 'doc1', 'text': 'replaced, all good'})
+            assert search('disk') == ['doc3']
+            assert search('good') == ['doc1']
+
+            col.delete('doc3')
+            assert search('disk') == []
+            assert search('network') == ['doc2']
+
+            col.drop_index('text')
+            with pytest.raises(persist.PersistException):
+                search('network')
+
+        conn = sqlite3.connect(path)
+        leftovers = conn.execute(
+            "SELECT name FROM sqlite_master WHERE name LIKE 'docs_text%'"
+        ).fetchall()
+        conn.close()
+        assert leftovers == []
+
+    def test_array(self, tmpdir):
+        path = str(tmpdir.join('array.db'))
+        with persist.Database(path, 'sqlite') as db:
+            col = db.get_collection('tagged', True)
+            col.set({'id': 'arr1', 'tags': ['red', 'green']})
+            col.set({'id': 'arr2', 'tags': ['blue']})
+
+            def contains(tag):
+                rules = [['tags', 'contains', tag]]
+                return sorted(o['id'] for o in col.query(rules))
+
+            # Existing objects get indexed when the index is created
+            col.add_index('tags', 'tags', 'array')
+            assert contains('green') == ['arr1']
+
+            col.set({'id': 'arr3', 'tags': ['green', 'blue']})
+            col.set({'id': 'arr1', 'tags': ['red']})
+            assert contains('green') == ['arr3']
+            assert contains('blue') == ['arr2', 'arr3']
+            assert contains('red') == ['arr1']
+
+            col.delete('arr3')
+            assert contains('green') == []
+            assert contains('blue') == ['arr2']
+
+        conn = sqlite3.connect(path)
+        rows = conn.execute('SELECT value, id FROM tagged_tags').fetchall()
+        conn.close()
+        assert sorted(rows) == [('"blue"', 'arr2'), ('"red"', 'arr1')]
@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <glib.h>
 #include <rpc/rpc.h>
@@ -41,10 +42,12 @@
     "  get COLLECTION ID\n"						\
     "  insert COLLECTION ID\n"						\
     "  delete COLLECTION ID\n"						\
-    "  add-index COLLECTION NAME PATH\n"				\
-    "  drop-index COLLECTION NAME\n"
+    "  add-index COLLECTION NAME PATH [value|fulltext|array]\n"		\
+    "  drop-index COLLECTION NAME\n"					\
+    "  backup PATH\n"
 
 static int open_db(const char *, const char *);
+static rpc_object_t parse_params(void);
 static int print_object(rpc_object_t);
 static rpc_object_t ingest_object(void);
 static int cmd_list(int, char *[]);
@@ -56,11 +59,13 @@ static int cmd_insert(int, char *[]);
 static int cmd_delete(int, char *[]);
 static int cmd_add_index(int, char *[]);
 static int cmd_drop_index(int, char *[]);
+static int cmd_backup(int, char *[]);
 static void usage(GOptionContext *);
 
 static const char *file;
 static const char *format = "native";
 static const char *driver = "sqlite";
+static char **params;
 static char **args;
 static persist_db_t db;
 static GOptionContext *context;
@@ -78,6 +83,7 @@ static struct {
 	{ "delete", cmd_delete },
 	{ "add-index", cmd_add_index },
 	{ "drop-index", cmd_drop_index },
+	{ "backup", cmd_backup },
 	{ }
 };
 
@@ -85,6 +91,7 @@ static const GOptionEntry options[] = {
 	{ "file", 'f', 0, G_OPTION_ARG_STRING, &file, "Database path", "FILE" },
 	{ "format", 't', 0, G_OPTION_ARG_STRING, &format, "Input/output format", "FORMAT" },
 	{ "driver", 'd', 0, G_OPTION_ARG_STRING, &driver, "Driver", "DRIVER" },
+	{ "param", 'p', 0, G_OPTION_ARG_STRING_ARRAY, &params, "Driver setting", "KEY=VALUE" },
 	{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &args, "", NULL },
 	{ }
 };
@@ -92,9 +99,19 @@ static const GOptionEntry options[] = {
 static int
 open_db(const char *filename, const char *driver)
 {
+	rpc_object_t dict = NULL;
 	const char *errmsg;
 
-	db = persist_open(filename, driver, NULL);
+	if (params != NULL) {
+		dict = parse_params();
+		if (dict == NULL)
+			return (-1);
+	}
+
+	db = persist_open(filename, driver, dict);
+	if (dict != NULL)
+		rpc_release(dict);
+
 	if (db == NULL) {
 		persist_get_last_error(&errmsg);
 		fprintf(stderr, "Cannot open database: %s\n", errmsg);
@@ -104,6 +121,36 @@ open_db(const char *filename, const char *driver)
 	return (0);
 }
 
+static rpc_object_t
+parse_params(void)
+{
+	rpc_object_t result;
+	gint64 num;
+	char *value;
+	char **p;
+
+	result = rpc_dictionary_create();
+
+	for (p = params; *p != NULL; p++) {
+		value = strchr(*p, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Invalid parameter: %s\n", *p);
+			rpc_release(result);
+			return (NULL);
+		}
+
+		/* Numeric values are passed as integers, anything else as is */
+		*value++ = '\0';
+		if (g_ascii_string_to_signed(value, 10, G_MININT64, G_MAXINT64,
+		    &num, NULL))
+			rpc_dictionary_set_int64(result, *p, num);
+		else
+			rpc_dictionary_set_string(result, *p, value);
+	}
+
+	return (result);
+}
+
 static rpc_object_t
 ingest_object(void)
 {
@@ -422,6 +469,7 @@ static int
 cmd_add_index(int argc, char *argv[])
 {
 	persist_collection_t col;
+	persist_index_type_t type = PERSIST_INDEX_VALUE;
 	const char *errmsg;
 
 	if (argc < 3) {
@@ -429,13 +477,24 @@ cmd_add_index(int argc, char *argv[])
 		return (1);
 	}
 
+	if (argc > 3) {
+		if (g_strcmp0(argv[3], "fulltext") == 0)
+			type = PERSIST_INDEX_FULLTEXT;
+		else if (g_strcmp0(argv[3], "array") == 0)
+			type = PERSIST_INDEX_ARRAY;
+		else if (g_strcmp0(argv[3], "value") != 0) {
+			fprintf(stderr, "invalid index type: %s\n", argv[3]);
+			return (1);
+		}
+	}
+
 	col = persist_collection_get(db, argv[0], false);
 	if (col == NULL) {
 		persist_get_last_error(&errmsg);
 		fprintf(stderr, "cannot get collection: %s\n", errmsg);
 	}
 
-	if (persist_add_index(col, argv[1], argv[2]) < 0) {
+	if (persist_add_index_ex(col, argv[1], argv[2], type) < 0) {
 		persist_get_last_error(&errmsg);
 		fprintf(stderr, "cannot add index: %s\n", errmsg);
 	}
@@ -468,6 +527,34 @@ cmd_drop_index(int argc, char *argv[])
 	return (0);
 }
 
+static int
+cmd_backup(int argc, char *argv[])
+{
+	const char *errmsg;
+	int ret;
+
+	if (argc < 1) {
+		usage(NULL);
+		return (1);
+	}
+
+	ret = persist_backup(db, argv[0], ^(size_t remaining, size_t total) {
+		fprintf(stderr, "\r%zu/%zu pages copied", total - remaining,
+		    total);
+		return ((bool)true);
+	});
+
+	fprintf(stderr, "\n");
+
+	if (ret < 0) {
+		persist_get_last_error(&errmsg);
+		fprintf(stderr, "cannot back up database: %s\n", errmsg);
+		return (1);
+	}
+
+	return (0);
+}
+
 static void
 usage(GOptionContext *ctx)
 {